@@ -0,0 +1,292 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "atomic_write.h"
+
+/// @brief File linked under temporary name and waiting for batch sync
+struct PendingRename {
+    int dir_fd;
+    char tmp_name[NAME_MAX + 1];
+    char *name;
+    char *path;         ///< destination path for messages
+    bool replace;
+    int sync_errno;     ///< result of last syncfs of file system of this file
+    bool renamed;
+};
+
+/// @brief Files of all copy threads waiting for next syncfs
+static struct {
+    pthread_mutex_t mtx;
+    PendingRename *files;
+    int count;
+    int capacity;
+    bool failed;        ///< some postponed file was not moved into place
+} pending = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, false};
+
+static int tmp_counter = 0;
+
+static int openTmpName(int dir_fd, const char *name, mode_t mode, char *tmp_name);
+
+static int linkTmpName(int fd, int dir_fd, const char *name, char *tmp_name);
+
+static int moveIntoPlace(int dir_fd, const char *tmp_name, const char *name, bool replace);
+
+static CpErr commitError(int move_errno);
+
+static void syncPending(int idx, bool renamed);
+
+static void flushPending();
+
+/// @brief Create hidden .name.cpcp-pid-N file next to destination, name is stored in tmp_name
+static int openTmpName(int dir_fd, const char *name, mode_t mode, char *tmp_name) {
+    while (true) {
+        int counter = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+        int len = snprintf(tmp_name, NAME_MAX + 1, ".%s.cpcp-%d-%d", name, (int) getpid(), counter);
+        if (len < 0 || len > NAME_MAX) {
+            snprintf(tmp_name, NAME_MAX + 1, ".cpcp-%d-%d", (int) getpid(), counter);
+        }
+
+        int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        if (fd >= 0 || errno != EEXIST) return fd;
+    }
+}
+
+/// @brief Give unnamed O_TMPFILE fd a temporary name in dir_fd
+static int linkTmpName(int fd, int dir_fd, const char *name, char *tmp_name) {
+    // AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc link works for everyone
+    char proc_path[64] = "";
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+
+    while (true) {
+        int counter = __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED);
+        int len = snprintf(tmp_name, NAME_MAX + 1, ".%s.cpcp-%d-%d", name, (int) getpid(), counter);
+        if (len < 0 || len > NAME_MAX) {
+            snprintf(tmp_name, NAME_MAX + 1, ".cpcp-%d-%d", (int) getpid(), counter);
+        }
+
+        if (linkat(AT_FDCWD, proc_path, dir_fd, tmp_name, AT_SYMLINK_FOLLOW) == 0) return 0;
+        if (errno != EEXIST) {
+            tmp_name[0] = '\0';
+            return -1;
+        }
+    }
+}
+
+/// @brief Atomic rename; without replace existing destination is kept and EEXIST returned
+static int moveIntoPlace(int dir_fd, const char *tmp_name, const char *name, bool replace) {
+    int code = renameat2(dir_fd, tmp_name, dir_fd, name, (replace) ? 0 : RENAME_NOREPLACE);
+    if (code < 0 && !replace && errno == EINVAL) {
+        // filesystem without RENAME_NOREPLACE: link fails on existing name just as well
+        code = linkat(dir_fd, tmp_name, dir_fd, name, 0);
+        if (code == 0) unlinkat(dir_fd, tmp_name, 0);
+    }
+
+    return code;
+}
+
+static CpErr commitError(int move_errno) {
+    if (move_errno == EEXIST) return {CP_ERROR::DST_REWRITE, 0};
+    return {CP_ERROR::DST_COMMIT, move_errno};
+}
+
+/// @brief syncfs of dir_fd file system, once per file system among files with the same renamed state;
+/// error is stored in sync_errno
+static void syncPending(int idx, bool renamed) {
+    PendingRename *file = &pending.files[idx];
+    struct stat dir_info = {}, prev_info = {};
+    fstat(file->dir_fd, &dir_info);
+    for (int prev = 0; prev < idx; prev++) {
+        if (pending.files[prev].renamed != renamed) continue;
+        if (fstat(pending.files[prev].dir_fd, &prev_info) == 0 && prev_info.st_dev == dir_info.st_dev) {
+            file->sync_errno = pending.files[prev].sync_errno;
+            return;
+        }
+    }
+
+    file->sync_errno = (syncfs(file->dir_fd) < 0) ? errno : 0;
+}
+
+/// @brief syncfs every filesystem of pending files, rename them, then syncfs again for directory entries
+/// Files whose data couldn't be synced (i.e. writeback error) are never renamed into place.
+/// Called with pending.mtx locked
+static void flushPending() {
+    for (int idx = 0; idx < pending.count; idx++) {
+        pending.files[idx].renamed = false;
+        syncPending(idx, false);
+    }
+
+    for (int idx = 0; idx < pending.count; idx++) {
+        PendingRename *file = &pending.files[idx];
+        if (file->sync_errno != 0) {
+            ERRPRINTF("Can't sync '%s':%s\n", file->path, strerror(file->sync_errno));
+            unlinkat(file->dir_fd, file->tmp_name, 0);
+            pending.failed = true;
+        } else if (moveIntoPlace(file->dir_fd, file->tmp_name, file->name, file->replace) < 0) {
+            if (errno == EEXIST) printf("Already exists: '%s'\n", file->path);
+            else ERRPRINTF("Can't move '%s' into place:%s\n", file->path, strerror(errno));
+            unlinkat(file->dir_fd, file->tmp_name, 0);
+            pending.failed = true;
+        } else {
+            file->renamed = true; // its directory entry is synced below
+        }
+    }
+
+    for (int idx = 0; idx < pending.count; idx++) {
+        PendingRename *file = &pending.files[idx];
+        if (!file->renamed) continue;
+        syncPending(idx, true);
+        if (file->sync_errno != 0) {
+            ERRPRINTF("Can't sync '%s':%s\n", file->path, strerror(file->sync_errno));
+            pending.failed = true;
+        }
+    }
+
+    for (int idx = 0; idx < pending.count; idx++) {
+        close(pending.files[idx].dir_fd);
+        free(pending.files[idx].name);
+        free(pending.files[idx].path);
+    }
+    pending.count = 0;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+int openAtomicDst(int dst_dirfd, const char *dst_name, mode_t mode, AtomicDst *atomic) {
+    assert(dst_name); assert(atomic);
+    atomic->tmp_name[0] = '\0';
+
+    const char *slash = strrchr(dst_name, '/');
+    atomic->name = (slash) ? slash + 1 : dst_name;
+    if (slash) {
+        size_t dir_len = (slash == dst_name) ? 1 : (size_t)(slash - dst_name);
+        char *dir = strndup(dst_name, dir_len);
+        if (!dir) return -1;
+        atomic->dir_fd = openat(dst_dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(dir);
+    } else {
+        atomic->dir_fd = openat(dst_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (atomic->dir_fd < 0) return -1;
+
+    int fd = openat(atomic->dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        fd = openTmpName(atomic->dir_fd, atomic->name, mode, atomic->tmp_name);
+    }
+    if (fd < 0) {
+        int open_errno = errno;
+        close(atomic->dir_fd);
+        atomic->dir_fd = -1;
+        errno = open_errno;
+    }
+
+    return fd;
+}
+
+CpErr commitAtomicDst(int fd, AtomicDst *atomic, bool replace, const char *dst_path,
+                      const struct copy_flags *flags) {
+    assert(atomic); assert(dst_path); assert(flags);
+
+    if (flags->sync_every == 1 && fdatasync(fd) < 0) {
+        CpErr status = {CP_ERROR::DST_WRITE, errno};
+        abortAtomicDst(atomic);
+        return status;
+    }
+
+    bool postpone = flags->sync_every > 1;
+    if (!atomic->tmp_name[0]) {
+        // new file without batching can get its final name directly
+        if (!replace && !postpone) {
+            char proc_path[64] = "";
+            snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+            int code = linkat(AT_FDCWD, proc_path, atomic->dir_fd, atomic->name, AT_SYMLINK_FOLLOW);
+            int link_errno = errno;
+            abortAtomicDst(atomic);
+            return (code == 0) ? CpErr{CP_ERROR::SUCCESS, 0} : commitError(link_errno);
+        }
+
+        if (linkTmpName(fd, atomic->dir_fd, atomic->name, atomic->tmp_name) < 0) {
+            CpErr status = commitError(errno);
+            abortAtomicDst(atomic);
+            return status;
+        }
+    }
+
+    if (!postpone) {
+        CpErr status = {CP_ERROR::SUCCESS, 0};
+        if (moveIntoPlace(atomic->dir_fd, atomic->tmp_name, atomic->name, replace) < 0) {
+            status = commitError(errno);
+        } else {
+            atomic->tmp_name[0] = '\0';
+        }
+        abortAtomicDst(atomic);
+        return status;
+    }
+
+    char *name = strdup(atomic->name);
+    char *path = strdup(dst_path);
+    if (!name || !path) {
+        free(name);
+        free(path);
+        abortAtomicDst(atomic);
+        return {CP_ERROR::DST_COMMIT, ENOMEM};
+    }
+
+    pthread_mutex_lock(&pending.mtx);
+    if (pending.count == pending.capacity) {
+        int capacity = (pending.capacity) ? 2 * pending.capacity : flags->sync_every;
+        PendingRename *files = (PendingRename *) realloc(pending.files, capacity * sizeof(PendingRename));
+        if (!files) {
+            pthread_mutex_unlock(&pending.mtx);
+            free(name);
+            free(path);
+            abortAtomicDst(atomic);
+            return {CP_ERROR::DST_COMMIT, ENOMEM};
+        }
+        pending.files = files;
+        pending.capacity = capacity;
+    }
+
+    // descriptor and temporary name are handed over to batch
+    PendingRename *file = &pending.files[pending.count++];
+    file->dir_fd = atomic->dir_fd;
+    memcpy(file->tmp_name, atomic->tmp_name, sizeof(file->tmp_name));
+    file->name = name;
+    file->path = path;
+    file->replace = replace;
+    atomic->dir_fd = -1;
+    atomic->tmp_name[0] = '\0';
+
+    // failures of batch are reported by flush itself, they don't belong to this file
+    if (pending.count >= flags->sync_every) flushPending();
+    pthread_mutex_unlock(&pending.mtx);
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+void abortAtomicDst(AtomicDst *atomic) {
+    assert(atomic);
+    if (atomic->dir_fd < 0) return;
+
+    if (atomic->tmp_name[0]) unlinkat(atomic->dir_fd, atomic->tmp_name, 0);
+    atomic->tmp_name[0] = '\0';
+    close(atomic->dir_fd);
+    atomic->dir_fd = -1;
+}
+
+bool flushAtomicWrites() {
+    pthread_mutex_lock(&pending.mtx);
+    flushPending();
+    bool success = !pending.failed;
+    free(pending.files);
+    pending.files = NULL;
+    pending.capacity = 0;
+    pthread_mutex_unlock(&pending.mtx);
+
+    return success;
+}
@@ -0,0 +1,37 @@
+#ifndef ATOMIC_WRITE_H
+#define ATOMIC_WRITE_H
+
+#include <sys/types.h>
+#include <limits.h>
+
+#include "file_copy.h"
+
+const int DEFAULT_SYNC_EVERY = 64;  ///< files made durable by one syncfs with --atomic
+
+/// @brief Destination which becomes visible under its name only after successful copy
+struct AtomicDst {
+    int dir_fd;                     ///< directory of destination
+    const char *name;               ///< final name inside dir_fd
+    char tmp_name[NAME_MAX + 1];    ///< temporary name, empty while file is unnamed O_TMPFILE
+};
+
+/// @brief Open unnamed O_TMPFILE (or hidden temporary file if not supported) in directory of dst_name
+/// Returns file descriptor or -1 with errno set
+int openAtomicDst(int dst_dirfd, const char *dst_name, mode_t mode, AtomicDst *atomic);
+
+/// @brief Move copied file fd into place; replace allows overwriting existing destination
+/// With flags->sync_every == 1 data is synced right here; with N > 1 file gets temporary name
+/// and rename is postponed until N files are pending, all of them are made durable by one syncfs.
+/// With 0 file is renamed without sync. dst_path is used only for messages
+CpErr commitAtomicDst(int fd, AtomicDst *atomic, bool replace, const char *dst_path,
+                      const struct copy_flags *flags);
+
+/// @brief Remove temporary file after failed copy
+void abortAtomicDst(AtomicDst *atomic);
+
+/// @brief Sync and rename all postponed files; errors are printed. Returns false if some postponed file
+/// was not moved into place during whole run. May be called more than once, copyTree flushes before
+/// it fixes up directories
+bool flushAtomicWrites();
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+
+/* Benchmark of cpcp engines: generates file sets, copies them with every engine
+   and prints one CSV line per run */
+
+const int BENCH_PATH_LEN = 512;
+const size_t GEN_BLOCK = 1 << 20;
+
+/// @brief Set of source files generated once and copied by every run
+struct FileSet {
+    const char *name;
+    int files;
+    size_t file_size;
+    size_t data_every;      ///< sparse files: one GEN_BLOCK of data every data_every bytes, 0 for dense
+};
+
+/// @brief One cpcp configuration
+struct BenchRun {
+    const char *engine;
+    const char *buffer_size;    ///< NULL for engine default
+};
+
+/// @brief Measurements of one cpcp launch
+struct RunResult {
+    bool ok;
+    double seconds;
+    double user_cpu;
+    double sys_cpu;
+    long syscalls;              ///< -1 if not counted
+};
+
+static const FileSet FILE_SETS[] = {
+    {"tiny",   2000, 4 << 10,   0},
+    {"huge",   2,    256 << 20, 0},
+    {"sparse", 4,    64 << 20,  8 << 20},
+};
+
+static const BenchRun RUNS[] = {
+    {"auto",  NULL},
+    {"rw",    "64K"},
+    {"rw",    "1M"},
+    {"rw",    "8M"},
+    {"uring", NULL},
+    {"mmap",  NULL},
+    {"pipe",  NULL},
+};
+
+static double getTime();
+
+static int generateSet(const char *root, const FileSet *set, char *buffer);
+
+static const char *dropCache(const char *dir, const FileSet *set);
+
+static bool removeTree(const char *path);
+
+static RunResult runCpcp(const char *cpcp, char *const argv[], bool count_syscalls);
+
+static void printHelpMsg();
+
+static double getTime() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+/// @brief Create root/set->name with set->files files; returns -1 on error
+static int generateSet(const char *root, const FileSet *set, char *buffer) {
+    char path[BENCH_PATH_LEN] = "";
+    snprintf(path, BENCH_PATH_LEN, "%s/%s", root, set->name);
+    if (mkdir(path, 0755) < 0) return -1;
+
+    for (int idx = 0; idx < set->files; idx++) {
+        snprintf(path, BENCH_PATH_LEN, "%s/%s/f%d", root, set->name, idx);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+
+        for (size_t pos = 0; pos < set->file_size; pos += GEN_BLOCK) {
+            size_t len = (set->file_size - pos < GEN_BLOCK) ? set->file_size - pos : GEN_BLOCK;
+            if (set->data_every && pos % set->data_every != 0) continue;
+
+            // cheap non-zero pattern, different in every block so nothing can be deduplicated
+            for (size_t word = 0; word + sizeof(size_t) <= len; word += sizeof(size_t)) {
+                size_t value = (pos + word) * 0x9E3779B97F4A7C15ull + (size_t) idx;
+                memcpy(buffer + word, &value, sizeof(value));
+            }
+            if (pwrite(fd, buffer, len, (off_t) pos) != (ssize_t) len) {
+                close(fd);
+                return -1;
+            }
+        }
+        if (ftruncate(fd, (off_t) set->file_size) < 0 || close(fd) < 0) return -1;
+    }
+
+    return 0;
+}
+
+/// @brief Evict source files from page cache: drop_caches if permitted, fadvise otherwise
+/// Returns name of used method for cache column
+static const char *dropCache(const char *dir, const FileSet *set) {
+    sync();
+    int drop_fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (drop_fd >= 0) {
+        bool dropped = write(drop_fd, "1", 1) == 1;
+        close(drop_fd);
+        if (dropped) return "cold";
+    }
+
+    char path[BENCH_PATH_LEN] = "";
+    for (int idx = 0; idx < set->files; idx++) {
+        snprintf(path, BENCH_PATH_LEN, "%s/f%d", dir, idx);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    return "cold-fadvise";
+}
+
+static bool removeTree(const char *path) {
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        execlp("rm", "rm", "-rf", path, NULL);
+        _exit(127);
+    }
+
+    int wstatus = 0;
+    waitpid(pid, &wstatus, 0);
+    return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+}
+
+/// @brief Launch cpcp and wait for it; with count_syscalls all its threads are traced with ptrace
+static RunResult runCpcp(const char *cpcp, char *const argv[], bool count_syscalls) {
+    RunResult result = {false, 0, 0, 0, -1};
+
+    double start = getTime();
+    pid_t pid = fork();
+    if (pid < 0) return result;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        if (count_syscalls) {
+            if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) _exit(126);
+            raise(SIGSTOP);     // lets parent set options before exec
+        }
+        execv(cpcp, argv);
+        _exit(127);
+    }
+
+    int wstatus = 0;
+    struct rusage usage = {};
+    if (count_syscalls) {
+        waitpid(pid, &wstatus, 0);
+        if (!WIFSTOPPED(wstatus)) return result;   // ptrace is not permitted
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+        long stops = 0;
+        while (true) {
+            pid_t tid = wait4(-1, &wstatus, __WALL, &usage);
+            if (tid < 0) break;
+            if (tid == pid && (WIFEXITED(wstatus) || WIFSIGNALED(wstatus))) break;
+            if (!WIFSTOPPED(wstatus)) continue;
+
+            int sig = WSTOPSIG(wstatus);
+            if (sig == (SIGTRAP | 0x80)) stops++;
+            // traps of clone/exec events and new threads' SIGSTOP are not delivered
+            bool deliver = sig != (SIGTRAP | 0x80) && sig != SIGTRAP && sig != SIGSTOP;
+            ptrace(PTRACE_SYSCALL, tid, NULL, deliver ? sig : 0);
+        }
+        result.syscalls = stops / 2;    // enter and exit stops
+    } else {
+        wait4(pid, &wstatus, 0, &usage);
+    }
+    result.seconds = getTime() - start;
+
+    result.ok = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+    result.user_cpu = (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec * 1e-6;
+    result.sys_cpu  = (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec * 1e-6;
+    return result;
+}
+
+static void printHelpMsg() {
+    printf("Usage: ./cpcp_bench [-n REPEAT] [-j N] cpcp_path [work_dir]\n"
+           "\tGenerates file sets (many tiny, few huge, sparse files) in work_dir (default /tmp)\n"
+           "\tand copies them with every cpcp engine and buffer size, with warm and dropped\n"
+           "\tpage cache. Prints CSV: MB/s and CPU time are the best of REPEAT runs (default 3),\n"
+           "\tsyscalls are counted in one extra traced run\n"
+           "\n"
+           "\t-n REPEAT  Runs of every configuration\n"
+           "\t-j N       Pass -j N to cpcp\n"
+           "\t-h         Show this message\n"
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int repeat = 3;
+    const char *jobs = "1";
+
+    int ch = 0;
+    while ((ch = getopt(argc, argv, "n:j:h")) != -1) {
+        switch (ch) {
+            case 'n':
+                repeat = atoi(optarg);
+                if (repeat <= 0) {
+                    fprintf(stderr, "Invalid repeat count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                jobs = optarg;
+                break;
+            default:
+                printHelpMsg();
+                return 0;
+        }
+    }
+    if (argc - optind < 1) {
+        printHelpMsg();
+        return 0;
+    }
+
+    const char *cpcp = argv[optind];
+    char root[BENCH_PATH_LEN] = "";
+    snprintf(root, BENCH_PATH_LEN, "%s/cpcp_bench.XXXXXX", (argc - optind > 1) ? argv[optind + 1] : "/tmp");
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    char *buffer = (char *) malloc(GEN_BLOCK);
+    if (!buffer) return 1;
+
+    printf("set,engine,buffer,cache,files,bytes,seconds,MB/s,user_cpu,sys_cpu,syscalls_per_file\n");
+    int result = 0;
+    for (size_t set_idx = 0; set_idx < sizeof(FILE_SETS) / sizeof(FILE_SETS[0]) && result == 0; set_idx++) {
+        const FileSet *set = &FILE_SETS[set_idx];
+        if (generateSet(root, set, buffer) < 0) {
+            fprintf(stderr, "Failed to generate '%s' set:%s\n", set->name, strerror(errno));
+            result = 1;
+            break;
+        }
+
+        char src[BENCH_PATH_LEN] = "", dst[BENCH_PATH_LEN] = "";
+        snprintf(src, BENCH_PATH_LEN, "%s/%s", root, set->name);
+        snprintf(dst, BENCH_PATH_LEN, "%s/copy", root);
+        size_t total = (size_t) set->files * set->file_size;
+
+        for (size_t run_idx = 0; run_idx < sizeof(RUNS) / sizeof(RUNS[0]); run_idx++) {
+            const BenchRun *run = &RUNS[run_idx];
+            char engine_arg[64] = "", buffer_arg[64] = "";
+            snprintf(engine_arg, sizeof(engine_arg), "--engine=%s", run->engine);
+            char *cpcp_argv[10] = {(char *) cpcp, (char *) "-r", (char *) "-j", (char *) jobs, engine_arg};
+            int arg_idx = 5;
+            if (run->buffer_size) {
+                snprintf(buffer_arg, sizeof(buffer_arg), "--buffer-size=%s", run->buffer_size);
+                cpcp_argv[arg_idx++] = buffer_arg;
+            }
+            cpcp_argv[arg_idx++] = src;
+            cpcp_argv[arg_idx++] = dst;
+            cpcp_argv[arg_idx] = NULL;
+
+            removeTree(dst);
+            RunResult traced = runCpcp(cpcp, cpcp_argv, true);
+
+            for (int cold = 0; cold <= 1; cold++) {
+                RunResult best = {false, 0, 0, 0, traced.syscalls};
+                const char *cache = "warm";
+                if (!cold) {
+                    removeTree(dst);
+                    runCpcp(cpcp, cpcp_argv, false);
+                }
+
+                for (int attempt = 0; attempt < repeat; attempt++) {
+                    removeTree(dst);
+                    if (cold) cache = dropCache(src, set);
+
+                    RunResult current = runCpcp(cpcp, cpcp_argv, false);
+                    if (!current.ok) {
+                        best.ok = false;
+                        break;
+                    }
+                    if (!best.ok || current.seconds < best.seconds) {
+                        current.syscalls = traced.syscalls;
+                        best = current;
+                    }
+                }
+
+                if (!best.ok) {
+                    fprintf(stderr, "cpcp failed on '%s' set with %s\n", set->name, engine_arg);
+                    continue;
+                }
+                printf("%s,%s,%s,%s,%d,%zu,%.4f,%.1f,%.4f,%.4f,", set->name, run->engine,
+                       run->buffer_size ? run->buffer_size : "default",
+                       cache,
+                       set->files, total, best.seconds, (double) total / best.seconds / 1e6,
+                       best.user_cpu, best.sys_cpu);
+                if (best.syscalls >= 0) printf("%.1f\n", (double) best.syscalls / set->files);
+                else printf("-\n");
+                fflush(stdout);
+            }
+        }
+        removeTree(dst);
+        removeTree(src);
+    }
+
+    free(buffer);
+    rmdir(root);
+    return result;
+}
@@ -0,0 +1,199 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <atomic>
+
+#include "chunk_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+/// @brief Checksum of one range for verify; ranges finish out of order, so they are combined at the end
+struct ChunkSum {
+    uint32_t crc;
+    off_t length;           ///< bytes covered by crc, less than range only if file shrank
+};
+
+/// @brief State shared by all threads copying one file
+struct ChunkJob {
+    int src_fd;
+    int dst_fd;
+    off_t size;
+    size_t buf_size;                    ///< pread/pwrite buffer size for each thread
+
+    std::atomic<off_t> next;            ///< start of the next free range
+    std::atomic<size_t> copied;
+    ProgressSlot *progress;             ///< slot of thread which started the copy, shared by all workers
+    std::atomic<bool> use_file_range;   ///< cleared once copy_file_range is refused
+    std::atomic<bool> failed;
+    ChunkSum *sums;                     ///< one per range with verify, NULL otherwise
+
+    pthread_mutex_t mtx;                ///< protects error
+    CpErr error;
+};
+
+static void setChunkError(ChunkJob *job, CpErr error);
+
+static CpErr copyRange(ChunkJob *job, off_t start, off_t end, CopyBuffer *buffer, ChunkSum *sum);
+
+static void *chunkWorker(void *job_ptr);
+
+static void setChunkError(ChunkJob *job, CpErr error) {
+    pthread_mutex_lock(&job->mtx);
+    if (!job->failed.load()) {
+        job->error = error;
+        job->failed.store(true);
+    }
+    pthread_mutex_unlock(&job->mtx);
+}
+
+/// @brief sum is filled from data passing through buffer if it is not NULL, so copy_file_range is not used then
+static CpErr copyRange(ChunkJob *job, off_t start, off_t end, CopyBuffer *buffer, ChunkSum *sum) {
+    loff_t in = start, out = start;
+    if (sum) *sum = {0, 0};
+
+    while (in < end && !sum && job->use_file_range.load(std::memory_order_relaxed)) {
+        ssize_t moved = copy_file_range(job->src_fd, &in, job->dst_fd, &out,
+                                       throttleChunk((size_t)(end - in)), 0);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) {
+            // 0 before end isn't trusted as EOF: pread below decides whether file was truncated
+            job->use_file_range.store(false, std::memory_order_relaxed);
+            break;
+        }
+
+        job->copied.fetch_add(moved, std::memory_order_relaxed);
+        progressAdd(job->progress, moved);
+        throttleIo(moved);
+    }
+
+    char *memory = (char *) reserveCopyBuffer(buffer, job->buf_size);
+    if (!memory) return {CP_ERROR::SRC_READ, ENOMEM};
+
+    while (in < end) {
+        size_t to_read = ((size_t)(end - in) < job->buf_size) ? (size_t)(end - in) : job->buf_size;
+        ssize_t bytes_read = pread(job->src_fd, memory, to_read, in);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::SRC_READ, errno};
+        }
+        if (bytes_read == 0) break;
+        if (sum) {
+            sum->crc = crc32c(sum->crc, memory, bytes_read);
+            sum->length += bytes_read;
+        }
+
+        for (ssize_t written = 0; written < bytes_read;) {
+            ssize_t code = pwrite(job->dst_fd, memory + written, bytes_read - written, in + written);
+            if (code < 0) {
+                if (errno == EINTR) continue;
+                return {CP_ERROR::DST_WRITE, errno};
+            }
+            written += code;
+        }
+
+        in += bytes_read;
+        job->copied.fetch_add(bytes_read, std::memory_order_relaxed);
+        progressAdd(job->progress, bytes_read);
+        throttleIo(bytes_read);
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+static void *chunkWorker(void *job_ptr) {
+    ChunkJob *job = (ChunkJob *) job_ptr;
+    CopyBuffer buffer = {NULL, 0};
+
+    while (!job->failed.load(std::memory_order_relaxed)) {
+        off_t start = job->next.fetch_add(COPY_CHUNK_SIZE);
+        if (start >= job->size) break;
+
+        off_t end = start + (off_t) COPY_CHUNK_SIZE;
+        if (end > job->size) end = job->size;
+
+        ChunkSum *sum = (job->sums) ? &job->sums[start / (off_t) COPY_CHUNK_SIZE] : NULL;
+        CpErr status = copyRange(job, start, end, &buffer, sum);
+        if (status.code != CP_ERROR::SUCCESS) setChunkError(job, status);
+    }
+
+    freeCopyBuffer(&buffer);
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+CpErr copyFileChunked(int src_fd, int dst_fd, const struct stat *src_info,
+                      CpContext_t *context, const struct copy_flags *flags) {
+    assert(src_info); assert(context); assert(flags);
+    context->method = CopyMethod::CHUNKED;
+    context->bytes_copied = 0;
+
+    // reserve all blocks at once, so parallel writers don't fragment the file
+    if (fallocate(dst_fd, 0, 0, src_info->st_size) < 0 && errno == ENOSPC) {
+        return {CP_ERROR::DST_WRITE, errno};
+    }
+
+    ChunkJob job = {};
+    job.src_fd = src_fd;
+    job.dst_fd = dst_fd;
+    job.size = src_info->st_size;
+    job.buf_size = chooseBufferSize(src_info->st_blksize, src_info->st_blksize,
+                                    COPY_CHUNK_SIZE, flags->buffer_size);
+    job.next.store(0);
+    job.copied.store(0);
+    job.progress = context->progress;
+    job.use_file_range.store(true);
+    job.failed.store(false);
+    job.error = {CP_ERROR::SUCCESS, 0};
+
+    off_t chunks = (job.size + (off_t) COPY_CHUNK_SIZE - 1) / (off_t) COPY_CHUNK_SIZE;
+    if (flags->verify) {
+        job.sums = (ChunkSum *) calloc(chunks, sizeof(ChunkSum));
+        if (!job.sums) return {CP_ERROR::SRC_READ, ENOMEM};
+    }
+    pthread_mutex_init(&job.mtx, NULL);
+
+    int thread_count = (chunks < flags->jobs) ? (int) chunks : flags->jobs;
+
+    pthread_t *threads = (pthread_t *) calloc(thread_count, sizeof(pthread_t));
+    int started = 0;
+    for (; threads && started < thread_count; started++) {
+        int code = pthread_create(&threads[started], NULL, chunkWorker, &job);
+        if (code != 0) {
+            ERRPRINTF("Failed to start copy thread:%s\n", strerror(code));
+            break;
+        }
+    }
+    if (started == 0) chunkWorker(&job);
+
+    for (int idx = 0; idx < started; idx++) {
+        pthread_join(threads[idx], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.mtx);
+
+    // copy starts at offset 0, so checksum of resumed head is not continued
+    context->checksum = 0;
+    context->has_checksum = flags->verify;
+    for (off_t idx = 0; job.sums && idx < chunks; idx++) {
+        context->checksum = crc32cCombine(context->checksum, job.sums[idx].crc, job.sums[idx].length);
+    }
+    free(job.sums);
+
+    context->bytes_copied = job.copied.load();
+    if (job.failed.load()) return job.error;
+
+    // file could shrink while copying, don't leave preallocated tail
+    if ((off_t) context->bytes_copied < job.size && ftruncate(dst_fd, context->bytes_copied) < 0) {
+        return {CP_ERROR::DST_WRITE, errno};
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
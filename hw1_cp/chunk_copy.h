@@ -0,0 +1,18 @@
+#ifndef CHUNK_COPY_H
+#define CHUNK_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+const size_t DEFAULT_CHUNK_THRESHOLD = 256 << 20; ///< smaller files are copied by one thread
+const size_t COPY_CHUNK_SIZE = 64 << 20;          ///< range taken by a thread at once
+
+/// @brief Copy file with flags->jobs threads, each takes COPY_CHUNK_SIZE ranges in turn
+/// Destination is preallocated; ranges are moved with copy_file_range, or pread/pwrite if it fails.
+/// File offsets of descriptors are not used and not changed
+CpErr copyFileChunked(int src_fd, int dst_fd, const struct stat *src_info,
+                      CpContext_t *context, const struct copy_flags *flags);
+
+#endif
@@ -0,0 +1,350 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "copy_engine.h"
+#include "chunk_copy.h"
+#include "uring_copy.h"
+#include "sparse_copy.h"
+#include "mmap_copy.h"
+#include "direct_copy.h"
+#include "ring_copy.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+const size_t KERNEL_CHUNK = 1 << 30;     ///< max bytes requested in one kernel copy syscall
+const int SPLICE_PIPE_SIZE = 1 << 20;
+
+/// @brief Result of one engine in fallback chain
+enum class EngineStatus {
+    DONE,       ///< reached end of file
+    FALLBACK,   ///< engine can't continue, next one should try from current offset
+    FAILED,     ///< unrecoverable error, stored in CpErr
+};
+
+static ssize_t Write(int fd, const void *buf, size_t count);
+
+static EngineStatus copyWithFileRange(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress);
+
+static EngineStatus copyWithSendfile(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress);
+
+static EngineStatus copyWithSplice(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress,
+                                   CpErr *err);
+
+static CpErr copyWithReadWrite(int src_fd, int dst_fd, char *buffer, size_t buf_size, size_t *copied,
+                               ProgressSlot *progress, uint32_t *checksum);
+
+static CpErr copyWithBuffer(int src_fd, int dst_fd, const struct stat *src_info,
+                            CpContext_t *context, const struct copy_flags *flags);
+
+static EngineStatus copyWithKernel(int src_fd, int dst_fd, const struct stat *src_info,
+                                   CpContext_t *context, const struct copy_flags *flags, CpErr *status);
+
+static ssize_t Write(int fd, const void *buf, size_t count) {
+    const uint8_t *byte_buf = (const uint8_t *)buf;
+
+    while (count > 0) {
+        ssize_t written = write(fd, byte_buf, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return written;
+        }
+
+        count -= written;
+        byte_buf += written;
+    }
+
+    return count;
+}
+
+/// Any error (EXDEV, EINVAL, EOPNOTSUPP, ENOSYS, EIO, ...) passes copy to the next engine:
+/// nothing is copied by failed call, so read/write loop will report exact failing side.
+/// 0 is trusted as EOF only after size bytes, earlier 0 passes copy on from current offset too
+static EngineStatus copyWithFileRange(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress) {
+    while (true) {
+        ssize_t moved = copy_file_range(src_fd, NULL, dst_fd, NULL, throttleChunk(KERNEL_CHUNK), 0);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return EngineStatus::FALLBACK;
+        }
+        // some pseudo filesystems report 0 instead of error, let next engine check it
+        if (moved == 0) return (*copied >= (size_t) size) ? EngineStatus::DONE : EngineStatus::FALLBACK;
+
+        *copied += moved;
+        progressAdd(progress, moved);
+        throttleIo(moved);
+    }
+}
+
+static EngineStatus copyWithSendfile(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress) {
+    while (true) {
+        ssize_t moved = sendfile(dst_fd, src_fd, NULL, throttleChunk(KERNEL_CHUNK));
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return EngineStatus::FALLBACK;
+        }
+        if (moved == 0) return (*copied >= (size_t) size) ? EngineStatus::DONE : EngineStatus::FALLBACK;
+
+        *copied += moved;
+        progressAdd(progress, moved);
+        throttleIo(moved);
+    }
+}
+
+/// Data is moved src -> pipe -> dst; once bytes are in pipe they can't be returned to src,
+/// so errors on the write half are final
+static EngineStatus copyWithSplice(int src_fd, int dst_fd, off_t size, size_t *copied, ProgressSlot *progress,
+                                   CpErr *err) {
+    int pipe_fd[2] = {-1, -1};
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0) return EngineStatus::FALLBACK;
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    EngineStatus status = EngineStatus::DONE;
+    while (true) {
+        ssize_t in_pipe = splice(src_fd, NULL, pipe_fd[1], NULL, SPLICE_PIPE_SIZE, SPLICE_F_MOVE);
+        if (in_pipe < 0) {
+            if (errno == EINTR) continue;
+            status = EngineStatus::FALLBACK;
+            break;
+        }
+        if (in_pipe == 0) {
+            status = (*copied >= (size_t) size) ? EngineStatus::DONE : EngineStatus::FALLBACK;
+            break;
+        }
+
+        while (in_pipe > 0) {
+            ssize_t out = splice(pipe_fd[0], NULL, dst_fd, NULL, in_pipe, SPLICE_F_MOVE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                *err = {CP_ERROR::DST_WRITE, errno};
+                status = EngineStatus::FAILED;
+                break;
+            }
+            in_pipe -= out;
+            *copied += out;
+            progressAdd(progress, out);
+            throttleIo(out);
+        }
+        if (status == EngineStatus::FAILED) break;
+    }
+
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return status;
+}
+
+/// @brief checksum is continued with CRC32C of copied data if it is not NULL
+static CpErr copyWithReadWrite(int src_fd, int dst_fd, char *buffer, size_t buf_size, size_t *copied,
+                               ProgressSlot *progress, uint32_t *checksum) {
+    ssize_t bytes_read = 0;
+    while ((bytes_read = read(src_fd, buffer, buf_size)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::SRC_READ, errno};
+        }
+        if (checksum) *checksum = crc32c(*checksum, buffer, bytes_read);
+
+        if (Write(dst_fd, buffer, bytes_read) < 0) {
+            return {CP_ERROR::DST_WRITE, errno};
+        }
+        *copied += bytes_read;
+        progressAdd(progress, bytes_read);
+        throttleIo(bytes_read);
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/// @brief Read/write loop with buffer sized for both files, continues from current offsets
+/// With verify checksum continues context->checksum, which covers data before offsets
+static CpErr copyWithBuffer(int src_fd, int dst_fd, const struct stat *src_info,
+                            CpContext_t *context, const struct copy_flags *flags) {
+    context->method = CopyMethod::READ_WRITE;
+    context->has_checksum = flags->verify;
+
+    struct stat dst_info = {};
+    blksize_t dst_block = (fstat(dst_fd, &dst_info) == 0) ? dst_info.st_blksize : 0;
+    size_t buf_size = chooseBufferSize(src_info->st_blksize, dst_block,
+                                       src_info->st_size - (off_t) context->bytes_copied, flags->buffer_size);
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, buf_size);
+    if (!memory) return {CP_ERROR::SRC_READ, ENOMEM};
+
+    CpErr status = copyWithReadWrite(src_fd, dst_fd, memory, buf_size, &context->bytes_copied,
+                                     context->progress, (flags->verify) ? &context->checksum : NULL);
+    freeCopyBuffer(&local_buffer);
+    return status;
+}
+
+/// @brief Parallel ranges for huge files, then copy_file_range -> sendfile -> splice
+/// With verify only engines which pass data through buffer are tried, FALLBACK leads to read/write loop.
+/// Big files which copy_file_range can't move between devices are pipelined instead of sendfile:
+/// sendfile reads and writes by turns, while ring keeps both devices busy
+static EngineStatus copyWithKernel(int src_fd, int dst_fd, const struct stat *src_info,
+                                   CpContext_t *context, const struct copy_flags *flags, CpErr *status) {
+    off_t src_size = src_info->st_size;
+
+    if (flags->jobs > 1 && src_size > 0 && (size_t) src_size >= flags->chunk_threshold) {
+        *status = copyFileChunked(src_fd, dst_fd, src_info, context, flags);
+        return EngineStatus::DONE;
+    }
+
+    // empty files (or files with unknown size like /proc/...) are not worth kernel tricks
+    if (src_size > 0) {
+        // checksum is taken from data passing through buffer, zero-copy calls never show it to us
+        context->method = CopyMethod::COPY_FILE_RANGE;
+        if (!flags->verify &&
+            copyWithFileRange(src_fd, dst_fd, src_size, &context->bytes_copied, context->progress) == EngineStatus::DONE)
+            return EngineStatus::DONE;
+
+        struct stat dst_info = {};
+        if (src_size - (off_t) context->bytes_copied >= RING_AUTO_MIN &&
+            fstat(dst_fd, &dst_info) == 0 && dst_info.st_dev != src_info->st_dev &&
+            copyFileRing(src_fd, dst_fd, src_info, context, flags, status)) {
+            return EngineStatus::DONE;
+        }
+        if (flags->verify) return EngineStatus::FALLBACK;
+
+        context->method = CopyMethod::SENDFILE;
+        if (copyWithSendfile(src_fd, dst_fd, src_size, &context->bytes_copied, context->progress) == EngineStatus::DONE)
+            return EngineStatus::DONE;
+
+        context->method = CopyMethod::SPLICE;
+        return copyWithSplice(src_fd, dst_fd, src_size, &context->bytes_copied, context->progress, status);
+    }
+
+    return EngineStatus::FALLBACK;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+size_t chooseBufferSize(blksize_t src_block, blksize_t dst_block, off_t file_size, size_t cap) {
+    size_t block = BUF_SIZE;
+    if ((size_t) src_block > block) block = src_block;
+    if ((size_t) dst_block > block) block = dst_block;
+
+    // whole file in one read, rounded up to block
+    size_t size = (file_size > 0) ? ((size_t) file_size + block - 1) / block * block : block;
+    if (size > cap) size = cap / block * block;
+    if (size < block) size = block;
+
+    return size;
+}
+
+void *reserveCopyBuffer(CopyBuffer *buffer, size_t size) {
+    assert(buffer);
+    if (buffer->capacity >= size) return buffer->data;
+
+    void *memory = NULL;
+    if (posix_memalign(&memory, BUF_SIZE, size) != 0) return NULL;
+
+    free(buffer->data);
+    buffer->data = memory;
+    buffer->capacity = size;
+    return memory;
+}
+
+void freeCopyBuffer(CopyBuffer *buffer) {
+    assert(buffer);
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
+
+const char *copyMethodName(CopyMethod method) {
+    switch (method) {
+        case CopyMethod::NONE:            return "none";
+        case CopyMethod::COPY_FILE_RANGE: return "copy_file_range";
+        case CopyMethod::SENDFILE:        return "sendfile";
+        case CopyMethod::SPLICE:          return "splice";
+        case CopyMethod::READ_WRITE:      return "read/write";
+        case CopyMethod::CHUNKED:         return "parallel ranges";
+        case CopyMethod::URING:           return "io_uring";
+        case CopyMethod::SPARSE:          return "sparse";
+        case CopyMethod::MMAP:            return "mmap";
+        case CopyMethod::PIPELINE:        return "pipeline";
+        case CopyMethod::DIRECT:          return "direct";
+        case CopyMethod::DROP_BEHIND:     return "drop-behind";
+        case CopyMethod::DIRECTORY:       return "directory";
+        case CopyMethod::SYMLINK:         return "symlink";
+        case CopyMethod::UP_TO_DATE:      return "up to date";
+        case CopyMethod::DELTA:           return "delta";
+        case CopyMethod::REFLINK:         return "reflink";
+        case CopyMethod::HARDLINK:        return "hardlink";
+        case CopyMethod::ARCHIVE:         return "tar";
+        default:                          return "unknown";
+    }
+}
+
+CpErr copyFileFromFd(int src_fd, int dst_fd, const struct stat *src_info,
+                     CpContext_t *context, const struct copy_flags *flags) {
+    assert(src_info); assert(context); assert(flags);
+    off_t src_size = src_info->st_size;
+    context->bytes_copied = 0;
+    context->method = CopyMethod::NONE;
+
+    // cache bypass overrides engines: all of them leave copied data in page cache
+    if (flags->cache == CacheMode::DIRECT) {
+        CpErr status = {CP_ERROR::SUCCESS, 0};
+        if (copyFileDirect(src_fd, dst_fd, src_info, context, flags, &status))
+            return status;
+    }
+    if (flags->cache != CacheMode::NORMAL) {
+        return copyFileDropBehind(src_fd, dst_fd, src_info, context, flags);
+    }
+
+    if (flags->sparse == SparseMode::ALWAYS || (flags->sparse == SparseMode::AUTO && isSparseFile(src_info))) {
+        return copyFileSparse(src_fd, dst_fd, src_info, context, flags);
+    }
+
+    switch (flags->engine) {
+        case CopyEngine::AUTO: {
+            CpErr status = {CP_ERROR::SUCCESS, 0};
+            if (copyWithKernel(src_fd, dst_fd, src_info, context, flags, &status) != EngineStatus::FALLBACK)
+                return status;
+            break;
+        }
+        case CopyEngine::URING: {
+            // linked requests pass data from read to write inside kernel, checksum needs read/write loop
+            CpErr status = {CP_ERROR::SUCCESS, 0};
+            if (!flags->verify && copyFileUring(src_fd, dst_fd, src_info, context, flags, &status))
+                return status;
+            break;
+        }
+        case CopyEngine::MMAP: {
+            CpErr status = {CP_ERROR::SUCCESS, 0};
+            if (copyFileMmap(src_fd, dst_fd, src_info, context, flags, &status))
+                return status;
+            break;
+        }
+        case CopyEngine::PIPELINE: {
+            CpErr status = {CP_ERROR::SUCCESS, 0};
+            if (copyFileRing(src_fd, dst_fd, src_info, context, flags, &status))
+                return status;
+            break;
+        }
+        case CopyEngine::READ_WRITE:
+            break;
+        default:
+            assert("Unknown copy engine" && false);
+    }
+
+    // mapping beats read/write copy through buffer only for mid-sized files
+    off_t left = src_size - (off_t) context->bytes_copied;
+    if (flags->engine == CopyEngine::AUTO && left >= MMAP_AUTO_MIN && left < MMAP_AUTO_MAX) {
+        CpErr status = {CP_ERROR::SUCCESS, 0};
+        if (copyFileMmap(src_fd, dst_fd, src_info, context, flags, &status))
+            return status;
+    }
+
+    return copyWithBuffer(src_fd, dst_fd, src_info, context, flags);
+}
@@ -0,0 +1,21 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+/// @brief Copy whole src_fd to dst_fd starting from current offsets with engine from flags
+/// AUTO tries copy_file_range -> pipeline (big files between devices) -> sendfile -> splice -> mmap (mid-sized files) -> read/write; each method continues
+/// from the offset where previous one stopped. Method and bytes are stored in context
+CpErr copyFileFromFd(int src_fd, int dst_fd, const struct stat *src_info,
+                     CpContext_t *context, const struct copy_flags *flags);
+
+/// @brief Buffer size for read/write loop: multiple of both block sizes, not bigger than file and cap
+size_t chooseBufferSize(blksize_t src_block, blksize_t dst_block, off_t file_size, size_t cap);
+
+/// @brief Make buffer at least size bytes long; old content is not preserved
+void *reserveCopyBuffer(CopyBuffer *buffer, size_t size);
+
+#endif
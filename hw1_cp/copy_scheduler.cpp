@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "copy_scheduler.h"
+
+struct CopyTask {
+    CpContext_t context;
+    off_t size;     ///< only for ordering, 0 if stat failed
+    int index;      ///< position in source order
+    CpErr result;
+    bool done;
+};
+
+struct CopyQueue {
+    CopyTask *tasks;    ///< in source order
+    CopyTask **order;   ///< in execution order
+    int count;
+    int next;           ///< next task in order to start
+    bool stop;
+    const struct copy_flags *flags;
+
+    pthread_mutex_t mtx;
+    pthread_cond_t task_done;
+};
+
+static int compareTasks(const void *lhs, const void *rhs);
+
+static CopyTask *takeTask(CopyQueue *queue);
+
+static void *copyWorker(void *queue_ptr);
+
+static int compareTasks(const void *lhs, const void *rhs) {
+    const CopyTask *a = *(const CopyTask * const *) lhs,
+                   *b = *(const CopyTask * const *) rhs;
+    if (a->size != b->size) return (a->size > b->size) ? -1 : 1;
+    return a->index - b->index;
+}
+
+static CopyTask *takeTask(CopyQueue *queue) {
+    CopyTask *task = NULL;
+
+    pthread_mutex_lock(&queue->mtx);
+    if (!queue->stop && queue->next < queue->count) {
+        task = queue->order[queue->next++];
+    }
+    pthread_mutex_unlock(&queue->mtx);
+
+    return task;
+}
+
+static void *copyWorker(void *queue_ptr) {
+    CopyQueue *queue = (CopyQueue *) queue_ptr;
+    CopyBuffer buffer = {NULL, 0};
+
+    CopyTask *task = NULL;
+    while ((task = takeTask(queue)) != NULL) {
+        task->context.buffer = &buffer;
+        CpErr result = copyFile(&task->context, queue->flags);
+
+        pthread_mutex_lock(&queue->mtx);
+        task->result = result;
+        task->done = true;
+        pthread_cond_broadcast(&queue->task_done);
+        pthread_mutex_unlock(&queue->mtx);
+    }
+
+    freeCopyBuffer(&buffer);
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+int copyFilesParallel(char *const sources[], int count, const char *dst, const struct copy_flags *flags) {
+    assert(sources); assert(dst); assert(flags);
+    if (count <= 0) return 0;
+
+    CopyQueue queue = {};
+    queue.tasks = (CopyTask *) calloc(count, sizeof(CopyTask));
+    queue.order = (CopyTask **) calloc(count, sizeof(CopyTask *));
+    pthread_t *workers = (pthread_t *) calloc(flags->jobs, sizeof(pthread_t));
+    if (!queue.tasks || !queue.order || !workers) {
+        ERRPRINTF("Failed to allocate copy queue\n");
+        free(queue.tasks); free(queue.order); free(workers);
+        return CP_FATAL;
+    }
+
+    queue.count = count;
+    queue.flags = flags;
+    pthread_mutex_init(&queue.mtx, NULL);
+    pthread_cond_init(&queue.task_done, NULL);
+
+    for (int idx = 0; idx < count; idx++) {
+        CopyTask *task = &queue.tasks[idx];
+        task->context.src = sources[idx];
+        task->context.dst = dst;
+        task->index = idx;
+
+        struct stat src_info = {};
+        if (stat(sources[idx], &src_info) == 0) task->size = src_info.st_size;
+
+        queue.order[idx] = task;
+    }
+    qsort(queue.order, count, sizeof(CopyTask *), compareTasks);
+
+    int started = 0;
+    for (; started < flags->jobs; started++) {
+        int code = pthread_create(&workers[started], NULL, copyWorker, &queue);
+        if (code != 0) {
+            ERRPRINTF("Failed to start copy thread:%s\n", strerror(code));
+            break;
+        }
+    }
+    if (started == 0) copyWorker(&queue); // copying in this thread then
+
+    int result = 0;
+    for (int idx = 0; idx < count; idx++) {
+        CopyTask *task = &queue.tasks[idx];
+
+        pthread_mutex_lock(&queue.mtx);
+        while (!task->done) {
+            pthread_cond_wait(&queue.task_done, &queue.mtx);
+        }
+        pthread_mutex_unlock(&queue.mtx);
+
+        if (parseCpErr(&task->context, task->result, flags) == CP_FATAL) {
+            pthread_mutex_lock(&queue.mtx);
+            queue.stop = true;
+            pthread_mutex_unlock(&queue.mtx);
+            result = CP_FATAL;
+            break;
+        }
+    }
+
+    for (int idx = 0; idx < started; idx++) {
+        pthread_join(workers[idx], NULL);
+    }
+
+    pthread_cond_destroy(&queue.task_done);
+    pthread_mutex_destroy(&queue.mtx);
+    free(workers);
+    free(queue.order);
+    free(queue.tasks);
+
+    return result;
+}
@@ -0,0 +1,12 @@
+#ifndef COPY_SCHEDULER_H
+#define COPY_SCHEDULER_H
+
+#include "file_copy.h"
+
+/// @brief Copy count sources to directory dst with flags->jobs worker threads
+/// Biggest files are started first so they don't end up as a long tail,
+/// results are reported with parseCpErr in source order.
+/// Returns CP_FATAL if copy was stopped, 0 otherwise
+int copyFilesParallel(char *const sources[], int count, const char *dst, const struct copy_flags *flags);
+
+#endif
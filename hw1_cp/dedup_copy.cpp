@@ -0,0 +1,594 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "dedup_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+const uint64_t PRIME_1 = 0x9E3779B185EBCA87ull;
+const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t PRIME_3 = 0x165667B19E3779F9ull;
+const uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t PRIME_5 = 0x27D4EB2F165667C5ull;
+
+/// @brief Copied file which may be linked instead of copying same content again
+struct DedupEntry {
+    off_t size;
+    DedupHash hash;
+    char *path;         ///< absolute, entries are freed only by saveDedupCache
+    DedupEntry *next;
+};
+
+/// @brief Index shared by all copy threads
+/// Entries are chained by size and hash; sizes are kept in separate open addressing table,
+/// so files of new size are hashed while they are copied and are never read twice
+struct DedupIndex {
+    pthread_mutex_t mtx;
+    DedupEntry **buckets;
+    size_t bucket_mask;
+    size_t entries;
+    off_t *sizes;           ///< 0 is empty slot, empty files are not indexed
+    size_t size_mask;
+    size_t size_count;
+    char cwd[PATH_MAX];     ///< prefix of relative destination paths, empty until first use
+};
+
+static DedupIndex INDEX = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0, ""};
+
+static unsigned LINK_COUNTER = 0;
+
+static inline uint64_t rotateLeft(uint64_t value, int bits);
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input);
+
+static inline uint64_t mergeLane(uint64_t acc, uint64_t lane);
+
+static inline uint64_t avalanche(uint64_t hash);
+
+static uint64_t hashTail(uint64_t hash, const unsigned char *tail, size_t len, int shift);
+
+static uint64_t mixKey(off_t size, const DedupHash *hash);
+
+static bool growIndex();
+
+static bool rememberSize(off_t size);
+
+static bool isSizeKnown(off_t size);
+
+static bool insertEntry(off_t size, const DedupHash *hash, char *path);
+
+static const DedupEntry *findEntry(off_t size, const DedupHash *hash);
+
+static void freeIndex();
+
+static ssize_t writeAll(int fd, const char *data, size_t size);
+
+static CpErr hashFile(int fd, char *buffer, size_t buf_size, DedupHash *hash);
+
+static CpErr copyAndHash(int src_fd, int dst_fd, char *buffer, size_t buf_size,
+                         CpContext_t *context, bool verify, DedupHash *hash);
+
+static int openDuplicate(const DedupEntry *entry, int src_fd, off_t size, char *buffer, size_t buf_size);
+
+static int linkDuplicate(const char *path, const DedupTarget *target);
+
+static inline uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME_2;
+    return rotateLeft(acc, 31) * PRIME_1;
+}
+
+static inline uint64_t mergeLane(uint64_t acc, uint64_t lane) {
+    acc ^= hashRound(0, lane);
+    return acc * PRIME_1 + PRIME_4;
+}
+
+static inline uint64_t avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/// @brief Fold bytes left after last stripe; shift makes two halves of DedupHash differ
+static uint64_t hashTail(uint64_t hash, const unsigned char *tail, size_t len, int shift) {
+    size_t pos = 0;
+    for (; pos + sizeof(uint64_t) <= len; pos += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, tail + pos, sizeof(word));
+        hash ^= hashRound(0, word);
+        hash = rotateLeft(hash, 27 + shift) * PRIME_1 + PRIME_4;
+    }
+    for (; pos < len; pos++) {
+        hash ^= tail[pos] * PRIME_5;
+        hash = rotateLeft(hash, 11 + shift) * PRIME_1;
+    }
+
+    return hash;
+}
+
+static uint64_t mixKey(off_t size, const DedupHash *hash) {
+    return avalanche(hash->lo ^ ((uint64_t) size * PRIME_1));
+}
+
+/// @brief Double both tables, called with INDEX.mtx held
+static bool growIndex() {
+    if (INDEX.entries >= INDEX.bucket_mask + 1 || !INDEX.buckets) {
+        size_t new_count = (INDEX.buckets) ? (INDEX.bucket_mask + 1) * 2 : DEDUP_BUCKETS;
+        DedupEntry **buckets = (DedupEntry **) calloc(new_count, sizeof(DedupEntry *));
+        if (!buckets) return false;
+
+        for (size_t idx = 0; INDEX.buckets && idx <= INDEX.bucket_mask; idx++) {
+            DedupEntry *entry = INDEX.buckets[idx];
+            while (entry) {
+                DedupEntry *next = entry->next;
+                size_t bucket = mixKey(entry->size, &entry->hash) & (new_count - 1);
+                entry->next = buckets[bucket];
+                buckets[bucket] = entry;
+                entry = next;
+            }
+        }
+        free(INDEX.buckets);
+        INDEX.buckets = buckets;
+        INDEX.bucket_mask = new_count - 1;
+    }
+
+    if (INDEX.size_count * 2 >= INDEX.size_mask + 1 || !INDEX.sizes) {
+        size_t new_count = (INDEX.sizes) ? (INDEX.size_mask + 1) * 2 : DEDUP_BUCKETS;
+        off_t *sizes = (off_t *) calloc(new_count, sizeof(off_t));
+        if (!sizes) return false;
+
+        for (size_t idx = 0; INDEX.sizes && idx <= INDEX.size_mask; idx++) {
+            if (INDEX.sizes[idx] == 0) continue;
+            size_t slot = avalanche((uint64_t) INDEX.sizes[idx]) & (new_count - 1);
+            while (sizes[slot] != 0) slot = (slot + 1) & (new_count - 1);
+            sizes[slot] = INDEX.sizes[idx];
+        }
+        free(INDEX.sizes);
+        INDEX.sizes = sizes;
+        INDEX.size_mask = new_count - 1;
+    }
+
+    return true;
+}
+
+/// @brief Called with INDEX.mtx held and tables already grown
+static bool rememberSize(off_t size) {
+    size_t slot = avalanche((uint64_t) size) & INDEX.size_mask;
+    while (INDEX.sizes[slot] != 0) {
+        if (INDEX.sizes[slot] == size) return true;
+        slot = (slot + 1) & INDEX.size_mask;
+    }
+
+    INDEX.sizes[slot] = size;
+    INDEX.size_count++;
+    return true;
+}
+
+static bool isSizeKnown(off_t size) {
+    pthread_mutex_lock(&INDEX.mtx);
+    bool known = false;
+    if (INDEX.sizes) {
+        size_t slot = avalanche((uint64_t) size) & INDEX.size_mask;
+        while (INDEX.sizes[slot] != 0 && !known) {
+            known = INDEX.sizes[slot] == size;
+            slot = (slot + 1) & INDEX.size_mask;
+        }
+    }
+    pthread_mutex_unlock(&INDEX.mtx);
+    return known;
+}
+
+/// @brief Takes ownership of path; newer entry hides older one with same content
+static bool insertEntry(off_t size, const DedupHash *hash, char *path) {
+    DedupEntry *entry = (DedupEntry *) calloc(1, sizeof(DedupEntry));
+    if (!entry) {
+        free(path);
+        return false;
+    }
+    entry->size = size;
+    entry->hash = *hash;
+    entry->path = path;
+
+    pthread_mutex_lock(&INDEX.mtx);
+    bool inserted = growIndex() && rememberSize(size);
+    bool known = false;
+    if (inserted) {
+        size_t bucket = mixKey(size, hash) & INDEX.bucket_mask;
+        // same file copied again by later run must not grow cache
+        for (const DedupEntry *old = INDEX.buckets[bucket]; old && !known; old = old->next) {
+            known = old->size == size && old->hash.lo == hash->lo && old->hash.hi == hash->hi &&
+                    strcmp(old->path, path) == 0;
+        }
+        if (!known) {
+            entry->next = INDEX.buckets[bucket];
+            INDEX.buckets[bucket] = entry;
+            INDEX.entries++;
+        }
+    }
+    pthread_mutex_unlock(&INDEX.mtx);
+
+    if (!inserted || known) {
+        free(path);
+        free(entry);
+    }
+    return inserted;
+}
+
+/// @brief Entries are never removed while files are copied, so result stays valid after unlock
+static const DedupEntry *findEntry(off_t size, const DedupHash *hash) {
+    pthread_mutex_lock(&INDEX.mtx);
+    const DedupEntry *entry = NULL;
+    if (INDEX.buckets) {
+        entry = INDEX.buckets[mixKey(size, hash) & INDEX.bucket_mask];
+        while (entry && !(entry->size == size && entry->hash.lo == hash->lo && entry->hash.hi == hash->hi))
+            entry = entry->next;
+    }
+    pthread_mutex_unlock(&INDEX.mtx);
+    return entry;
+}
+
+static void freeIndex() {
+    pthread_mutex_lock(&INDEX.mtx);
+    for (size_t idx = 0; INDEX.buckets && idx <= INDEX.bucket_mask; idx++) {
+        DedupEntry *entry = INDEX.buckets[idx];
+        while (entry) {
+            DedupEntry *next = entry->next;
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(INDEX.buckets);
+    free(INDEX.sizes);
+    INDEX.buckets = NULL;
+    INDEX.sizes = NULL;
+    INDEX.bucket_mask = INDEX.size_mask = 0;
+    INDEX.entries = INDEX.size_count = 0;
+    pthread_mutex_unlock(&INDEX.mtx);
+}
+
+static ssize_t writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return written;
+        }
+        data += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/// @brief Hash whole file with pread, file offset is kept
+static CpErr hashFile(int fd, char *buffer, size_t buf_size, DedupHash *hash) {
+    HashState state = {};
+    hashInit(&state);
+
+    off_t pos = 0;
+    while (true) {
+        ssize_t bytes_read = pread(fd, buffer, buf_size, pos);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::SRC_READ, errno};
+        }
+        if (bytes_read == 0) break;
+
+        hashUpdate(&state, buffer, bytes_read);
+        pos += bytes_read;
+    }
+
+    *hash = hashFinal(&state);
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/// @brief Read/write loop which hashes data while it passes through buffer, also checksums it with verify
+static CpErr copyAndHash(int src_fd, int dst_fd, char *buffer, size_t buf_size,
+                         CpContext_t *context, bool verify, DedupHash *hash) {
+    HashState state = {};
+    hashInit(&state);
+    context->method = CopyMethod::READ_WRITE;
+    context->bytes_copied = 0;
+    context->checksum = 0;
+    context->has_checksum = verify;
+
+    ssize_t bytes_read = 0;
+    while ((bytes_read = read(src_fd, buffer, buf_size)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::SRC_READ, errno};
+        }
+
+        hashUpdate(&state, buffer, bytes_read);
+        if (verify) context->checksum = crc32c(context->checksum, buffer, bytes_read);
+        if (writeAll(dst_fd, buffer, bytes_read) < 0) return {CP_ERROR::DST_WRITE, errno};
+        context->bytes_copied += bytes_read;
+        progressAdd(context->progress, bytes_read);
+        throttleIo(bytes_read);
+    }
+
+    *hash = hashFinal(&state);
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/// @brief Open entry's file if it still has exactly the same content as src_fd; -1 otherwise
+/// Hash equality is not trusted: cache may be stale and hash is not cryptographic
+static int openDuplicate(const DedupEntry *entry, int src_fd, off_t size, char *buffer, size_t buf_size) {
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat info = {};
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size != size) {
+        close(fd);
+        return -1;
+    }
+
+    size_t half = buf_size / 2;
+    off_t pos = 0;
+    while (pos < size) {
+        size_t len = ((size_t)(size - pos) < half) ? (size_t)(size - pos) : half;
+        ssize_t src_read = pread(src_fd, buffer, len, pos);
+        ssize_t dup_read = pread(fd, buffer + half, len, pos);
+        if (src_read <= 0 || src_read != dup_read || memcmp(buffer, buffer + half, src_read) != 0) {
+            close(fd);
+            return -1;
+        }
+        pos += src_read;
+    }
+
+    return fd;
+}
+
+/// @brief Make target->name hardlink to path; returns 0 or -1 with errno set
+/// Existing name is replaced through temporary link, so it is never missing
+static int linkDuplicate(const char *path, const DedupTarget *target) {
+    if (!target->replace) return linkat(AT_FDCWD, path, target->dir_fd, target->name, 0);
+
+    char tmp_name[MAX_PATH_LEN] = "";
+    const char *slash = strrchr(target->name, '/');
+    int dir_len = (slash) ? (int)(slash - target->name + 1) : 0;
+    unsigned counter = __atomic_fetch_add(&LINK_COUNTER, 1, __ATOMIC_RELAXED);
+    int len = snprintf(tmp_name, MAX_PATH_LEN, "%.*s.cpcp-link.%d.%u", dir_len, target->name,
+                       (int) getpid(), counter);
+    if (len >= MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (linkat(AT_FDCWD, path, target->dir_fd, tmp_name, 0) < 0) return -1;
+    if (renameat(target->dir_fd, tmp_name, target->dir_fd, target->name) < 0) {
+        int rename_errno = errno;
+        unlinkat(target->dir_fd, tmp_name, 0);
+        errno = rename_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+void hashInit(HashState *state) {
+    assert(state);
+    state->lanes[0] = PRIME_1 + PRIME_2;
+    state->lanes[1] = PRIME_2;
+    state->lanes[2] = 0;
+    state->lanes[3] = 0 - PRIME_1;
+    state->total = 0;
+    state->tail_len = 0;
+}
+
+void hashUpdate(HashState *state, const void *data, size_t size) {
+    assert(state); assert(data || size == 0);
+    const unsigned char *bytes = (const unsigned char *) data;
+    state->total += size;
+
+    if (state->tail_len > 0) {
+        size_t fill = DEDUP_STRIPE - state->tail_len;
+        if (fill > size) fill = size;
+        memcpy(state->tail + state->tail_len, bytes, fill);
+        state->tail_len += fill;
+        bytes += fill;
+        size -= fill;
+        if (state->tail_len < DEDUP_STRIPE) return;
+
+        uint64_t words[4];
+        memcpy(words, state->tail, DEDUP_STRIPE);
+        for (int lane = 0; lane < 4; lane++) state->lanes[lane] = hashRound(state->lanes[lane], words[lane]);
+        state->tail_len = 0;
+    }
+
+    // lanes don't depend on each other, so compiler keeps all four multiplications in flight
+    uint64_t lane0 = state->lanes[0], lane1 = state->lanes[1],
+             lane2 = state->lanes[2], lane3 = state->lanes[3];
+    for (; size >= DEDUP_STRIPE; bytes += DEDUP_STRIPE, size -= DEDUP_STRIPE) {
+        uint64_t words[4];
+        memcpy(words, bytes, DEDUP_STRIPE);
+        lane0 = hashRound(lane0, words[0]);
+        lane1 = hashRound(lane1, words[1]);
+        lane2 = hashRound(lane2, words[2]);
+        lane3 = hashRound(lane3, words[3]);
+    }
+    state->lanes[0] = lane0; state->lanes[1] = lane1;
+    state->lanes[2] = lane2; state->lanes[3] = lane3;
+
+    memcpy(state->tail, bytes, size);
+    state->tail_len = size;
+}
+
+DedupHash hashFinal(const HashState *state) {
+    assert(state);
+    const uint64_t *lanes = state->lanes;
+
+    uint64_t lo = rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) +
+                  rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+    uint64_t hi = rotateLeft(lanes[3], 1) + rotateLeft(lanes[2], 7) +
+                  rotateLeft(lanes[1], 12) + rotateLeft(lanes[0], 18);
+    for (int lane = 0; lane < 4; lane++) {
+        lo = mergeLane(lo, lanes[lane]);
+        hi = mergeLane(hi, lanes[3 - lane]);
+    }
+    lo += state->total;
+    hi ^= state->total * PRIME_5;
+
+    lo = hashTail(lo, state->tail, state->tail_len, 0);
+    hi = hashTail(hi, state->tail, state->tail_len, 3);
+    lo = avalanche(lo);
+    hi = avalanche(hi ^ lo);
+    return {lo, hi};
+}
+
+CpErr copyFileDedup(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags, DedupTarget *target) {
+    assert(src_info); assert(context); assert(flags); assert(target);
+    target->hashed = false;
+    off_t size = src_info->st_size;
+    if (size == 0) return copyFileFromFd(src_fd, dst_fd, src_info, context, flags);
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    size_t buf_size = chooseBufferSize(src_info->st_blksize, src_info->st_blksize, size, flags->buffer_size);
+    // second half holds duplicate's data while contents are compared
+    char *memory = (char *) reserveCopyBuffer(buffer, buf_size * 2);
+    if (!memory) return {CP_ERROR::SRC_READ, ENOMEM};
+
+    CpErr status = {CP_ERROR::SUCCESS, 0};
+    if (!isSizeKnown(size)) {
+        // nothing to compare with, hash is taken from data passing through buffer
+        status = copyAndHash(src_fd, dst_fd, memory, buf_size, context, flags->verify, &target->hash);
+        target->hashed = status.code == CP_ERROR::SUCCESS;
+        freeCopyBuffer(&local_buffer);
+        return status;
+    }
+
+    status = hashFile(src_fd, memory, buf_size, &target->hash);
+    if (status.code != CP_ERROR::SUCCESS) {
+        freeCopyBuffer(&local_buffer);
+        return status;
+    }
+    target->hashed = true;
+
+    const DedupEntry *entry = findEntry(size, &target->hash);
+    int dup_fd = (entry) ? openDuplicate(entry, src_fd, size, memory, buf_size * 2) : -1;
+    freeCopyBuffer(&local_buffer);
+    if (dup_fd >= 0) {
+        bool linked = false;
+        if (flags->dedup != DedupMode::HARDLINK && ioctl(dst_fd, FICLONE, dup_fd) == 0) {
+            context->method = CopyMethod::REFLINK;
+            linked = true;
+        } else if (flags->dedup != DedupMode::REFLINK && linkDuplicate(entry->path, target) == 0) {
+            context->method = CopyMethod::HARDLINK;
+            linked = true;
+        }
+        close(dup_fd);
+
+        if (linked) {
+            context->bytes_copied = 0;
+            progressAdd(context->progress, size);
+            return {CP_ERROR::SUCCESS, 0};
+        }
+    }
+
+    return copyFileFromFd(src_fd, dst_fd, src_info, context, flags);
+}
+
+void addDedupFile(off_t size, const DedupTarget *target, const char *path) {
+    assert(target); assert(path);
+    if (!target->hashed || size == 0) return;
+
+    const char *prefix = "";
+    if (path[0] != '/') {
+        pthread_mutex_lock(&INDEX.mtx);
+        if (INDEX.cwd[0] == '\0' && !getcwd(INDEX.cwd, sizeof(INDEX.cwd))) INDEX.cwd[0] = '\0';
+        pthread_mutex_unlock(&INDEX.mtx);
+        if (INDEX.cwd[0] == '\0') return;
+        prefix = INDEX.cwd;
+    }
+
+    size_t len = strlen(prefix) + strlen(path) + 2;
+    char *full_path = (char *) malloc(len);
+    if (!full_path) return;
+    snprintf(full_path, len, "%s%s%s", prefix, (prefix[0] != '\0') ? "/" : "", path);
+    insertEntry(size, &target->hash, full_path);
+}
+
+bool loadDedupCache(const char *path) {
+    assert(path);
+    FILE *cache = fopen(path, "r");
+    if (!cache) return errno == ENOENT;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len = 0;
+    bool ok = true;
+    while ((line_len = getline(&line, &line_cap, cache)) > 0) {
+        if (line[line_len - 1] == '\n') line[--line_len] = '\0';
+
+        // <hash hi><hash lo> <size> <absolute path>
+        unsigned long long hi = 0, lo = 0;
+        long long size = 0;
+        int path_pos = 0;
+        if (sscanf(line, "%16llx%16llx %lld %n", &hi, &lo, &size, &path_pos) != 3 ||
+            path_pos == 0 || line[path_pos] != '/' || size <= 0) {
+            ok = false;
+            continue;
+        }
+
+        DedupHash hash = {lo, hi};
+        char *entry_path = strdup(line + path_pos);
+        if (!entry_path || !insertEntry((off_t) size, &hash, entry_path)) ok = false;
+    }
+
+    free(line);
+    fclose(cache);
+    return ok;
+}
+
+bool saveDedupCache(const char *path) {
+    assert(path);
+    char tmp_path[PATH_MAX] = "";
+    if (snprintf(tmp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        freeIndex();
+        return false;
+    }
+
+    FILE *cache = fopen(tmp_path, "w");
+    if (!cache) {
+        freeIndex();
+        return false;
+    }
+
+    pthread_mutex_lock(&INDEX.mtx);
+    for (size_t idx = 0; INDEX.buckets && idx <= INDEX.bucket_mask; idx++) {
+        for (DedupEntry *entry = INDEX.buckets[idx]; entry; entry = entry->next) {
+            if (strchr(entry->path, '\n')) continue;     // can't be stored in line format
+            fprintf(cache, "%016llx%016llx %lld %s\n", (unsigned long long) entry->hash.hi,
+                    (unsigned long long) entry->hash.lo, (long long) entry->size, entry->path);
+        }
+    }
+    pthread_mutex_unlock(&INDEX.mtx);
+    freeIndex();
+
+    bool ok = !ferror(cache);
+    if (fclose(cache) != 0) ok = false;
+    if (ok && rename(tmp_path, path) < 0) ok = false;
+    if (!ok) unlink(tmp_path);
+    return ok;
+}
@@ -0,0 +1,59 @@
+#ifndef DEDUP_COPY_H
+#define DEDUP_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "file_copy.h"
+
+const size_t DEDUP_STRIPE = 32;         ///< hash consumes 4 independent 64-bit lanes at once
+const size_t DEDUP_BUCKETS = 4096;      ///< initial size of index, doubles when it is full
+
+/// @brief 128-bit content hash; it only finds candidates, contents are compared before linking
+struct DedupHash {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+/// @brief Streaming hash state: xxHash64-like lanes without dependency between them
+struct HashState {
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char tail[DEDUP_STRIPE];
+    size_t tail_len;
+};
+
+/// @brief Where duplicate may be linked and what is known about copied content
+struct DedupTarget {
+    int dir_fd;
+    const char *name;   ///< destination name inside dir_fd
+    bool replace;       ///< name may already exist and is replaced by link
+    bool hashed;        ///< Out parameter: hash is valid
+    DedupHash hash;     ///< Out parameter
+};
+
+void hashInit(HashState *state);
+
+void hashUpdate(HashState *state, const void *data, size_t size);
+
+DedupHash hashFinal(const HashState *state);
+
+/// @brief Copy src_fd to dst_fd unless identical file was already copied in this or cached run
+/// Files of new size are copied through buffer and hashed on the fly, sources of already seen sizes
+/// are hashed first. Match is compared byte by byte and cloned into dst_fd (REFLINK), or linked as
+/// target->name (HARDLINK): then dst_fd is detached from destination and must be discarded by caller.
+/// Otherwise file is copied by copyFileFromFd. Hash of copied file is stored in target
+CpErr copyFileDedup(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags, DedupTarget *target);
+
+/// @brief Add copied file to index, path must stay valid while it is used by other threads
+void addDedupFile(off_t size, const DedupTarget *target, const char *path);
+
+/// @brief Fill index from cache file of previous runs; missing file is not an error
+bool loadDedupCache(const char *path);
+
+/// @brief Write index to cache file through temporary file and rename, then free index
+bool saveDedupCache(const char *path);
+
+#endif
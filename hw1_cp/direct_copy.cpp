@@ -0,0 +1,182 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "direct_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "ring_copy.h"
+#include "verify_copy.h"
+
+static bool setDirect(int fd, bool enable);
+
+static ssize_t readBlock(int fd, char *buffer, size_t size, off_t offset);
+
+static CpErr writeBlock(int fd, const char *buffer, size_t size, off_t offset);
+
+static bool setDirect(int fd, bool enable) {
+    int fd_flags = fcntl(fd, F_GETFL);
+    if (fd_flags < 0) return false;
+
+    fd_flags = (enable) ? fd_flags | O_DIRECT : fd_flags & ~O_DIRECT;
+    return fcntl(fd, F_SETFL, fd_flags) == 0;
+}
+
+/// @brief pread until size bytes or EOF
+static ssize_t readBlock(int fd, char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes_read = pread(fd, buffer + done, size - done, offset + (off_t) done);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes_read == 0) break;
+        done += bytes_read;
+    }
+
+    return (ssize_t) done;
+}
+
+static CpErr writeBlock(int fd, const char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, buffer, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::DST_WRITE, errno};
+        }
+
+        buffer += written;
+        offset += written;
+        size -= written;
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool copyFileDirect(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags, CpErr *status) {
+    assert(src_info); assert(context); assert(flags); assert(status);
+    if (!setDirect(src_fd, true)) return false;
+    if (!setDirect(dst_fd, true)) {
+        setDirect(src_fd, false);
+        return false;
+    }
+    context->method = CopyMethod::DIRECT;
+    // both engines copy from offset 0, so checksum of resumed head is not continued
+    context->checksum = 0;
+    context->has_checksum = flags->verify;
+
+    size_t buf_size = chooseBufferSize(src_info->st_blksize, DIRECT_ALIGN, src_info->st_size, flags->buffer_size);
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, 2 * buf_size);
+    if (!memory) {
+        *status = {CP_ERROR::SRC_READ, ENOMEM};
+        return true;
+    }
+
+    // with O_DIRECT only the last read may be short, so two slots keep device busy
+    CopyRing ring = {};
+    bool started = startRing(&ring, src_fd, 0, memory, buf_size, 2);
+    *status = (started) ? CpErr{CP_ERROR::SUCCESS, 0} : CpErr{CP_ERROR::SRC_READ, errno};
+
+    off_t offset = 0;
+    while (started) {
+        char *data = NULL;
+        ssize_t filled = ringNextSlot(&ring, &data);
+        if (filled < 0) {
+            *status = {CP_ERROR::SRC_READ, errno};
+            break;
+        }
+        if (filled == 0) break;
+        if (flags->verify) context->checksum = crc32c(context->checksum, data, filled);
+
+        // tail is padded with zeros to aligned size, extra bytes are cut below
+        size_t to_write = ((size_t) filled + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        memset(data + filled, 0, to_write - filled);
+        *status = writeBlock(dst_fd, data, to_write, offset);
+        if (status->code != CP_ERROR::SUCCESS) break;
+
+        offset += filled;
+        context->bytes_copied += filled;
+        progressAdd(context->progress, filled);
+        throttleIo(filled);
+        ringReleaseSlot(&ring);
+
+        if ((size_t) filled < buf_size) break;
+    }
+    if (started) stopRing(&ring);
+
+    if (status->code == CP_ERROR::SUCCESS && ftruncate(dst_fd, offset) < 0) {
+        *status = {CP_ERROR::DST_WRITE, errno};
+    }
+
+    setDirect(dst_fd, false);
+    setDirect(src_fd, false);
+    freeCopyBuffer(&local_buffer);
+    return true;
+}
+
+CpErr copyFileDropBehind(int src_fd, int dst_fd, const struct stat *src_info,
+                         CpContext_t *context, const struct copy_flags *flags) {
+    assert(src_info); assert(context); assert(flags);
+    context->method = CopyMethod::DROP_BEHIND;
+    context->checksum = 0;
+    context->has_checksum = flags->verify;
+
+    size_t buf_size = chooseBufferSize(src_info->st_blksize, BUF_SIZE, src_info->st_size, flags->buffer_size);
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, buf_size);
+    if (!memory) return {CP_ERROR::SRC_READ, ENOMEM};
+
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    CpErr status = {CP_ERROR::SUCCESS, 0};
+    off_t offset = 0, window_start = 0, prev_window = -1;
+    while (true) {
+        ssize_t bytes_read = readBlock(src_fd, memory, buf_size, offset);
+        if (bytes_read < 0) { status = {CP_ERROR::SRC_READ, errno}; break; }
+
+        if (bytes_read > 0) {
+            if (flags->verify) context->checksum = crc32c(context->checksum, memory, bytes_read);
+            status = writeBlock(dst_fd, memory, bytes_read, offset);
+            if (status.code != CP_ERROR::SUCCESS) break;
+            offset += bytes_read;
+            context->bytes_copied += bytes_read;
+            progressAdd(context->progress, bytes_read);
+            throttleIo(bytes_read);
+        }
+
+        bool at_end = bytes_read < (ssize_t) buf_size;
+        if (offset - window_start < (off_t) DROP_WINDOW && !at_end) continue;
+
+        // start writeback of this window; dirty pages can't be dropped, so previous one is waited for
+        off_t window_len = offset - window_start;
+        sync_file_range(dst_fd, window_start, window_len, SYNC_FILE_RANGE_WRITE);
+        posix_fadvise(src_fd, window_start, window_len, POSIX_FADV_DONTNEED);
+        if (prev_window >= 0) {
+            sync_file_range(dst_fd, prev_window, window_start - prev_window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(dst_fd, prev_window, window_start - prev_window, POSIX_FADV_DONTNEED);
+        }
+        prev_window = window_start;
+        window_start = offset;
+
+        if (at_end) {
+            sync_file_range(dst_fd, prev_window, offset - prev_window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(dst_fd, prev_window, offset - prev_window, POSIX_FADV_DONTNEED);
+            break;
+        }
+    }
+
+    freeCopyBuffer(&local_buffer);
+    return status;
+}
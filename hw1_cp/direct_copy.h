@@ -0,0 +1,24 @@
+#ifndef DIRECT_COPY_H
+#define DIRECT_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+const size_t DIRECT_ALIGN = BUF_SIZE;       ///< offset, length and memory alignment of O_DIRECT transfers
+const size_t DROP_WINDOW = 8 << 20;         ///< drop-behind copies and evicts this much at once
+
+/// @brief Copy with O_DIRECT on both descriptors: reader thread fills one aligned buffer while
+/// calling thread writes another. Unaligned tail is written padded to DIRECT_ALIGN and cut by ftruncate.
+/// Returns false if filesystem refuses O_DIRECT; nothing is copied then. File offsets are not used
+bool copyFileDirect(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags, CpErr *status);
+
+/// @brief Copy through page cache, but evict every written window of both files with
+/// sync_file_range + posix_fadvise(DONTNEED), so copy doesn't push out other cached data.
+/// File offsets are not used
+CpErr copyFileDropBehind(int src_fd, int dst_fd, const struct stat *src_info,
+                         CpContext_t *context, const struct copy_flags *flags);
+
+#endif
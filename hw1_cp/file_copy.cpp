@@ -9,39 +9,27 @@
 #include <stdbool.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "file_copy.h"
-
-static ssize_t Write(int fd, const void *buf, size_t count);
+#include "copy_engine.h"
+#include "update_copy.h"
+#include "atomic_write.h"
+#include "progress.h"
+#include "meta_copy.h"
+#include "dedup_copy.h"
+#include "verify_copy.h"
+#include "journal.h"
 
 static const char *findFileName(const char *path);
 
 static FileType getFileType(struct stat *file_info);
 
-static const char *createFileName(const char *src, const char *dst, bool dst_is_dir);
+static const char *createFileName(const char *src, const char *dst, bool dst_is_dir, char *buffer);
 
 static int getUserChoice(const char *path);
 
-static CpErr copyFileFromFd(int src_fd, int dst_fd);
-
-static ssize_t Write(int fd, const void *buf, size_t count) {
-    const uint8_t *byte_buf = (const uint8_t *)buf;
-
-    while (count > 0) {
-        ssize_t written = write(fd, byte_buf, count);
-        if (written < 0) {
-            if (errno == EINTR)
-                continue;
-
-            return written;
-        }
-
-        count -= written;
-        byte_buf += written;
-    }
-
-    return count;
-}
+static double getTime();
 
 static const char *findFileName(const char *path) {
     assert(path);
@@ -62,19 +50,18 @@ static FileType getFileType(struct stat *file_info) {
 
 }
 
-static const char *createFileName(const char *src, const char *dst, bool dst_is_dir) {
+/// @brief Returns dst or dst/src_name stored in buffer of MAX_PATH_LEN bytes; NULL if name is too long
+static const char *createFileName(const char *src, const char *dst, bool dst_is_dir, char *buffer) {
     assert(src);
     assert(dst);
-
-    static char buffer[MAX_PATH_LEN];
-    buffer[0] = '\0';
+    assert(buffer);
 
     if (dst_is_dir) {
         const char *src_name = findFileName(src);
 
-        strcat(buffer, dst);
-        strcat(buffer, "/"); /*  dir may have or not have /, so adding extra */
-        strcat(buffer, src_name);
+        /*  dir may have or not have /, so adding extra */
+        int len = snprintf(buffer, MAX_PATH_LEN, "%s/%s", dst, src_name);
+        if (len < 0 || len >= MAX_PATH_LEN) return NULL;
 
         return buffer;
     }
@@ -90,21 +77,10 @@ static int getUserChoice(const char *path) {
     return ans != 'n';
 }
 
-static CpErr copyFileFromFd(int src_fd, int dst_fd) {
-    char buffer[BUF_SIZE];
-    int bytes_read = 0;
-    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
-        int code = Write(dst_fd, buffer, bytes_read);
-        if (code < 0) {
-            return {CP_ERROR::DST_WRITE, code};
-        }
-    }
-
-    if (bytes_read < 0) {
-        return {CP_ERROR::SRC_READ, bytes_read};
-    }
-
-    return {CP_ERROR::SUCCESS, 0};
+static double getTime() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
 }
 
 /* =============================== GLOBAL SYMBOLS ================================= */
@@ -126,7 +102,6 @@ CpErr copyFile(CpContext_t *context, const struct copy_flags *flags) {
 
     struct stat dst_info = {};
     bool dst_is_dir = false;
-    bool allow_rewrite = flags->rewrite_existing;
     if (stat(dst, &dst_info) == 0) {
         dst_is_dir = getFileType(&dst_info) == FileType::DIR;
     }
@@ -135,11 +110,25 @@ CpErr copyFile(CpContext_t *context, const struct copy_flags *flags) {
         return {CP_ERROR::DST_NOT_DIR, 0};
     }
 
-    const char *dst_path = createFileName(src, dst, dst_is_dir);
+    const char *dst_path = createFileName(src, dst, dst_is_dir, context->path_buffer);
+    if (!dst_path) {
+        return {CP_ERROR::DST_PATH_LEN, 0};
+    }
     context->dst_path = dst_path;
 
+    return copyFileAt(context, AT_FDCWD, src, AT_FDCWD, dst_path, &src_info, flags);
+}
+
+CpErr copyFileAt(CpContext_t *context, int src_dirfd, const char *src_name,
+                 int dst_dirfd, const char *dst_name,
+                 const struct stat *src_info, const struct copy_flags *flags) {
+    assert(context); assert(src_name); assert(dst_name); assert(flags);
+    bool allow_rewrite = flags->rewrite_existing;
+    bool update_in_place = false;
+    bool resumed = false;       // destination is left by interrupted run recorded in journal
+
     struct stat real_dst_info = {};
-    if (stat(dst_path, &real_dst_info) == 0) {
+    if (fstatat(dst_dirfd, dst_name, &real_dst_info, 0) == 0) {
         // file exists
         if (getFileType(&real_dst_info) == FileType::DIR) {
             // example: cp hello  a
@@ -148,10 +137,18 @@ CpErr copyFile(CpContext_t *context, const struct copy_flags *flags) {
             return {CP_ERROR::DIR_REWRITE, 0};
         }
 
-        if (!allow_rewrite) {
+        if (flags->resume && !flags->update && getFileType(&real_dst_info) == FileType::REGULAR &&
+            journalLookup(context->dst_path, NULL, NULL) != JournalState::UNKNOWN) {
+            // skipped, continued or copied again below depending on record and source version;
+            // files without record are not ours and are protected like without --resume
+            resumed = true;
+        } else if (flags->update && getFileType(&real_dst_info) == FileType::REGULAR) {
+            // existing destination is synchronized, not replaced
+            update_in_place = true;
+        } else if (!allow_rewrite) {
             if (!flags->interactive) {
                 return {CP_ERROR::DST_REWRITE, 0};
-            } else if (!getUserChoice(dst_path)) {
+            } else if (!getUserChoice(context->dst_path)) {
                 return {CP_ERROR::USR_CANCEL, 0};
             } else {
                 allow_rewrite = true;
@@ -159,22 +156,121 @@ CpErr copyFile(CpContext_t *context, const struct copy_flags *flags) {
         }
     }
 
-    int src_fd = open(src, O_RDONLY);
+    int src_fd = openat(src_dirfd, src_name, O_RDONLY);
     if (src_fd < 0) {
         return {CP_ERROR::SRC_OPEN, errno};
     }
 
+    struct stat opened_info = {};
+    if (!src_info) {
+        if (fstat(src_fd, &opened_info) < 0) {
+            int src_errno = errno;
+            close(src_fd);
+            return {CP_ERROR::SRC_STAT, src_errno};
+        }
+        if (getFileType(&opened_info) != FileType::REGULAR) {
+            close(src_fd);
+            return {CP_ERROR::SRC_NOT_REGULAR, 0};
+        }
+        src_info = &opened_info;
+    }
+
+    off_t resume_offset = 0;
+    JournalState journal_state = (resumed) ? journalLookup(context->dst_path, src_info, &resume_offset) :
+                                             JournalState::UNKNOWN;
+    bool journal_done = journal_state == JournalState::DONE && real_dst_info.st_size == src_info->st_size;
+    // temporary file of atomic copy can't be continued
+    if (journal_state != JournalState::PARTIAL || flags->atomic) resume_offset = 0;
+
+    context->progress = progressThreadSlot();
+    if (journal_done || (update_in_place && !flags->checksum && isUpToDate(src_info, &real_dst_info))) {
+        progressEndFile(context->progress);
+        context->method = CopyMethod::UP_TO_DATE;
+        context->bytes_copied = 0;
+        context->copy_time = 0;
+        if (close(src_fd) < 0) return {CP_ERROR::SRC_CLOSE, errno};
+        return {CP_ERROR::SUCCESS, 0};
+    }
+
+    // atomic copy never touches existing destination, whole file is written to temporary one
+    bool replace = allow_rewrite || update_in_place || resumed;
+    if (flags->atomic) update_in_place = false;
 
-    int open_flags = (allow_rewrite) ? O_WRONLY | O_CREAT | O_TRUNC :
-                                       O_WRONLY | O_CREAT | O_EXCL;
+    // resumed destination is read back by tail check
+    int open_flags = (update_in_place || resume_offset > 0) ? O_RDWR :
+                     (replace)                              ? O_WRONLY | O_CREAT | O_TRUNC :
+                                                              O_WRONLY | O_CREAT | O_EXCL;
 
-    int dst_fd = open(dst_path, open_flags, src_info.st_mode);
+    AtomicDst atomic = {-1, NULL, ""};
+    int dst_fd = (flags->atomic) ? openAtomicDst(dst_dirfd, dst_name, src_info->st_mode, &atomic) :
+                                   openat(dst_dirfd, dst_name, open_flags, src_info->st_mode);
     if (dst_fd < 0) {
-        return {CP_ERROR::DST_OPEN, errno};
+        int dst_errno = errno;
+        close(src_fd);
+        return {CP_ERROR::DST_OPEN, dst_errno};
     }
 
-    struct CpErr copy_status = copyFileFromFd(src_fd, dst_fd);
-    if (copy_status.code != CP_ERROR::SUCCESS) return copy_status;
+    // without atomic destination name was created above, so duplicate always replaces it
+    DedupTarget dedup = {dst_dirfd, dst_name, !flags->atomic || replace, false, {0, 0}};
+    progressStartFile(context->progress, context->dst_path, src_info->st_size);
+    context->has_checksum = false;
+    context->checksum = 0;
+    if (resume_offset > 0) {
+        // partial destination is continued only if it ends with source data, otherwise copied again
+        uint32_t *checksum = (flags->verify) ? &context->checksum : NULL;
+        if (checkResumeTail(src_fd, dst_fd, resume_offset, context->buffer, checksum) &&
+            lseek(src_fd, resume_offset, SEEK_SET) == resume_offset &&
+            lseek(dst_fd, resume_offset, SEEK_SET) == resume_offset) {
+            progressAdd(context->progress, resume_offset);
+        } else {
+            resume_offset = 0;
+            context->checksum = 0;
+            if (lseek(src_fd, 0, SEEK_SET) < 0 || lseek(dst_fd, 0, SEEK_SET) < 0 || ftruncate(dst_fd, 0) < 0) {
+                int dst_errno = errno;
+                close(dst_fd);
+                close(src_fd);
+                return {CP_ERROR::DST_WRITE, dst_errno};
+            }
+        }
+    }
+
+    JournalFile journal_file = {};
+    if (!flags->atomic) journalStartFile(&journal_file, dst_fd, context->dst_path, src_info, resume_offset);
+    double start_time = getTime();
+    // continued file has only its tail in dedup hash, so it isn't deduplicated
+    struct CpErr copy_status = (update_in_place) ? copyFileDelta(src_fd, dst_fd, src_info, context, flags) :
+                               (flags->dedup != DedupMode::NONE && resume_offset == 0) ?
+                                   copyFileDedup(src_fd, dst_fd, src_info, context, flags, &dedup) :
+                                   copyFileFromFd(src_fd, dst_fd, src_info, context, flags);
+    context->copy_time = getTime() - start_time;
+    if (!flags->atomic) journalEndFile(&journal_file);
+    progressEndFile(context->progress);
+    if (copy_status.code == CP_ERROR::SUCCESS && context->method == CopyMethod::HARDLINK) {
+        // name belongs to inode of earlier copy with its own metadata, dst_fd is unnamed now
+        if (flags->atomic) abortAtomicDst(&atomic);
+        close(dst_fd);
+        if (close(src_fd) < 0) return {CP_ERROR::SRC_CLOSE, errno};
+        journalFileDone(context->dst_path, src_info);
+        return {CP_ERROR::SUCCESS, 0};
+    }
+    // linked and cloned duplicates were compared byte by byte instead
+    if (copy_status.code == CP_ERROR::SUCCESS && flags->verify && context->has_checksum) {
+        copy_status = verifyCopy(dst_fd, context);
+    }
+    if (copy_status.code == CP_ERROR::SUCCESS && flags->preserve) {
+        copy_status = copyMetadata(src_fd, dst_fd, src_info);
+    } else if (copy_status.code == CP_ERROR::SUCCESS && flags->update) {
+        copy_status = copyModificationTime(dst_fd, src_info);
+    }
+    if (copy_status.code == CP_ERROR::SUCCESS && flags->atomic) {
+        copy_status = commitAtomicDst(dst_fd, &atomic, replace, context->dst_path, flags);
+    }
+    if (copy_status.code != CP_ERROR::SUCCESS) {
+        if (flags->atomic) abortAtomicDst(&atomic);
+        close(dst_fd);
+        close(src_fd);
+        return copy_status;
+    }
 
     int dst_close = close(dst_fd);
     int dst_close_errno = errno;
@@ -182,6 +278,9 @@ CpErr copyFile(CpContext_t *context, const struct copy_flags *flags) {
     int src_close_errno = errno;
     if (dst_close < 0) return {CP_ERROR::DST_CLOSE, dst_close_errno};
     if (src_close < 0) return {CP_ERROR::SRC_CLOSE, src_close_errno};
+    if (flags->dedup != DedupMode::NONE && context->method != CopyMethod::REFLINK)
+        addDedupFile(src_info->st_size, &dedup, context->dst_path);
+    journalFileDone(context->dst_path, src_info);
 
     return {CP_ERROR::SUCCESS, 0};
 }
@@ -194,8 +293,18 @@ int parseCpErr(const CpContext_t *context, const CpErr cp_code, const struct cop
 
     switch (cp_code.code) {
         case CP_ERROR::SUCCESS:
-            if (flags->verbose) {
-                printf("'%s' -> '%s'\n", src, dst);
+            if (flags->verbose && (context->method == CopyMethod::DIRECTORY ||
+                                   context->method == CopyMethod::SYMLINK ||
+                                   context->method == CopyMethod::UP_TO_DATE ||
+                                   context->method == CopyMethod::REFLINK ||
+                                   context->method == CopyMethod::HARDLINK)) {
+                printf("'%s' -> '%s' (%s)\n", src, dst, copyMethodName(context->method));
+            } else if (flags->verbose) {
+                printf("'%s' -> '%s' (%s, %zu bytes", src, dst,
+                       copyMethodName(context->method), context->bytes_copied);
+                if (context->copy_time > 0 && context->bytes_copied > 0)
+                    printf(", %.1f MB/s", (double) context->bytes_copied / context->copy_time / 1e6);
+                printf(")\n");
             }
             break;
         case CP_ERROR::SRC_STAT:
@@ -233,6 +342,27 @@ int parseCpErr(const CpContext_t *context, const CpErr cp_code, const struct cop
             break;
         case CP_ERROR::USR_CANCEL:
             break;
+        case CP_ERROR::DST_PATH_LEN:
+            ERRPRINTF("Destination path for '%s' is too long\n", src);
+            break;
+        case CP_ERROR::DST_MKDIR:
+            ERRPRINTF("Can't create directory '%s':%s\n", dst, strerror(cp_code.cp_errno));
+            break;
+        case CP_ERROR::DST_SYMLINK:
+            ERRPRINTF("Can't create symlink '%s':%s\n", dst, strerror(cp_code.cp_errno));
+            break;
+        case CP_ERROR::DST_COMMIT:
+            ERRPRINTF("Can't move '%s' into place:%s\n", dst, strerror(cp_code.cp_errno));
+            break;
+        case CP_ERROR::DST_ATTR:
+            ERRPRINTF("Can't preserve attributes of '%s':%s\n", dst, strerror(cp_code.cp_errno));
+            break;
+        case CP_ERROR::VERIFY_MISMATCH:
+            if (cp_code.cp_errno != 0)
+                ERRPRINTF("Can't verify '%s':%s\n", dst, strerror(cp_code.cp_errno));
+            else
+                ERRPRINTF("Verification failed: '%s' differs from '%s'\n", dst, src);
+            break;
         default:
             assert("Unknown copy error" && false);
 
@@ -241,4 +371,19 @@ int parseCpErr(const CpContext_t *context, const CpErr cp_code, const struct cop
     return CP_CONTINUE;
 }
 
+/// @brief Parse size with optional K, M, G suffix; returns 0 on error
+size_t parseSize(const char *str) {
+    char *end = NULL;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (end == str) return 0;
+
+    switch (*end) {
+        case 'G': case 'g': value <<= 10; /* fall through */
+        case 'M': case 'm': value <<= 10; /* fall through */
+        case 'K': case 'k': value <<= 10; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
 
+    return (*end == '\0') ? (size_t) value : 0;
+}
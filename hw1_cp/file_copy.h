@@ -1,9 +1,12 @@
 #ifndef FILE_COPY_H
 #define FILE_COPY_H
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 const int MAX_PATH_LEN = 512;
-const size_t BUF_SIZE = 4096;
+const size_t BUF_SIZE = 4096;               ///< minimal read/write buffer, also its alignment
+const size_t DEFAULT_BUF_CAP = 1 << 20;     ///< default upper bound for read/write buffer
 
 enum class FileType {
     UNSUPPORTED,
@@ -11,11 +14,61 @@ enum class FileType {
     REGULAR,
 };
 
+/// @brief Copy engine selected by user
+enum class CopyEngine {
+    AUTO = 0,   ///< kernel offload chain with read/write fallback
+    READ_WRITE,
+    URING,      ///< io_uring, falls back to read/write if not available
+    MMAP,       ///< mapped windows of source written to destination
+    PIPELINE,   ///< reader thread and writer overlap through ring of buffers
+};
+
+enum class SparseMode {
+    AUTO = 0,   ///< keep holes of sparse source files
+    ALWAYS,     ///< also turn blocks of zeros into holes
+    NEVER,      ///< write holes as zeros
+};
+
+enum class CacheMode {
+    NORMAL = 0, ///< copy through page cache
+    DIRECT,     ///< O_DIRECT, drop-behind if filesystem doesn't support it
+    DROP,       ///< evict copied data from page cache behind the copy
+};
+
+enum class DedupMode {
+    NONE = 0,
+    AUTO,       ///< reflink duplicates, hardlink them if filesystem can't share extents
+    REFLINK,    ///< only reflink, copy if it is impossible
+    HARDLINK,   ///< always hardlink
+};
+
 struct copy_flags {
     bool only_dir_dst;
     bool rewrite_existing;
     bool interactive;
     bool verbose;
+    bool recursive;
+    bool preserve;      ///< keep owner, mode, timestamps and xattrs
+    size_t buffer_size; ///< upper bound for read/write buffer
+    int jobs;           ///< number of parallel copy threads
+    size_t chunk_threshold; ///< files of this size and bigger are split between jobs threads
+    CopyEngine engine;
+    SparseMode sparse;
+    bool update;        ///< skip files with same size and mtime, rewrite only changed blocks of others
+    bool checksum;      ///< with update: compare contents even if size and mtime match
+    CacheMode cache;
+    bool atomic;        ///< write to temporary file and rename it into place
+    int sync_every;     ///< with atomic: 1 - fdatasync each file, N - one syncfs per N files, 0 - no sync
+    double progress_interval;   ///< seconds between progress reports, 0 - only on SIGUSR1
+    int status_fd;      ///< machine-readable progress is written here instead of stderr, -1 if not used
+    DedupMode dedup;    ///< link files with content of already copied ones instead of copying
+    const char *dedup_cache;    ///< index of copied files kept between runs, NULL if not used
+    bool verify;        ///< checksum source while copying and compare with destination read back from device
+    size_t bw_limit;    ///< bytes per second of all copy threads together, 0 - unlimited
+    size_t iops_limit;  ///< read/write operations per second, 0 - unlimited
+    int control_fd;     ///< limits are changed by lines written here, -1 if not used
+    const char *journal;        ///< finished files and offsets of big ones are recorded here, NULL if not used
+    bool resume;        ///< skip files finished by interrupted run and continue partial ones from journal
 };
 
 enum class CP_ERROR {
@@ -32,24 +85,82 @@ enum class CP_ERROR {
     SRC_CLOSE,
     DST_CLOSE,
     USR_CANCEL,
+    DST_PATH_LEN,  // dst/file_name doesn't fit in MAX_PATH_LEN
+    DST_MKDIR,
+    DST_SYMLINK,
+    DST_COMMIT,    // temporary file can't be moved into place
+    DST_ATTR,      // owner, mode, timestamps or xattrs can't be preserved
+    VERIFY_MISMATCH, // destination read back differs from source or can't be read (cp_errno is set then)
 };
 
+enum class CopyMethod {
+    NONE = 0,
+    COPY_FILE_RANGE,
+    SENDFILE,
+    SPLICE,
+    READ_WRITE,
+    CHUNKED,
+    URING,
+    SPARSE,
+    MMAP,
+    PIPELINE,
+    DIRECT,
+    DROP_BEHIND,
+    DIRECTORY,  ///< created by recursive copy
+    SYMLINK,    ///< recreated by recursive copy
+    UP_TO_DATE, ///< skipped by update mode
+    DELTA,      ///< only changed blocks were rewritten by update mode
+    REFLINK,    ///< extents shared with identical copied file
+    HARDLINK,   ///< linked to identical copied file
+    ARCHIVE,    ///< packed into or extracted from tar stream
+};
+
+const char *copyMethodName(CopyMethod method);
+
 struct CpErr {
     CP_ERROR code;
     int cp_errno;
 };
 
 
+/// @brief Aligned heap buffer, grows on demand and is reused between files
+struct CopyBuffer {
+    void *data;
+    size_t capacity;
+};
+
+void freeCopyBuffer(CopyBuffer *buffer);
+
+struct ProgressSlot;
+
 typedef struct CpContext {
     const char *src;
     const char *dst;
     const char *dst_path; ///< Out parameter
+    CopyMethod method;    ///< Out parameter: engine which finished the copy
+    size_t bytes_copied;  ///< Out parameter
+    double copy_time;     ///< Out parameter: seconds spent moving data
+    CopyBuffer *buffer;   ///< Buffer for read/write fallback, may be NULL
+    ProgressSlot *progress; ///< Live counters of copying thread, set by copyFileAt, may be NULL
+    uint32_t checksum;    ///< Out parameter: CRC32C of source data, valid if has_checksum; read/write
+                          ///< engine continues value set by caller
+    bool has_checksum;    ///< Out parameter: copy engine computed checksum (only with verify)
+    char path_buffer[MAX_PATH_LEN]; ///< Storage for dst_path when dst is directory
 } CpContext_t;
 
 #define ERRPRINTF(...) fprintf(stderr, __VA_ARGS__)
 
 CpErr copyFile(CpContext_t *context, const struct copy_flags *flags);
 
+/// @brief Copy regular file src_dirfd/src_name to dst_dirfd/dst_name, paths in context are used only for messages
+/// If src_info is NULL source is checked after opening
+CpErr copyFileAt(CpContext_t *context, int src_dirfd, const char *src_name,
+                 int dst_dirfd, const char *dst_name,
+                 const struct stat *src_info, const struct copy_flags *flags);
+
+/// @brief Parse size with optional K, M, G suffix; returns 0 on error
+size_t parseSize(const char *str);
+
 const int CP_CONTINUE = 4;
 const int CP_FATAL = 5;
 int parseCpErr(const CpContext_t *context, const CpErr cp_code, const struct copy_flags *flags);
@@ -0,0 +1,429 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "journal.h"
+#include "copy_engine.h"
+#include "verify_copy.h"
+
+/// @brief Last record of destination in loaded journal
+struct JournalRecord {
+    char *path;
+    JournalState state;
+    off_t offset;
+    off_t size;             ///< source identity
+    struct timespec mtime;
+};
+
+/// @brief Offset taken from duplicated descriptor, so file may be closed while it is synced
+struct JournalPart {
+    long id;
+    int fd;
+    off_t offset;
+};
+
+/// @brief Records of earlier run (read-only after loadJournal) and journal of this run
+static struct {
+    pthread_mutex_t mtx;                ///< protects files, pending records and stop
+    pthread_cond_t wake;
+
+    JournalRecord *records;             ///< open addressing table
+    size_t record_count;
+    size_t record_capacity;
+
+    int fd;
+    int sync_fd;                        ///< file on destination filesystem, synced before done records
+    int error;                          ///< errno of failed journal write
+    JournalFile *files;
+    long next_id;
+    char *pending;                      ///< records waiting for next checkpoint
+    size_t pending_len;
+    size_t pending_capacity;
+    bool pending_done;                  ///< pending records include finished files
+    bool writing_done;                  ///< checkpoint is writing records of finished files
+
+    bool running;
+    bool stop;
+    pthread_t thread;
+} journal = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static uint64_t hashPath(const char *path);
+
+static JournalRecord *findRecord(const char *path);
+
+static bool insertRecord(JournalRecord record);
+
+static bool parseLine(char *line, JournalRecord *record);
+
+static void appendRecord(const char *kind, off_t offset, const char *path, const struct stat *src_info);
+
+static void writeRecords(const char *records, size_t length);
+
+/// @brief Called with journal.mtx held; errors are kept in journal.error, nothing is written after first one
+static void writeRecords(const char *records, size_t length) {
+    for (size_t done = 0; done < length && journal.error == 0;) {
+        ssize_t written = write(journal.fd, records + done, length - done);
+        if (written < 0 && errno != EINTR) journal.error = errno;
+        if (written > 0) done += written;
+    }
+}
+
+static ssize_t preadFull(int fd, char *buffer, size_t size, off_t offset);
+
+static void checkpoint();
+
+static void *journalThread(void *arg);
+
+/// @brief FNV-1a
+static uint64_t hashPath(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; path++) hash = (hash ^ (unsigned char) *path) * 0x100000001b3ULL;
+    return hash;
+}
+
+/// @brief Slot of path or empty slot where it belongs; table must have free slots
+static JournalRecord *findRecord(const char *path) {
+    size_t mask = journal.record_capacity - 1;
+    for (size_t idx = hashPath(path) & mask;; idx = (idx + 1) & mask) {
+        JournalRecord *record = &journal.records[idx];
+        if (!record->path || strcmp(record->path, path) == 0) return record;
+    }
+}
+
+/// @brief Later records of the same destination replace earlier ones
+static bool insertRecord(JournalRecord record) {
+    if (2 * (journal.record_count + 1) > journal.record_capacity) {
+        size_t capacity = (journal.record_capacity) ? 2 * journal.record_capacity : 1024;
+        JournalRecord *old_records = journal.records;
+        size_t old_capacity = journal.record_capacity;
+        journal.records = (JournalRecord *) calloc(capacity, sizeof(JournalRecord));
+        if (!journal.records) {
+            journal.records = old_records;
+            return false;
+        }
+        journal.record_capacity = capacity;
+        for (size_t idx = 0; idx < old_capacity; idx++) {
+            if (old_records[idx].path) *findRecord(old_records[idx].path) = old_records[idx];
+        }
+        free(old_records);
+    }
+
+    JournalRecord *slot = findRecord(record.path);
+    if (slot->path) {
+        free(record.path);
+        record.path = slot->path;
+    } else {
+        journal.record_count++;
+    }
+    *slot = record;
+    return true;
+}
+
+/// @brief "start|part|done OFFSET SIZE MTIME_SEC MTIME_NSEC PATH"; path is strdup'ed
+static bool parseLine(char *line, JournalRecord *record) {
+    size_t len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n') return false;     // torn by kill in the middle of write
+    line[len - 1] = '\0';
+
+    char kind[8] = "";
+    long long offset = 0, size = 0, sec = 0;
+    long nsec = 0;
+    int path_pos = 0;
+    if (sscanf(line, "%7s %lld %lld %lld %ld %n", kind, &offset, &size, &sec, &nsec, &path_pos) != 5 ||
+        path_pos == 0 || line[path_pos] == '\0') {
+        return false;
+    }
+
+    if      (strcmp(kind, "start") == 0) record->state = JournalState::STARTED;
+    else if (strcmp(kind, "part") == 0) record->state = JournalState::PARTIAL;
+    else if (strcmp(kind, "done") == 0) record->state = JournalState::DONE;
+    else return false;
+
+    record->offset = (off_t) offset;
+    record->size = (off_t) size;
+    record->mtime = {(time_t) sec, nsec};
+    record->path = strdup(line + path_pos);
+    return record->path != NULL;
+}
+
+/// @brief Called with journal.mtx held; record is dropped if memory is over
+static void appendRecord(const char *kind, off_t offset, const char *path, const struct stat *src_info) {
+    // journal is line based, such names can't be resumed
+    if (strchr(path, '\n')) return;
+
+    size_t need = journal.pending_len + strlen(path) + 128;
+    if (need > journal.pending_capacity) {
+        size_t capacity = (need > 2 * journal.pending_capacity) ? need : 2 * journal.pending_capacity;
+        char *pending = (char *) realloc(journal.pending, capacity);
+        if (!pending) return;
+        journal.pending = pending;
+        journal.pending_capacity = capacity;
+    }
+
+    journal.pending_len += snprintf(journal.pending + journal.pending_len,
+                                    journal.pending_capacity - journal.pending_len,
+                                    "%s %lld %lld %lld %ld %s\n", kind, (long long) offset,
+                                    (long long) src_info->st_size, (long long) src_info->st_mtim.tv_sec,
+                                    src_info->st_mtim.tv_nsec, path);
+}
+
+static ssize_t preadFull(int fd, char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes_read = pread(fd, buffer + done, size - done, offset + (off_t) done);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes_read == 0) break;
+        done += bytes_read;
+    }
+
+    return (ssize_t) done;
+}
+
+/// @brief Record offsets of big files in progress and write pending records durably
+/// Offset is recorded only after destination data before it is synced, done records only
+/// after syncfs of destination filesystem
+static void checkpoint() {
+    JournalPart parts[JOURNAL_MAX_PARTS] = {};
+    int count = 0;
+
+    pthread_mutex_lock(&journal.mtx);
+    for (JournalFile *file = journal.files; file && count < JOURNAL_MAX_PARTS; file = file->next) {
+        if (file->src_info->st_size < JOURNAL_PART_MIN) continue;
+        int fd = fcntl(file->dst_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) continue;
+        // dup shares file position with descriptor of copy engine
+        parts[count++] = {file->id, fd, lseek(fd, 0, SEEK_CUR)};
+    }
+    pthread_mutex_unlock(&journal.mtx);
+
+    for (int idx = 0; idx < count; idx++) {
+        if (parts[idx].offset <= 0 || fdatasync(parts[idx].fd) < 0) parts[idx].offset = -1;
+        close(parts[idx].fd);
+    }
+
+    pthread_mutex_lock(&journal.mtx);
+    // files finished meanwhile are not in list anymore, their done records must stay last
+    for (JournalFile *file = journal.files; file; file = file->next) {
+        for (int idx = 0; idx < count; idx++) {
+            if (parts[idx].id != file->id || parts[idx].offset <= file->recorded) continue;
+            appendRecord("part", parts[idx].offset, file->path, file->src_info);
+            file->recorded = parts[idx].offset;
+        }
+    }
+    char *pending = journal.pending;
+    size_t pending_len = journal.pending_len;
+    bool pending_done = journal.pending_done;
+    journal.pending = NULL;
+    journal.pending_len = journal.pending_capacity = 0;
+    journal.pending_done = false;
+    journal.writing_done = pending_done;
+    pthread_mutex_unlock(&journal.mtx);
+
+    if (pending_len > 0 && pending_done && journal.sync_fd >= 0) syncfs(journal.sync_fd);
+
+    // copying threads write start records too
+    pthread_mutex_lock(&journal.mtx);
+    writeRecords(pending, pending_len);
+    journal.writing_done = false;
+    pthread_mutex_unlock(&journal.mtx);
+    free(pending);
+
+    if (pending_len > 0 && fdatasync(journal.fd) < 0) {
+        int sync_errno = errno;
+        pthread_mutex_lock(&journal.mtx);
+        if (journal.error == 0) journal.error = sync_errno;
+        pthread_mutex_unlock(&journal.mtx);
+    }
+}
+
+static void *journalThread(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&journal.mtx);
+    while (!journal.stop) {
+        // condition variable waits by realtime clock
+        struct timespec deadline = {};
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) JOURNAL_INTERVAL;
+        pthread_cond_timedwait(&journal.wake, &journal.mtx, &deadline);
+        if (journal.stop) break;
+
+        pthread_mutex_unlock(&journal.mtx);
+        checkpoint();
+        pthread_mutex_lock(&journal.mtx);
+    }
+    pthread_mutex_unlock(&journal.mtx);
+
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool loadJournal(const char *path) {
+    assert(path);
+    FILE *file = fopen(path, "r");
+    if (!file) return errno == ENOENT;
+
+    bool damaged = false;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) >= 0) {
+        JournalRecord record = {};
+        if (!parseLine(line, &record) || !insertRecord(record)) {
+            free(record.path);
+            damaged = true;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return !damaged;
+}
+
+bool startJournal(const struct copy_flags *flags) {
+    assert(flags); assert(flags->journal);
+    assert(!journal.running);
+
+    journal.fd = open(flags->journal, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal.fd < 0) return false;
+    journal.sync_fd = -1;
+    journal.error = 0;
+    journal.stop = false;
+
+    int create_code = pthread_create(&journal.thread, NULL, journalThread, NULL);
+    if (create_code != 0) {
+        close(journal.fd);
+        errno = create_code;
+        return false;
+    }
+
+    journal.running = true;
+    return true;
+}
+
+bool stopJournal() {
+    if (!journal.running) return true;
+
+    pthread_mutex_lock(&journal.mtx);
+    journal.stop = true;
+    pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.mtx);
+    pthread_join(journal.thread, NULL);
+    journal.running = false;
+
+    checkpoint();
+    if (close(journal.fd) < 0 && journal.error == 0) journal.error = errno;
+    if (journal.sync_fd >= 0) close(journal.sync_fd);
+
+    for (size_t idx = 0; idx < journal.record_capacity; idx++) free(journal.records[idx].path);
+    free(journal.records);
+    journal.records = NULL;
+    journal.record_count = journal.record_capacity = 0;
+
+    errno = journal.error;
+    return journal.error == 0;
+}
+
+JournalState journalLookup(const char *dst_path, const struct stat *src_info, off_t *offset) {
+    assert(dst_path);
+    if (journal.record_count == 0) return JournalState::UNKNOWN;
+
+    const JournalRecord *record = findRecord(dst_path);
+    if (!record->path) return JournalState::UNKNOWN;
+    if (src_info && (record->size != src_info->st_size || record->mtime.tv_sec != src_info->st_mtim.tv_sec ||
+                     record->mtime.tv_nsec != src_info->st_mtim.tv_nsec)) {
+        return JournalState::UNKNOWN;
+    }
+
+    if (offset) *offset = record->offset;
+    return record->state;
+}
+
+bool checkResumeTail(int src_fd, int dst_fd, off_t offset, CopyBuffer *buffer, uint32_t *checksum) {
+    assert(offset > 0);
+    struct stat dst_info = {};
+    if (fstat(dst_fd, &dst_info) < 0 || dst_info.st_size < offset) return false;
+
+    size_t tail = ((off_t) JOURNAL_TAIL_CHECK < offset) ? JOURNAL_TAIL_CHECK : (size_t) offset;
+    CopyBuffer local_buffer = {NULL, 0};
+    if (!buffer) buffer = &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, 2 * JOURNAL_TAIL_CHECK);
+    if (!memory) return false;
+
+    bool same = preadFull(src_fd, memory, tail, offset - tail) == (ssize_t) tail &&
+                preadFull(dst_fd, memory + tail, tail, offset - tail) == (ssize_t) tail &&
+                memcmp(memory, memory + tail, tail) == 0;
+
+    // --verify compares checksum of whole file, so resumed copy starts with checksum of source head
+    if (same && checksum) {
+        *checksum = 0;
+        for (off_t pos = 0; pos < offset && same;) {
+            size_t part = (offset - pos < (off_t) JOURNAL_TAIL_CHECK) ? (size_t)(offset - pos) : JOURNAL_TAIL_CHECK;
+            same = preadFull(src_fd, memory, part, pos) == (ssize_t) part;
+            if (same) *checksum = crc32c(*checksum, memory, part);
+            pos += part;
+        }
+    }
+
+    freeCopyBuffer(&local_buffer);
+    return same;
+}
+
+void journalStartFile(JournalFile *file, int dst_fd, const char *dst_path, const struct stat *src_info, off_t offset) {
+    assert(file); assert(dst_path); assert(src_info); assert(offset >= 0);
+    if (!journal.running) return;
+
+    pthread_mutex_lock(&journal.mtx);
+    file->id = ++journal.next_id;
+    file->dst_fd = dst_fd;
+    file->path = dst_path;
+    file->src_info = src_info;
+    file->recorded = offset;
+    file->next = journal.files;
+    journal.files = file;
+    if (journal.sync_fd < 0) journal.sync_fd = fcntl(dst_fd, F_DUPFD_CLOEXEC, 0);
+
+    // continued file keeps its part record. Done record of earlier copy to the same path must stay
+    // before start record, so while done records wait for syncfs start record waits with them
+    if (offset == 0) {
+        bool direct = !journal.pending_done && !journal.writing_done;
+        size_t pending_len = journal.pending_len;
+        appendRecord("start", 0, dst_path, src_info);
+        if (direct && journal.pending_len > pending_len) {
+            writeRecords(journal.pending + pending_len, journal.pending_len - pending_len);
+            journal.pending_len = pending_len;
+        }
+    }
+    pthread_mutex_unlock(&journal.mtx);
+}
+
+void journalEndFile(JournalFile *file) {
+    assert(file);
+    if (!journal.running) return;
+
+    pthread_mutex_lock(&journal.mtx);
+    for (JournalFile **link = &journal.files; *link; link = &(*link)->next) {
+        if (*link == file) {
+            *link = file->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&journal.mtx);
+}
+
+void journalFileDone(const char *dst_path, const struct stat *src_info) {
+    assert(dst_path); assert(src_info);
+    if (!journal.running) return;
+
+    pthread_mutex_lock(&journal.mtx);
+    appendRecord("done", src_info->st_size, dst_path, src_info);
+    journal.pending_done = true;
+    pthread_mutex_unlock(&journal.mtx);
+}
@@ -0,0 +1,64 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "file_copy.h"
+
+const double JOURNAL_INTERVAL = 5.0;            ///< seconds between checkpoints of journal thread
+const off_t JOURNAL_PART_MIN = 16 << 20;        ///< smaller files are recorded only when they are done
+const size_t JOURNAL_TAIL_CHECK = 1 << 20;      ///< bytes before recorded offset compared with source on resume
+const int JOURNAL_MAX_PARTS = 64;               ///< files checkpointed at once, others wait for next round
+
+/// @brief What journal of interrupted run knows about destination file
+enum class JournalState {
+    UNKNOWN = 0,
+    STARTED,    ///< copy was started, nothing of it is known to be on disk
+    PARTIAL,    ///< copy was interrupted, data up to recorded offset is on disk
+    DONE,       ///< copy was finished
+};
+
+/// @brief File being copied, registered by copyFileAt so journal thread can checkpoint its offset
+struct JournalFile {
+    long id;
+    int dst_fd;
+    const char *path;
+    const struct stat *src_info;
+    off_t recorded;         ///< offset of last part record
+    JournalFile *next;
+};
+
+/// @brief Read journal of earlier run for --resume; missing file is empty journal
+/// Returns false if some lines are damaged, they are ignored then
+bool loadJournal(const char *path);
+
+/// @brief Open flags->journal for appending and start thread which checkpoints big files in progress
+/// every JOURNAL_INTERVAL seconds. Only offsets of engines which move file positions (kernel
+/// copies, read/write, mmap, pipeline) are recorded, other engines just restart interrupted files
+bool startJournal(const struct copy_flags *flags);
+
+/// @brief Write last records and stop journal thread; returns false if journal couldn't be written
+bool stopJournal();
+
+/// @brief State of dst_path in loaded journal; with src_info records of other source version
+/// (size or mtime differ) are UNKNOWN, offset of PARTIAL record is stored in offset
+JournalState journalLookup(const char *dst_path, const struct stat *src_info, off_t *offset);
+
+/// @brief Partial destination continues source if JOURNAL_TAIL_CHECK bytes before offset are equal
+/// With checksum CRC32C of source before offset is stored there for --verify
+bool checkResumeTail(int src_fd, int dst_fd, off_t offset, CopyBuffer *buffer, uint32_t *checksum);
+
+/// @brief Register file copied from offset, must be called before its first write
+/// Copy from offset 0 writes start record at once, so destination interrupted before its first checkpoint
+/// is known to be ours on resume. Record is not synced: it survives killed run, but not crash of the system
+void journalStartFile(JournalFile *file, int dst_fd, const char *dst_path, const struct stat *src_info, off_t offset);
+
+/// @brief Must be called before dst_fd is closed
+void journalEndFile(JournalFile *file);
+
+/// @brief Record finished file; it becomes durable with next checkpoint
+void journalFileDone(const char *dst_path, const struct stat *src_info);
+
+#endif
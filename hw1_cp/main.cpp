@@ -1,38 +1,216 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "file_copy.h"
+#include "copy_scheduler.h"
+#include "chunk_copy.h"
+#include "tree_copy.h"
+#include "atomic_write.h"
+#include "progress.h"
+#include "dedup_copy.h"
+#include "throttle.h"
+#include "tar_stream.h"
+#include "journal.h"
 
 void printHelpMsg() {
-    printf("Usage: ./cpcp [-vfih] source1 source2 ... dst\n"
+    printf("Usage: ./cpcp [-vfirph] [-j N] source1 source2 ... dst\n"
            "\tCopies files source1, source2, ... to dst\n"
            "\tdst may be file (only with one source file) or directory\n"
            "\n"
            "\t-v --verbose     Show log with copied files\n"
            "\t-i --interactive Ask to rewrite file\n"
            "\t-f --force       Rewrite existing files\n"
+           "\t-r --recursive   Copy directories with their content, symlinks are copied as symlinks\n"
+           "\t-p --preserve    Keep owner, mode, timestamps, xattrs and ACLs\n"
            "\t By default copy is not performed if dst already exists\n"
+           "\t-j --jobs=N      Copy up to N files in parallel (ignored with -i)\n"
+           "\t                 Files bigger than --chunk-threshold (default 256M) are\n"
+           "\t                 split into ranges copied by N threads\n"
+           "\t   --buffer-size=SIZE Max buffer for read/write copy (K, M, G suffixes), default 1M\n"
+           "\t   --chunk-threshold=SIZE Min file size for parallel ranges copy\n"
+           "\t   --engine=NAME    Copy engine: auto (kernel offload, default), rw, uring, mmap,\n"
+           "\t                    pipe (reader thread overlapping writes, for copies between devices)\n"
+           "\t   --sparse=WHEN    Keep holes: auto (of sparse sources, default), always\n"
+           "\t                    (also make holes from zero blocks), never\n"
+           "\t   --update         Skip files with same size and mtime as existing dst,\n"
+           "\t                    rewrite only changed blocks of other existing files\n"
+           "\t   --checksum       Like --update, but compare contents of all existing files\n"
+           "\t   --direct         Bypass page cache with O_DIRECT (holes are written as zeros)\n"
+           "\t   --drop-cache     Copy through page cache, but evict copied data behind the copy;\n"
+           "\t                    also used by --direct on filesystems without O_DIRECT\n"
+           "\t   --atomic         Write each file to temporary one and rename it into place,\n"
+           "\t                    so interrupted copy never leaves half-written dst\n"
+           "\t   --sync-every=N   With --atomic: make files durable before rename with one syncfs\n"
+           "\t                    per N files (default 64), 1 - fdatasync each file, 0 - no sync\n"
+           "\t   --progress[=SEC] Print progress, throughput and ETA to stderr every SEC seconds\n"
+           "\t                    (default 1); SIGUSR1 prints it at any moment even without this option\n"
+           "\t   --status-fd=FD   Write progress as key=value lines to FD instead of stderr\n"
+           "\t   --dedup[=HOW]    Files with content of already copied ones become reflinks or\n"
+           "\t                    hardlinks to them: auto (reflink, else hardlink, default),\n"
+           "\t                    reflink (copy if reflink is impossible), hardlink\n"
+           "\t   --dedup-cache=FILE Keep index of copied files in FILE for later runs, implies --dedup\n"
+           "\t   --verify         Checksum (CRC32C) data while copying and compare it with dst read\n"
+           "\t                    back bypassing page cache; sparse, cache bypass, parallel ranges,\n"
+           "\t                    pipeline and mmap copies keep working, zero-copy kernel calls\n"
+           "\t                    and io_uring are replaced by read/write\n"
+           "\t   --bwlimit=SIZE   Copy at most SIZE bytes per second (K, M, G suffixes) in all threads\n"
+           "\t   --iops-limit=N   Do at most N read/write operations per second in all threads\n"
+           "\t   --control-fd=FD  Read 'bwlimit=SIZE' and 'iops-limit=N' lines from FD while copying\n"
+           "\t                    (0 removes limit); SIGUSR2 suspends limits or restores them\n"
+           "\t   --journal=FILE   Record finished files and synced offsets of big files in FILE\n"
+           "\t   --resume         With --journal: skip files finished by interrupted run, continue\n"
+           "\t                    partial ones after checking their tail, copy again ones it only\n"
+           "\t                    started; run from the same directory\n"
+           "\t   --tar            Pack sources into tar archive dst ('-' - stdout) with large\n"
+           "\t                    sequential writes instead of creating each file\n"
+           "\t   --untar          With two arguments archive and dst: extract tar archive ('-' - stdin)\n"
+           "\t                    into directory dst\n"
            "\t-h --help        Show this message\n"
     );
 }
 
+/// @brief Parse engine name; returns false if name is unknown
+static bool parseEngine(const char *name, CopyEngine *engine) {
+    if      (strcmp(name, "auto")  == 0) *engine = CopyEngine::AUTO;
+    else if (strcmp(name, "rw")    == 0) *engine = CopyEngine::READ_WRITE;
+    else if (strcmp(name, "uring") == 0) *engine = CopyEngine::URING;
+    else if (strcmp(name, "mmap")  == 0) *engine = CopyEngine::MMAP;
+    else if (strcmp(name, "pipe")  == 0) *engine = CopyEngine::PIPELINE;
+    else return false;
+
+    return true;
+}
+
+/// @brief Parse --sparse argument; returns false if it is unknown
+static bool parseSparseMode(const char *name, SparseMode *mode) {
+    if      (strcmp(name, "auto")   == 0) *mode = SparseMode::AUTO;
+    else if (strcmp(name, "always") == 0) *mode = SparseMode::ALWAYS;
+    else if (strcmp(name, "never")  == 0) *mode = SparseMode::NEVER;
+    else return false;
+
+    return true;
+}
+
+/// @brief Parse --dedup argument; returns false if it is unknown
+static bool parseDedupMode(const char *name, DedupMode *mode) {
+    if      (strcmp(name, "auto")     == 0) *mode = DedupMode::AUTO;
+    else if (strcmp(name, "reflink")  == 0) *mode = DedupMode::REFLINK;
+    else if (strcmp(name, "hardlink") == 0) *mode = DedupMode::HARDLINK;
+    else return false;
+
+    return true;
+}
+
+/// @brief Copy one source (whole tree if it is directory and -r is set) and report result
+/// Returns CP_FATAL or CP_CONTINUE
+static int copySource(const char *src, const char *dst, CopyBuffer *buffer, const struct copy_flags *flags) {
+    struct stat src_info = {};
+    if (flags->recursive && stat(src, &src_info) == 0 && S_ISDIR(src_info.st_mode)) {
+        return (copyTree(src, dst, flags) == CP_FATAL) ? CP_FATAL : CP_CONTINUE;
+    }
+
+    CpContext_t context = {src, dst, NULL};
+    context.buffer = buffer;
+    CpErr cp_code = copyFile(&context, flags);
+    return parseCpErr(&context, cp_code, flags);
+}
+
+enum LongOnlyOptions {
+    OPT_BUFFER_SIZE = 256,
+    OPT_CHUNK_THRESHOLD,
+    OPT_ENGINE,
+    OPT_SPARSE,
+    OPT_UPDATE,
+    OPT_CHECKSUM,
+    OPT_DIRECT,
+    OPT_DROP_CACHE,
+    OPT_ATOMIC,
+    OPT_SYNC_EVERY,
+    OPT_PROGRESS,
+    OPT_STATUS_FD,
+    OPT_DEDUP,
+    OPT_DEDUP_CACHE,
+    OPT_VERIFY,
+    OPT_BWLIMIT,
+    OPT_IOPS_LIMIT,
+    OPT_CONTROL_FD,
+    OPT_TAR,
+    OPT_UNTAR,
+    OPT_JOURNAL,
+    OPT_RESUME,
+};
+
 int main(int argc, char *argv[]) {
     struct copy_flags flags = {.only_dir_dst     = false,
                                .rewrite_existing = false,
                                .interactive      = false,
-                               .verbose          = false
+                               .verbose          = false,
+                               .recursive        = false,
+                               .preserve         = false,
+                               .buffer_size      = DEFAULT_BUF_CAP,
+                               .jobs             = 1,
+                               .chunk_threshold  = DEFAULT_CHUNK_THRESHOLD,
+                               .engine           = CopyEngine::AUTO,
+                               .sparse           = SparseMode::AUTO,
+                               .update           = false,
+                               .checksum         = false,
+                               .cache            = CacheMode::NORMAL,
+                               .atomic           = false,
+                               .sync_every       = DEFAULT_SYNC_EVERY,
+                               .progress_interval = 0,
+                               .status_fd        = -1,
+                               .dedup            = DedupMode::NONE,
+                               .dedup_cache      = NULL,
+                               .verify           = false,
+                               .bw_limit         = 0,
+                               .iops_limit       = 0,
+                               .control_fd       = -1,
+                               .journal          = NULL,
+                               .resume           = false
                               };
+    ArchiveMode archive = ArchiveMode::NONE;
 
     struct option cmd_options[] = {
         {"verbose", no_argument, NULL, 'v' },
         {"force", no_argument, NULL, 'f' },
         {"interactive", no_argument, NULL, 'i' },
+        {"recursive", no_argument, NULL, 'r' },
+        {"preserve", no_argument, NULL, 'p' },
         {"help", no_argument, NULL, 'h'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"buffer-size", required_argument, NULL, OPT_BUFFER_SIZE},
+        {"chunk-threshold", required_argument, NULL, OPT_CHUNK_THRESHOLD},
+        {"engine", required_argument, NULL, OPT_ENGINE},
+        {"sparse", required_argument, NULL, OPT_SPARSE},
+        {"update", no_argument, NULL, OPT_UPDATE},
+        {"checksum", no_argument, NULL, OPT_CHECKSUM},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"drop-cache", no_argument, NULL, OPT_DROP_CACHE},
+        {"atomic", no_argument, NULL, OPT_ATOMIC},
+        {"sync-every", required_argument, NULL, OPT_SYNC_EVERY},
+        {"progress", optional_argument, NULL, OPT_PROGRESS},
+        {"status-fd", required_argument, NULL, OPT_STATUS_FD},
+        {"dedup", optional_argument, NULL, OPT_DEDUP},
+        {"dedup-cache", required_argument, NULL, OPT_DEDUP_CACHE},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"bwlimit", required_argument, NULL, OPT_BWLIMIT},
+        {"iops-limit", required_argument, NULL, OPT_IOPS_LIMIT},
+        {"control-fd", required_argument, NULL, OPT_CONTROL_FD},
+        {"tar", no_argument, NULL, OPT_TAR},
+        {"untar", no_argument, NULL, OPT_UNTAR},
+        {"journal", required_argument, NULL, OPT_JOURNAL},
+        {"resume", no_argument, NULL, OPT_RESUME},
         {NULL, 0, NULL, 0}
     };
 
     int ch = 0;
-    while ((ch = getopt_long(argc, argv, "vfih", cmd_options, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "vfirphj:", cmd_options, NULL)) != -1) {
         switch(ch) {
             case 'v':
                 flags.verbose = true;
@@ -43,6 +221,147 @@ int main(int argc, char *argv[]) {
             case 'f':
                 flags.rewrite_existing = true;
                 break;
+            case 'r':
+                flags.recursive = true;
+                break;
+            case 'p':
+                flags.preserve = true;
+                break;
+            case 'j':
+                flags.jobs = atoi(optarg);
+                if (flags.jobs <= 0) {
+                    ERRPRINTF("Invalid number of jobs '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_BUFFER_SIZE:
+                flags.buffer_size = parseSize(optarg);
+                if (flags.buffer_size == 0) {
+                    ERRPRINTF("Invalid buffer size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_CHUNK_THRESHOLD:
+                flags.chunk_threshold = parseSize(optarg);
+                if (flags.chunk_threshold == 0) {
+                    ERRPRINTF("Invalid chunk threshold '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_ENGINE:
+                if (!parseEngine(optarg, &flags.engine)) {
+                    ERRPRINTF("Unknown engine '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SPARSE:
+                if (!parseSparseMode(optarg, &flags.sparse)) {
+                    ERRPRINTF("Unknown sparse mode '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_UPDATE:
+                flags.update = true;
+                break;
+            case OPT_CHECKSUM:
+                flags.update = true;
+                flags.checksum = true;
+                break;
+            case OPT_DIRECT:
+                flags.cache = CacheMode::DIRECT;
+                break;
+            case OPT_DROP_CACHE:
+                flags.cache = CacheMode::DROP;
+                break;
+            case OPT_ATOMIC:
+                flags.atomic = true;
+                break;
+            case OPT_SYNC_EVERY: {
+                char *end = NULL;
+                long sync_every = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || sync_every < 0 || sync_every > INT_MAX) {
+                    ERRPRINTF("Invalid sync interval '%s'\n", optarg);
+                    return 1;
+                }
+                flags.sync_every = (int) sync_every;
+                break;
+            }
+            case OPT_PROGRESS: {
+                flags.progress_interval = DEFAULT_PROGRESS_INTERVAL;
+                char *end = NULL;
+                if (optarg) flags.progress_interval = strtod(optarg, &end);
+                if (optarg && (*end != '\0' || !(flags.progress_interval > 0))) {
+                    ERRPRINTF("Invalid progress interval '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case OPT_STATUS_FD: {
+                char *end = NULL;
+                long status_fd = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || status_fd < 0 || status_fd > INT_MAX ||
+                    fcntl((int) status_fd, F_GETFD) < 0) {
+                    ERRPRINTF("Invalid status fd '%s'\n", optarg);
+                    return 1;
+                }
+                flags.status_fd = (int) status_fd;
+                if (flags.progress_interval == 0) flags.progress_interval = DEFAULT_PROGRESS_INTERVAL;
+                break;
+            }
+            case OPT_DEDUP:
+                flags.dedup = DedupMode::AUTO;
+                if (optarg && !parseDedupMode(optarg, &flags.dedup)) {
+                    ERRPRINTF("Unknown dedup mode '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_DEDUP_CACHE:
+                flags.dedup_cache = optarg;
+                if (flags.dedup == DedupMode::NONE) flags.dedup = DedupMode::AUTO;
+                break;
+            case OPT_VERIFY:
+                flags.verify = true;
+                break;
+            case OPT_BWLIMIT:
+                flags.bw_limit = parseSize(optarg);
+                if (flags.bw_limit == 0) {
+                    ERRPRINTF("Invalid bandwidth limit '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_IOPS_LIMIT: {
+                char *end = NULL;
+                long iops_limit = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || iops_limit <= 0) {
+                    ERRPRINTF("Invalid IOPS limit '%s'\n", optarg);
+                    return 1;
+                }
+                flags.iops_limit = (size_t) iops_limit;
+                break;
+            }
+            case OPT_CONTROL_FD: {
+                char *end = NULL;
+                long control_fd = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || control_fd < 0 || control_fd > INT_MAX ||
+                    fcntl((int) control_fd, F_GETFD) < 0) {
+                    ERRPRINTF("Invalid control fd '%s'\n", optarg);
+                    return 1;
+                }
+                flags.control_fd = (int) control_fd;
+                break;
+            }
+            case OPT_TAR:
+                archive = ArchiveMode::PACK;
+                break;
+            case OPT_UNTAR:
+                archive = ArchiveMode::UNPACK;
+                break;
+            case OPT_JOURNAL:
+                flags.journal = optarg;
+                break;
+            case OPT_RESUME:
+                flags.resume = true;
+                break;
             case 'h':
             case '?':
                 printHelpMsg();
@@ -54,23 +373,83 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (flags.interactive) flags.jobs = 1; // questions from several threads would mix up
+
+    int result = 0;
+    CopyBuffer buffer = {NULL, 0}; // shared between all files
+
     if (argc - optind <= 1) {
         printHelpMsg();
         return 0;
+    }
+
+    if (archive == ArchiveMode::UNPACK && argc - optind != 2) {
+        ERRPRINTF("--untar takes archive and destination directory\n");
+        return 1;
+    }
+
+    if (flags.resume && !flags.journal) {
+        ERRPRINTF("--resume needs --journal\n");
+        return 1;
+    }
+    if (flags.resume && !loadJournal(flags.journal))
+        ERRPRINTF("Journal '%s' is damaged, unreadable lines are ignored\n", flags.journal);
+    if (flags.journal && !startJournal(&flags)) {
+        ERRPRINTF("Can't open journal '%s':%s\n", flags.journal, strerror(errno));
+        return 1;
+    }
+
+    if (flags.dedup_cache && !loadDedupCache(flags.dedup_cache))
+        ERRPRINTF("Dedup cache '%s' is damaged, unreadable lines are ignored\n", flags.dedup_cache);
+
+    if ((flags.bw_limit > 0 || flags.iops_limit > 0 || flags.control_fd >= 0) && !startThrottle(&flags)) {
+        ERRPRINTF("Can't start throttling:%s\n", strerror(errno));
+        return 1;
+    }
+
+    // archive modes count members themselves
+    if (startProgress(&flags) && archive == ArchiveMode::NONE) {
+        // directories add their files while they are walked
+        for (int idx = optind; idx < argc - 1; idx++) {
+            struct stat src_info = {};
+            if (stat(argv[idx], &src_info) == 0 && S_ISREG(src_info.st_mode))
+                progressAddTotal(1, src_info.st_size);
+        }
+    }
+
+    if (archive == ArchiveMode::PACK) {
+        result = packArchive(&argv[optind], argc - optind - 1, argv[argc-1], &flags);
+    } else if (archive == ArchiveMode::UNPACK) {
+        result = unpackArchive(argv[optind], argv[argc-1], &flags);
     } else if (argc - optind == 2) {
-        CpContext_t context = {argv[optind], argv[optind+1], NULL};
-        CpErr cp_code = copyFile(&context, &flags);
-        if (parseCpErr(&context, cp_code, &flags) == CP_FATAL)
-            return CP_FATAL;
+        if (copySource(argv[optind], argv[optind+1], &buffer, &flags) == CP_FATAL)
+            result = CP_FATAL;
+    } else if (flags.jobs > 1 && !flags.recursive) {
+        flags.only_dir_dst = true;
+        result = copyFilesParallel(&argv[optind], argc - optind - 1, argv[argc-1], &flags);
     } else {
         flags.only_dir_dst = true;
         for (int idx = optind; idx < argc - 1; idx++) {
-            CpContext_t context = {argv[idx], argv[argc-1], NULL};
-            CpErr cp_code = copyFile(&context, &flags);
-            if (parseCpErr(&context, cp_code, &flags) == CP_FATAL)
-                return CP_FATAL;
+            if (copySource(argv[idx], argv[argc-1], &buffer, &flags) == CP_FATAL) {
+                result = CP_FATAL;
+                break;
+            }
         }
     }
 
-    return 0;
+    // postponed renames of last batch
+    if (flags.atomic && !flushAtomicWrites() && result == 0) result = 1;
+    stopThrottle();
+    stopProgress();
+    if (!stopJournal()) {
+        ERRPRINTF("Can't write journal '%s':%s\n", flags.journal, strerror(errno));
+        if (result == 0) result = 1;
+    }
+    if (flags.dedup_cache && !saveDedupCache(flags.dedup_cache)) {
+        ERRPRINTF("Can't write dedup cache '%s':%s\n", flags.dedup_cache, strerror(errno));
+        if (result == 0) result = 1;
+    }
+
+    freeCopyBuffer(&buffer);
+    return result;
 }
@@ -0,0 +1,113 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/xattr.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "meta_copy.h"
+
+static ssize_t readXattr(int fd, bool list, const char *name, char **buffer, size_t *capacity);
+
+/// @brief flistxattr (list) or fgetxattr into growing buffer; returns length or -1
+static ssize_t readXattr(int fd, bool list, const char *name, char **buffer, size_t *capacity) {
+    while (true) {
+        ssize_t len = (list) ? flistxattr(fd, *buffer, *capacity) : fgetxattr(fd, name, *buffer, *capacity);
+        if (len >= 0 || errno != ERANGE) return len;
+
+        // attribute grew between calls or buffer is just small
+        ssize_t needed = (list) ? flistxattr(fd, NULL, 0) : fgetxattr(fd, name, NULL, 0);
+        if (needed < 0) return -1;
+        size_t new_capacity = ((size_t) needed > 2 * *capacity) ? (size_t) needed : 2 * *capacity;
+        char *memory = (char *) realloc(*buffer, new_capacity);
+        if (!memory) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buffer = memory;
+        *capacity = new_capacity;
+    }
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+CpErr copyMetadata(int src_fd, int dst_fd, const struct stat *src_info) {
+    assert(src_info);
+
+    mode_t mode = src_info->st_mode & 07777;
+    if (fchown(dst_fd, src_info->st_uid, src_info->st_gid) < 0) {
+        if (errno != EPERM) return {CP_ERROR::DST_ATTR, errno};
+        mode &= ~(mode_t)(S_ISUID | S_ISGID);   // don't hand out privileges of another owner
+    }
+    // chown clears setuid bits, umask cut the rest at open
+    if (fchmod(dst_fd, mode) < 0) return {CP_ERROR::DST_ATTR, errno};
+
+    CpErr status = copyXattrs(src_fd, dst_fd);
+    if (status.code != CP_ERROR::SUCCESS) return status;
+
+    struct timespec times[2] = {src_info->st_atim, src_info->st_mtim};
+    if (futimens(dst_fd, times) < 0) return {CP_ERROR::DST_ATTR, errno};
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+CpErr copyXattrs(int src_fd, int dst_fd) {
+    size_t names_capacity = XATTR_LIST_LEN, value_capacity = XATTR_LIST_LEN;
+    char *names = (char *) malloc(names_capacity);
+    char *value = (char *) malloc(value_capacity);
+    if (!names || !value) {
+        free(names); free(value);
+        return {CP_ERROR::DST_ATTR, ENOMEM};
+    }
+
+    CpErr status = {CP_ERROR::SUCCESS, 0};
+    ssize_t names_len = readXattr(src_fd, true, NULL, &names, &names_capacity);
+    if (names_len < 0 && errno != ENOTSUP) status = {CP_ERROR::SRC_READ, errno};
+
+    // list is sequence of zero-terminated names
+    for (ssize_t pos = 0; pos < names_len && status.code == CP_ERROR::SUCCESS;
+         pos += (ssize_t) strlen(names + pos) + 1) {
+        const char *name = names + pos;
+        ssize_t value_len = readXattr(src_fd, false, name, &value, &value_capacity);
+        if (value_len < 0) {
+            if (errno == ENODATA) continue;    // removed meanwhile
+            status = {CP_ERROR::SRC_READ, errno};
+            break;
+        }
+
+        if (fsetxattr(dst_fd, name, value, value_len, 0) < 0) {
+            if (errno == ENOTSUP) break;       // destination has no xattrs at all
+            if (errno == EPERM) continue;      // trusted.*, security.* need privileges
+            status = {CP_ERROR::DST_ATTR, errno};
+        }
+    }
+
+    free(names);
+    free(value);
+    return status;
+}
+
+CpErr copySymlinkMetadata(int dirfd, const char *name, const struct stat *src_info) {
+    assert(name); assert(src_info);
+    if (fchownat(dirfd, name, src_info->st_uid, src_info->st_gid, AT_SYMLINK_NOFOLLOW) < 0 && errno != EPERM) {
+        return {CP_ERROR::DST_ATTR, errno};
+    }
+
+    struct timespec times[2] = {src_info->st_atim, src_info->st_mtim};
+    if (utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) < 0) return {CP_ERROR::DST_ATTR, errno};
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+CpErr applyMetadataAt(int dirfd, const char *path, uid_t uid, gid_t gid, mode_t mode,
+                      const struct timespec times[2]) {
+    assert(path); assert(times);
+    if (fchownat(dirfd, path, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (errno != EPERM) return {CP_ERROR::DST_ATTR, errno};
+        mode &= ~(mode_t)(S_ISUID | S_ISGID);
+    }
+    if (fchmodat(dirfd, path, mode, 0) < 0) return {CP_ERROR::DST_ATTR, errno};
+    if (utimensat(dirfd, path, times, AT_SYMLINK_NOFOLLOW) < 0) return {CP_ERROR::DST_ATTR, errno};
+
+    return {CP_ERROR::SUCCESS, 0};
+}
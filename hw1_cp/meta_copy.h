@@ -0,0 +1,26 @@
+#ifndef META_COPY_H
+#define META_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+const size_t XATTR_LIST_LEN = 4096;     ///< initial buffer for names and values, grows on ERANGE
+
+/// @brief Give dst_fd owner, mode, extended attributes (POSIX ACLs included) and timestamps of source
+/// Ownership can't be changed by regular users: EPERM is ignored like in cp -p, setuid/setgid bits
+/// are dropped then. Timestamps are set last, after all writes
+CpErr copyMetadata(int src_fd, int dst_fd, const struct stat *src_info);
+
+/// @brief Copy extended attributes; attributes refused by destination (ENOTSUP, EPERM) are skipped
+CpErr copyXattrs(int src_fd, int dst_fd);
+
+/// @brief Owner and timestamps of symlink dirfd/name; symlink mode and xattrs can't be set on Linux
+CpErr copySymlinkMetadata(int dirfd, const char *name, const struct stat *src_info);
+
+/// @brief Owner, mode and timestamps of dirfd/path without opening it, for batched directory fixups
+CpErr applyMetadataAt(int dirfd, const char *path, uid_t uid, gid_t gid, mode_t mode,
+                      const struct timespec times[2]);
+
+#endif
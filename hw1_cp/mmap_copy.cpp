@@ -0,0 +1,65 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "mmap_copy.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool copyFileMmap(int src_fd, int dst_fd, const struct stat *src_info,
+                  CpContext_t *context, const struct copy_flags *flags, CpErr *status) {
+    assert(src_info); assert(context); assert(flags); assert(status);
+    off_t size = src_info->st_size;
+    off_t pos = lseek(src_fd, 0, SEEK_CUR);
+    if (size <= 0 || pos < 0) return false;
+
+    // mmap offset must be page aligned, window starts below pos if needed
+    off_t page = sysconf(_SC_PAGESIZE);
+    bool mapped_any = false;
+    *status = {CP_ERROR::SUCCESS, 0};
+
+    while (pos < size) {
+        off_t map_start = pos / page * page;
+        size_t map_len = ((size_t)(size - map_start) < MMAP_WINDOW) ? (size_t)(size - map_start) : MMAP_WINDOW;
+
+        char *window = (char *) mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, src_fd, map_start);
+        if (window == MAP_FAILED) {
+            if (!mapped_any) return false;
+            *status = {CP_ERROR::SRC_READ, errno};
+            break;
+        }
+        mapped_any = true;
+        context->method = CopyMethod::MMAP;
+        context->has_checksum = flags->verify;
+        madvise(window, map_len, MADV_SEQUENTIAL);
+
+        // write() faults pages in; dst is not mapped, so full disk is reported as error instead of SIGBUS
+        const char *data = window + (pos - map_start);
+        size_t left = map_len - (size_t)(pos - map_start);
+        while (left > 0) {
+            ssize_t written = write(dst_fd, data, throttleChunk(left));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                *status = {CP_ERROR::DST_WRITE, errno};
+                break;
+            }
+            if (flags->verify) context->checksum = crc32c(context->checksum, data, written);
+            data += written;
+            left -= written;
+            pos += written;
+            context->bytes_copied += written;
+            progressAdd(context->progress, written);
+            throttleIo(written);
+        }
+
+        munmap(window, map_len);
+        if (status->code != CP_ERROR::SUCCESS) break;
+    }
+
+    // next engine or caller expects source offset after copied data
+    lseek(src_fd, pos, SEEK_SET);
+    return true;
+}
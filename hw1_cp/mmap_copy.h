@@ -0,0 +1,20 @@
+#ifndef MMAP_COPY_H
+#define MMAP_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+const size_t MMAP_WINDOW = 64 << 20;        ///< bytes of source mapped at once, keeps address space use bounded
+const off_t MMAP_AUTO_MIN = 64 << 10;       ///< AUTO falls back to mmap instead of read/write from this size...
+const off_t MMAP_AUTO_MAX = 4 << 20;        ///< ...up to this one; bigger files stream faster through read/write
+
+/// @brief Copy src_fd from its current offset by mapping windows of it with MADV_SEQUENTIAL and writing them to dst_fd
+/// Returns false if source can't be mapped (pipes, /proc files, unknown size); nothing is copied then
+/// and caller should use another engine. Otherwise result is stored in status.
+/// With verify context->checksum is continued from mapped pages
+bool copyFileMmap(int src_fd, int dst_fd, const struct stat *src_info,
+                  CpContext_t *context, const struct copy_flags *flags, CpErr *status);
+
+#endif
@@ -0,0 +1,296 @@
+#include <unistd.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <new>
+
+#include "progress.h"
+
+/// @brief Reporter state, exists between startProgress and stopProgress
+static struct {
+    bool running;
+    double interval;
+    int status_fd;
+    pthread_t thread;
+    sem_t wake;                         ///< posted by SIGUSR1 and stopProgress
+    std::atomic<bool> stop;
+
+    pthread_key_t slot_key;
+    pthread_mutex_t slots_mtx;          ///< protects slots list and owned flags
+    ProgressSlot *slots;
+
+    std::atomic<size_t> total_files;
+    std::atomic<size_t> total_bytes;
+    double start_time;
+    double last_time;
+    size_t last_bytes;
+    struct sigaction old_action;
+} reporter = {};
+
+/// @brief Sum of all slots at one moment
+struct ProgressTotals {
+    size_t bytes;
+    size_t files;
+};
+
+static double getTime();
+
+static void onDumpSignal(int sig);
+
+static void releaseSlot(void *slot_ptr);
+
+static const char *formatSize(double bytes, char *buffer, size_t size);
+
+static void printReport(bool final);
+
+static void *reporterThread(void *arg);
+
+static double getTime() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+static void onDumpSignal(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    sem_post(&reporter.wake);
+    errno = saved_errno;
+}
+
+/// @brief Thread exit: slot keeps its counters and goes to the next thread
+static void releaseSlot(void *slot_ptr) {
+    ProgressSlot *slot = (ProgressSlot *) slot_ptr;
+    pthread_mutex_lock(&reporter.slots_mtx);
+    slot->owned = false;
+    pthread_mutex_unlock(&reporter.slots_mtx);
+}
+
+static const char *formatSize(double bytes, char *buffer, size_t size) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buffer, size, "%.1f %s", bytes, units[unit]);
+    return buffer;
+}
+
+static void printReport(bool final) {
+    double now = getTime();
+    double elapsed = now - reporter.start_time;
+
+    ProgressTotals done = {0, 0};
+    pthread_mutex_lock(&reporter.slots_mtx);
+    for (ProgressSlot *slot = reporter.slots; slot; slot = slot->next) {
+        done.bytes += slot->bytes.load(std::memory_order_relaxed);
+        done.files += slot->files.load(std::memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&reporter.slots_mtx);
+
+    size_t total_bytes = reporter.total_bytes.load(), total_files = reporter.total_files.load();
+    double interval = now - reporter.last_time;
+    double rate = (interval > 0) ? (double)(done.bytes - reporter.last_bytes) / interval : 0;
+    double avg_rate = (elapsed > 0) ? (double) done.bytes / elapsed : 0;
+    double files_rate = (elapsed > 0) ? (double) done.files / elapsed : 0;
+    reporter.last_time = now;
+    reporter.last_bytes = done.bytes;
+
+    // bytes give better estimate; directories walked on the fly only count files
+    double eta = -1;
+    if (total_bytes > done.bytes && avg_rate > 0) eta = (double)(total_bytes - done.bytes) / avg_rate;
+    else if (total_bytes == 0 && total_files > done.files && files_rate > 0)
+        eta = (double)(total_files - done.files) / files_rate;
+
+    if (reporter.status_fd >= 0) {
+        dprintf(reporter.status_fd, "time=%.3f bytes=%zu total_bytes=%zu rate=%.0f avg_rate=%.0f "
+                "files=%zu total_files=%zu files_rate=%.2f eta=%.0f final=%d\n",
+                elapsed, done.bytes, total_bytes, rate, avg_rate, done.files, total_files,
+                files_rate, eta, (int) final);
+    } else {
+        char done_str[32] = "", total_str[32] = "";
+        ERRPRINTF("[%.1fs] %s", elapsed, formatSize((double) done.bytes, done_str, sizeof(done_str)));
+        if (total_bytes > 0) {
+            ERRPRINTF(" / %s (%.1f%%)", formatSize((double) total_bytes, total_str, sizeof(total_str)),
+                      100.0 * (double) done.bytes / (double) total_bytes);
+        }
+        ERRPRINTF(", %.1f MB/s, %zu/%zu files (%.1f files/s)", (final ? avg_rate : rate) / 1e6,
+                  done.files, total_files, files_rate);
+        if (eta >= 0 && !final) ERRPRINTF(", ETA %.0fs", eta);
+        ERRPRINTF("\n");
+    }
+    if (final) return;
+
+    // files in progress; slot lock only guards name between files
+    pthread_mutex_lock(&reporter.slots_mtx);
+    for (ProgressSlot *slot = reporter.slots; slot; slot = slot->next) {
+        pthread_mutex_lock(&slot->mtx);
+        if (slot->active) {
+            size_t file_bytes = slot->file_bytes.load(std::memory_order_relaxed);
+            double file_time = now - slot->file_start;
+            double file_rate = (file_time > 0) ? (double) file_bytes / file_time : 0;
+            if (reporter.status_fd >= 0) {
+                dprintf(reporter.status_fd, "file=%s bytes=%zu size=%lld rate=%.0f\n",
+                        slot->file, file_bytes, (long long) slot->file_size, file_rate);
+            } else {
+                char done_str[32] = "", size_str[32] = "";
+                ERRPRINTF("    '%s' %s / %s, %.1f MB/s\n", slot->file,
+                          formatSize((double) file_bytes, done_str, sizeof(done_str)),
+                          formatSize((double) slot->file_size, size_str, sizeof(size_str)), file_rate / 1e6);
+            }
+        }
+        pthread_mutex_unlock(&slot->mtx);
+    }
+    pthread_mutex_unlock(&reporter.slots_mtx);
+}
+
+static void *reporterThread(void *arg) {
+    (void) arg;
+    double next_report = getTime() + reporter.interval;
+
+    while (true) {
+        int code = 0;
+        if (reporter.interval > 0) {
+            // sem_timedwait wants realtime clock
+            struct timespec deadline = {};
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            double wait = next_report - getTime();
+            if (wait < 0) wait = 0;
+            deadline.tv_sec += (time_t) wait;
+            deadline.tv_nsec += (long)((wait - (double)(time_t) wait) * 1e9);
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            code = sem_timedwait(&reporter.wake, &deadline);
+        } else {
+            code = sem_wait(&reporter.wake);
+        }
+        if (reporter.stop.load()) break;
+        if (code < 0 && errno == EINTR) continue;
+
+        printReport(false);
+        if (code < 0) next_report += reporter.interval;   // timeout, not SIGUSR1
+    }
+
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool startProgress(const struct copy_flags *flags) {
+    assert(flags);
+    assert(!reporter.running);
+
+    reporter.interval = flags->progress_interval;
+    reporter.status_fd = flags->status_fd;
+    reporter.slots = NULL;
+    reporter.stop.store(false);
+    reporter.total_files.store(0);
+    reporter.total_bytes.store(0);
+    reporter.start_time = reporter.last_time = getTime();
+    reporter.last_bytes = 0;
+
+    if (sem_init(&reporter.wake, 0, 0) < 0) return false;
+    pthread_mutex_init(&reporter.slots_mtx, NULL);
+    if (pthread_key_create(&reporter.slot_key, releaseSlot) != 0) {
+        sem_destroy(&reporter.wake);
+        return false;
+    }
+
+    if (pthread_create(&reporter.thread, NULL, reporterThread, NULL) != 0) {
+        pthread_key_delete(reporter.slot_key);
+        sem_destroy(&reporter.wake);
+        return false;
+    }
+    reporter.running = true;
+
+    struct sigaction action = {};
+    action.sa_handler = onDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, &reporter.old_action);
+    return true;
+}
+
+void stopProgress() {
+    if (!reporter.running) return;
+
+    sigaction(SIGUSR1, &reporter.old_action, NULL);
+    reporter.stop.store(true);
+    sem_post(&reporter.wake);
+    pthread_join(reporter.thread, NULL);
+    if (reporter.interval > 0) printReport(true);
+    reporter.running = false;
+
+    // main thread slot has no exit to release it
+    pthread_setspecific(reporter.slot_key, NULL);
+    pthread_key_delete(reporter.slot_key);
+    while (reporter.slots) {
+        ProgressSlot *slot = reporter.slots;
+        reporter.slots = slot->next;
+        pthread_mutex_destroy(&slot->mtx);
+        slot->~ProgressSlot();
+        free(slot);
+    }
+    pthread_mutex_destroy(&reporter.slots_mtx);
+    sem_destroy(&reporter.wake);
+}
+
+ProgressSlot *progressThreadSlot() {
+    if (!reporter.running) return NULL;
+
+    ProgressSlot *slot = (ProgressSlot *) pthread_getspecific(reporter.slot_key);
+    if (slot) return slot;
+
+    pthread_mutex_lock(&reporter.slots_mtx);
+    for (slot = reporter.slots; slot && slot->owned; slot = slot->next) {}
+    if (!slot) {
+        void *memory = calloc(1, sizeof(ProgressSlot));
+        slot = (memory) ? new(memory) ProgressSlot() : NULL;
+        if (slot) {
+            pthread_mutex_init(&slot->mtx, NULL);
+            slot->next = reporter.slots;
+            reporter.slots = slot;
+        }
+    }
+    if (slot) slot->owned = true;
+    pthread_mutex_unlock(&reporter.slots_mtx);
+
+    if (slot) pthread_setspecific(reporter.slot_key, slot);
+    return slot;
+}
+
+void progressAddTotal(size_t files, size_t bytes) {
+    if (!reporter.running) return;
+    reporter.total_files.fetch_add(files, std::memory_order_relaxed);
+    reporter.total_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void progressStartFile(ProgressSlot *slot, const char *name, off_t size) {
+    if (!slot) return;
+    assert(name);
+
+    pthread_mutex_lock(&slot->mtx);
+    slot->active = true;
+    snprintf(slot->file, PROGRESS_NAME_LEN, "%s", name);
+    slot->file_size = size;
+    slot->file_start = getTime();
+    slot->file_bytes.store(0, std::memory_order_relaxed);
+    pthread_mutex_unlock(&slot->mtx);
+}
+
+void progressEndFile(ProgressSlot *slot) {
+    if (!slot) return;
+
+    pthread_mutex_lock(&slot->mtx);
+    slot->active = false;
+    pthread_mutex_unlock(&slot->mtx);
+    slot->files.fetch_add(1, std::memory_order_relaxed);
+}
@@ -0,0 +1,53 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <atomic>
+
+#include "file_copy.h"
+
+const int PROGRESS_NAME_LEN = 256;
+const double DEFAULT_PROGRESS_INTERVAL = 1.0;   ///< seconds between reports with --progress
+
+/// @brief Counters of one copy thread; copy loops only add to atomics and never lock
+struct ProgressSlot {
+    std::atomic<size_t> bytes;          ///< all bytes copied through this slot
+    std::atomic<size_t> file_bytes;     ///< bytes of current file
+    std::atomic<size_t> files;          ///< finished files
+    ProgressSlot *next;                 ///< list of all slots, never shrinks while reporter runs
+    bool owned;                         ///< used by some thread
+
+    pthread_mutex_t mtx;                ///< protects current file below, taken only between files
+    bool active;
+    char file[PROGRESS_NAME_LEN];
+    off_t file_size;
+    double file_start;
+};
+
+/// @brief Account bytes copied by hot loop; slot may be NULL when reporter doesn't run
+static inline void progressAdd(ProgressSlot *slot, size_t bytes) {
+    if (!slot) return;
+    slot->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    slot->file_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/// @brief Start reporter thread and SIGUSR1 handler; with flags->progress_interval == 0
+/// stats are printed only on SIGUSR1. Reports go to stderr as text or to flags->status_fd as key=value lines
+bool startProgress(const struct copy_flags *flags);
+
+/// @brief Print final report (if periodic reports were requested) and stop reporter
+void stopProgress();
+
+/// @brief Slot of calling thread, taken on first call and returned at thread exit; NULL if reporter doesn't run
+ProgressSlot *progressThreadSlot();
+
+/// @brief Expected work for percentage and ETA; grows while directories are walked
+void progressAddTotal(size_t files, size_t bytes);
+
+void progressStartFile(ProgressSlot *slot, const char *name, off_t size);
+
+void progressEndFile(ProgressSlot *slot);
+
+#endif
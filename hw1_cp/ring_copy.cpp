@@ -0,0 +1,180 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "ring_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+static ssize_t readSlot(int fd, char *buffer, size_t size, off_t offset);
+
+static void *ringReader(void *ring_ptr);
+
+/// @brief pread until size bytes or EOF
+static ssize_t readSlot(int fd, char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes_read = pread(fd, buffer + done, size - done, offset + (off_t) done);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes_read == 0) break;
+        done += bytes_read;
+    }
+
+    return (ssize_t) done;
+}
+
+static void *ringReader(void *ring_ptr) {
+    CopyRing *ring = (CopyRing *) ring_ptr;
+
+    for (long idx = 0;; idx++) {
+        pthread_mutex_lock(&ring->mtx);
+        while (idx - ring->released >= ring->slots && !ring->stop)
+            pthread_cond_wait(&ring->empty, &ring->mtx);
+        bool stop = ring->stop;
+        pthread_mutex_unlock(&ring->mtx);
+        if (stop) break;
+
+        int slot = (int)(idx % ring->slots);
+        ssize_t bytes_read = readSlot(ring->src_fd, ring->memory + slot * ring->slot_size,
+                                      ring->slot_size, ring->offset);
+        int read_errno = errno;
+
+        pthread_mutex_lock(&ring->mtx);
+        ring->lengths[slot] = bytes_read;
+        if (bytes_read < 0) ring->read_errno = read_errno;
+        ring->filled++;
+        pthread_cond_signal(&ring->ready);
+        pthread_mutex_unlock(&ring->mtx);
+
+        if (bytes_read < (ssize_t) ring->slot_size) break;
+        ring->offset += bytes_read;
+    }
+
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool startRing(CopyRing *ring, int src_fd, off_t offset, char *memory, size_t slot_size, int slots) {
+    assert(ring); assert(memory); assert(slots > 0 && slots <= RING_MAX_SLOTS);
+    ring->src_fd = src_fd;
+    ring->offset = offset;
+    ring->memory = memory;
+    ring->slot_size = slot_size;
+    ring->slots = slots;
+    ring->filled = ring->released = 0;
+    ring->read_errno = 0;
+    ring->stop = false;
+
+    pthread_mutex_init(&ring->mtx, NULL);
+    pthread_cond_init(&ring->ready, NULL);
+    pthread_cond_init(&ring->empty, NULL);
+
+    int create_code = pthread_create(&ring->reader, NULL, ringReader, ring);
+    if (create_code != 0) {
+        pthread_cond_destroy(&ring->empty);
+        pthread_cond_destroy(&ring->ready);
+        pthread_mutex_destroy(&ring->mtx);
+        errno = create_code;
+        return false;
+    }
+
+    return true;
+}
+
+ssize_t ringNextSlot(CopyRing *ring, char **data) {
+    assert(ring); assert(data);
+    pthread_mutex_lock(&ring->mtx);
+    while (ring->filled == ring->released)
+        pthread_cond_wait(&ring->ready, &ring->mtx);
+    int slot = (int)(ring->released % ring->slots);
+    ssize_t length = ring->lengths[slot];
+    int read_errno = ring->read_errno;
+    pthread_mutex_unlock(&ring->mtx);
+
+    *data = ring->memory + slot * ring->slot_size;
+    if (length < 0) errno = read_errno;
+    return length;
+}
+
+void ringReleaseSlot(CopyRing *ring) {
+    assert(ring);
+    pthread_mutex_lock(&ring->mtx);
+    ring->released++;
+    pthread_cond_signal(&ring->empty);
+    pthread_mutex_unlock(&ring->mtx);
+}
+
+void stopRing(CopyRing *ring) {
+    assert(ring);
+    pthread_mutex_lock(&ring->mtx);
+    ring->stop = true;
+    pthread_cond_signal(&ring->empty);
+    pthread_mutex_unlock(&ring->mtx);
+
+    pthread_join(ring->reader, NULL);
+    pthread_cond_destroy(&ring->empty);
+    pthread_cond_destroy(&ring->ready);
+    pthread_mutex_destroy(&ring->mtx);
+}
+
+bool copyFileRing(int src_fd, int dst_fd, const struct stat *src_info,
+                  CpContext_t *context, const struct copy_flags *flags, CpErr *status) {
+    assert(src_info); assert(context); assert(flags); assert(status);
+    // previous engine of AUTO chain may have copied beginning already
+    off_t offset = lseek(src_fd, 0, SEEK_CUR);
+    if (offset < 0) return false;
+
+    struct stat dst_info = {};
+    blksize_t dst_block = (fstat(dst_fd, &dst_info) == 0) ? dst_info.st_blksize : 0;
+    size_t slot_size = chooseBufferSize(src_info->st_blksize, dst_block,
+                                        src_info->st_size - offset, flags->buffer_size);
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, slot_size * RING_SLOTS);
+    if (!memory) return false;
+
+    CopyRing ring = {};
+    if (!startRing(&ring, src_fd, offset, memory, slot_size, RING_SLOTS)) {
+        freeCopyBuffer(&local_buffer);
+        return false;
+    }
+    context->method = CopyMethod::PIPELINE;
+    context->has_checksum = flags->verify;
+    *status = {CP_ERROR::SUCCESS, 0};
+
+    while (true) {
+        char *data = NULL;
+        ssize_t length = ringNextSlot(&ring, &data);
+        if (length < 0) {
+            *status = {CP_ERROR::SRC_READ, errno};
+            break;
+        }
+        // continues checksum of data before current offset
+        if (flags->verify) context->checksum = crc32c(context->checksum, data, length);
+
+        for (ssize_t done = 0; done < length && status->code == CP_ERROR::SUCCESS;) {
+            ssize_t written = write(dst_fd, data + done, length - done);
+            if (written < 0 && errno != EINTR) *status = {CP_ERROR::DST_WRITE, errno};
+            if (written > 0) done += written;
+        }
+        if (status->code != CP_ERROR::SUCCESS) break;
+
+        context->bytes_copied += length;
+        progressAdd(context->progress, length);
+        throttleIo(length);
+        ringReleaseSlot(&ring);
+        if (length < (ssize_t) slot_size) break;
+    }
+
+    stopRing(&ring);
+    freeCopyBuffer(&local_buffer);
+    return true;
+}
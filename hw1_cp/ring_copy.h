@@ -0,0 +1,54 @@
+#ifndef RING_COPY_H
+#define RING_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "file_copy.h"
+
+const int RING_MAX_SLOTS = 16;
+const int RING_SLOTS = 8;                   ///< buffers in flight between reader and writer of pipeline engine
+const off_t RING_AUTO_MIN = 8 << 20;        ///< AUTO pipelines cross-device copies from this size
+
+/// @brief Ring of equal buffers filled by reader thread and emptied by calling thread, like moncat monitor
+/// Reader reads slots sequentially from src_fd with pread and stops after first short slot (EOF or error)
+struct CopyRing {
+    int src_fd;
+    off_t offset;           ///< source offset of next slot, used by reader only
+    char *memory;           ///< slots * slot_size bytes, aligned like CopyBuffer
+    size_t slot_size;
+    int slots;
+    pthread_t reader;
+
+    pthread_mutex_t mtx;    ///< protects everything below
+    pthread_cond_t ready;   ///< reader filled slot
+    pthread_cond_t empty;   ///< writer released slot
+    long filled;            ///< slots filled since start
+    long released;          ///< slots released since start
+    ssize_t lengths[RING_MAX_SLOTS];   ///< bytes in filled slot, -1 after read error
+    int read_errno;
+    bool stop;              ///< writer gave up, reader must exit
+};
+
+/// @brief Start reader thread over memory of slots * slot_size bytes from source offset
+/// Returns false with errno set if thread can't be created
+bool startRing(CopyRing *ring, int src_fd, off_t offset, char *memory, size_t slot_size, int slots);
+
+/// @brief Wait for next filled slot; returns its length (shorter than slot_size for the last one),
+/// 0 at EOF or -1 with errno set after read error. No slots follow short one
+ssize_t ringNextSlot(CopyRing *ring, char **data);
+
+/// @brief Give slot returned by ringNextSlot back to reader
+void ringReleaseSlot(CopyRing *ring);
+
+/// @brief Stop reader (it may be waiting for free slot) and join it
+void stopRing(CopyRing *ring);
+
+/// @brief Copy src_fd to dst_fd from their current offsets with RING_SLOTS buffers, so reads of
+/// source overlap writes of destination. Pays off when files are on different devices.
+/// Returns false if reader thread can't be started; nothing is copied then
+bool copyFileRing(int src_fd, int dst_fd, const struct stat *src_info,
+                  CpContext_t *context, const struct copy_flags *flags, CpErr *status);
+
+#endif
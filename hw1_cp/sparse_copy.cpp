@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "sparse_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+const blkcnt_t STAT_BLOCK_SIZE = 512; ///< unit of st_blocks
+
+/// @brief Copy state of one file
+struct SparseCopy {
+    int src_fd;
+    int dst_fd;
+    char *buffer;
+    size_t buf_size;
+    size_t block;           ///< granularity of zero detection
+    bool detect_zeros;
+    bool use_file_range;
+    size_t copied;
+    ProgressSlot *progress;
+    uint32_t *checksum;     ///< CRC32C of source continued here with verify, holes count as zeros
+};
+
+static bool isZeroBlock(const char *data, size_t size);
+
+static CpErr writeData(SparseCopy *copy, const char *data, size_t size, off_t offset);
+
+static CpErr copyExtent(SparseCopy *copy, off_t start, off_t end);
+
+static bool isZeroBlock(const char *data, size_t size) {
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static CpErr writeData(SparseCopy *copy, const char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(copy->dst_fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::DST_WRITE, errno};
+        }
+
+        data += written;
+        offset += written;
+        size -= written;
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+static CpErr copyExtent(SparseCopy *copy, off_t start, off_t end) {
+    loff_t in = start, out = start;
+    while (!copy->detect_zeros && !copy->checksum && copy->use_file_range && in < end) {
+        ssize_t moved = copy_file_range(copy->src_fd, &in, copy->dst_fd, &out,
+                                       throttleChunk((size_t)(end - in)), 0);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) {
+            // 0 before end isn't trusted as EOF: pread below stops at real EOF
+            copy->use_file_range = false;
+            break;
+        }
+
+        copy->copied += moved;
+        progressAdd(copy->progress, moved);
+        throttleIo(moved);
+    }
+
+    while (in < end) {
+        size_t to_read = ((size_t)(end - in) < copy->buf_size) ? (size_t)(end - in) : copy->buf_size;
+        ssize_t bytes_read = pread(copy->src_fd, copy->buffer, to_read, in);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return {CP_ERROR::SRC_READ, errno};
+        }
+        if (bytes_read == 0) break;
+        if (copy->checksum) *copy->checksum = crc32c(*copy->checksum, copy->buffer, bytes_read);
+
+        // writing runs of non-zero blocks, zero blocks are left as holes
+        size_t run_start = 0, pos = 0;
+        while (pos < (size_t) bytes_read) {
+            size_t len = ((size_t) bytes_read - pos < copy->block) ? (size_t) bytes_read - pos : copy->block;
+            if (copy->detect_zeros && isZeroBlock(copy->buffer + pos, len)) {
+                if (pos > run_start) {
+                    CpErr status = writeData(copy, copy->buffer + run_start, pos - run_start, in + run_start);
+                    if (status.code != CP_ERROR::SUCCESS) return status;
+                }
+                run_start = pos + len;
+            }
+            pos += len;
+        }
+        if (pos > run_start) {
+            CpErr status = writeData(copy, copy->buffer + run_start, pos - run_start, in + run_start);
+            if (status.code != CP_ERROR::SUCCESS) return status;
+        }
+
+        in += bytes_read;
+        copy->copied += bytes_read;
+        progressAdd(copy->progress, bytes_read);
+        throttleIo(bytes_read);
+    }
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool isSparseFile(const struct stat *info) {
+    assert(info);
+    return info->st_size > 0 && info->st_blocks * STAT_BLOCK_SIZE < info->st_size;
+}
+
+CpErr copyFileSparse(int src_fd, int dst_fd, const struct stat *src_info,
+                     CpContext_t *context, const struct copy_flags *flags) {
+    assert(src_info); assert(context); assert(flags);
+    context->method = CopyMethod::SPARSE;
+    context->bytes_copied = 0;
+
+    struct stat dst_info = {};
+    if (fstat(dst_fd, &dst_info) < 0) return {CP_ERROR::DST_WRITE, errno};
+    // freshly truncated destination already is one big hole, old content must be punched out
+    bool punch_holes = dst_info.st_size > 0;
+
+    SparseCopy copy = {};
+    copy.src_fd = src_fd;
+    copy.dst_fd = dst_fd;
+    copy.detect_zeros = flags->sparse == SparseMode::ALWAYS;
+    copy.use_file_range = true;
+    copy.progress = context->progress;
+    // copy starts at offset 0, so checksum of resumed head is not continued
+    context->checksum = 0;
+    context->has_checksum = flags->verify;
+    copy.checksum = (flags->verify) ? &context->checksum : NULL;
+    copy.block = (dst_info.st_blksize > 0) ? dst_info.st_blksize : BUF_SIZE;
+    copy.buf_size = chooseBufferSize(src_info->st_blksize, dst_info.st_blksize,
+                                     src_info->st_size, flags->buffer_size);
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    copy.buffer = (char *) reserveCopyBuffer(buffer, copy.buf_size);
+    if (!copy.buffer) return {CP_ERROR::SRC_READ, ENOMEM};
+
+    CpErr status = {CP_ERROR::SUCCESS, 0};
+    off_t size = src_info->st_size;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;              // only hole till the end
+            if (errno != EINVAL) { status = {CP_ERROR::SRC_READ, errno}; break; }
+            data = pos;                             // SEEK_DATA is not supported: all file is data
+        }
+
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (data > size) data = size;
+        if (hole < 0) hole = size;
+        if (hole > size) hole = size;
+        if (copy.checksum) *copy.checksum = crc32cZeros(*copy.checksum, data - pos);
+
+        if (punch_holes && data > pos) {
+            fallocate(dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, data - pos);
+        }
+
+        status = copyExtent(&copy, data, hole);
+        if (status.code != CP_ERROR::SUCCESS) break;
+        pos = hole;
+    }
+
+    if (status.code == CP_ERROR::SUCCESS && copy.checksum && pos < size) {
+        *copy.checksum = crc32cZeros(*copy.checksum, size - pos);
+    }
+    if (status.code == CP_ERROR::SUCCESS && punch_holes && pos < dst_info.st_size && pos < size) {
+        fallocate(dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size - pos);
+    }
+    // trailing hole has no data to write, size is set explicitly
+    if (status.code == CP_ERROR::SUCCESS && ftruncate(dst_fd, size) < 0) {
+        status = {CP_ERROR::DST_WRITE, errno};
+    }
+
+    context->bytes_copied = copy.copied;
+    freeCopyBuffer(&local_buffer);
+    return status;
+}
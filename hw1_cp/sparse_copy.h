@@ -0,0 +1,18 @@
+#ifndef SPARSE_COPY_H
+#define SPARSE_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+/// @brief File has less allocated blocks than its size, so it has holes
+bool isSparseFile(const struct stat *info);
+
+/// @brief Copy only data extents found with SEEK_DATA/SEEK_HOLE, holes are kept in destination
+/// With SparseMode::ALWAYS blocks of zeros inside data extents are turned into holes too.
+/// File offsets of descriptors are not used
+CpErr copyFileSparse(int src_fd, int dst_fd, const struct stat *src_info,
+                     CpContext_t *context, const struct copy_flags *flags);
+
+#endif
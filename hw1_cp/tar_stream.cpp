@@ -0,0 +1,1063 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "tar_stream.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "meta_copy.h"
+#include "throttle.h"
+
+/// @brief ustar header block, GNU format has the same layout
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char dev_major[8];
+    char dev_minor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK, "tar header must take one block");
+
+const char TAR_REGULAR = '0';
+const char TAR_OLD_REGULAR = '\0';
+const char TAR_HARDLINK = '1';
+const char TAR_SYMLINK = '2';
+const char TAR_DIRECTORY = '5';
+const char TAR_CONTIGUOUS = '7';
+const char TAR_GNU_LONG_NAME = 'L';     ///< data of this entry is name of the next one
+const char TAR_GNU_LONG_LINK = 'K';     ///< data of this entry is link target of the next one
+const char TAR_PAX = 'x';               ///< pax records for the next entry
+const char TAR_PAX_GLOBAL = 'g';
+
+const char *GNU_LONG_LINK_NAME = "././@LongLink";
+const size_t TAR_NAME_LEN = sizeof(((TarHeader *) NULL)->name) + sizeof(((TarHeader *) NULL)->prefix) + 2;
+
+static const char ZERO_BLOCK[TAR_BLOCK] = {};
+
+/// @brief Archive written or read through one big buffer
+struct TarStream {
+    int fd;
+    const char *path;           ///< archive name for messages
+    char *buffer;               ///< TAR_BUFFER bytes
+    size_t start;               ///< unpack: first unconsumed byte
+    size_t end;                 ///< pack: bytes waiting for write; unpack: bytes read into buffer
+    bool eof;
+    int error;                  ///< errno of failed archive I/O, stream is dead after it
+    CopyBuffer memory;
+    const struct copy_flags *flags;
+    ProgressSlot *progress;
+
+    dev_t archive_dev;          ///< pack: archive itself is skipped if it is inside source
+    ino_t archive_ino;
+};
+
+/// @brief Header of extracted entry with GNU/pax long names applied
+struct TarMember {
+    char *path;                 ///< relative to destination, "" is destination itself
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;                 ///< data bytes following header
+    struct timespec times[2];
+    const char *link;           ///< symlink target or hardlink source
+};
+
+/// @brief Mode and times of extracted directory, applied after extraction like in tree copy
+struct TarFixup {
+    char *path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec times[2];
+};
+
+struct TarUnpack {
+    TarStream stream;
+    const char *root_path;
+    int root_fd;
+
+    char parent_path[PATH_MAX]; ///< directory of previous member, relative to root
+    size_t parent_len;
+    int parent_fd;              ///< -1 if not opened
+
+    TarFixup *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+};
+
+static char *joinPath(const char *dir, const char *name);
+
+static size_t paddingOf(off_t size);
+
+static void reportMember(const TarStream *stream, const char *src, const char *dst,
+                         CopyMethod method, size_t bytes, CpErr err);
+
+static bool flushStream(TarStream *stream);
+
+static void streamWrite(TarStream *stream, const void *data, size_t size);
+
+static void streamZeros(TarStream *stream, size_t size);
+
+static void putNumber(char *field, size_t width, unsigned long long value);
+
+static void putHeader(TarStream *stream, const char *name, const struct stat *info,
+                      char type, off_t size, const char *link);
+
+static char *memberName(const char *src);
+
+static void packFile(TarStream *stream, int dirfd, const char *name, const char *src_path, const char *member);
+
+static void packSymlink(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                        const char *src_path, const char *member);
+
+static void packDir(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                    const char *src_path, const char *member);
+
+static void packEntry(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                      const char *src_path, const char *member);
+
+static bool fillStream(TarStream *stream, size_t need);
+
+static bool skipStream(TarStream *stream, off_t size);
+
+static char *readBlob(TarStream *stream, off_t size);
+
+static bool parseNumber(const char *field, size_t width, unsigned long long *value);
+
+static bool checkHeader(const TarHeader *header);
+
+static void parsePax(char *records, size_t size, char **path, char **link);
+
+static char *safeMemberPath(char *path);
+
+static int openBeneath(int root_fd, const char *path);
+
+static int memberParent(TarUnpack *unpack, const char *path, const char **name);
+
+static void addFixup(TarUnpack *unpack, const TarMember *member);
+
+static void applyFixups(TarUnpack *unpack);
+
+static CpErr replaceExisting(TarUnpack *unpack, int dir_fd, const char *name);
+
+static CpErr extractFile(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name,
+                         size_t *bytes, bool *truncated);
+
+static CpErr extractDir(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name);
+
+static CpErr extractSymlink(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name);
+
+static CpErr extractHardlink(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name);
+
+static bool extractMember(TarUnpack *unpack, TarMember *member);
+
+static char *joinPath(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = (char *) malloc(dir_len + name_len + 2);
+    if (!path) return NULL;
+
+    memcpy(path, dir, dir_len);
+    size_t pos = dir_len;
+    if (dir_len > 0 && dir[dir_len - 1] != '/') path[pos++] = '/';
+    memcpy(path + pos, name, name_len + 1);
+    return path;
+}
+
+/// @brief Zeros which complete data of size bytes to whole blocks
+static size_t paddingOf(off_t size) {
+    return (TAR_BLOCK - (size_t) size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static void reportMember(const TarStream *stream, const char *src, const char *dst,
+                         CopyMethod method, size_t bytes, CpErr err) {
+    CpContext_t context = {};
+    context.src = src;
+    context.dst = dst;
+    context.dst_path = dst;
+    context.method = method;
+    context.bytes_copied = bytes;
+
+    parseCpErr(&context, err, stream->flags);
+}
+
+/// @brief Write whole buffer; requests are cut by throttleChunk so --bwlimit stays smooth
+static bool flushStream(TarStream *stream) {
+    size_t done = 0;
+    while (done < stream->end) {
+        ssize_t written = write(stream->fd, stream->buffer + done, throttleChunk(stream->end - done));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            stream->error = errno;
+            return false;
+        }
+        done += written;
+        throttleIo(written);
+    }
+
+    stream->end = 0;
+    return true;
+}
+
+static void streamWrite(TarStream *stream, const void *data, size_t size) {
+    const char *bytes = (const char *) data;
+    while (size > 0 && stream->error == 0) {
+        if (stream->end == TAR_BUFFER && !flushStream(stream)) return;
+
+        size_t part = TAR_BUFFER - stream->end;
+        if (part > size) part = size;
+        memcpy(stream->buffer + stream->end, bytes, part);
+        stream->end += part;
+        bytes += part;
+        size -= part;
+    }
+}
+
+static void streamZeros(TarStream *stream, size_t size) {
+    while (size > 0 && stream->error == 0) {
+        size_t part = (size < TAR_BLOCK) ? size : TAR_BLOCK;
+        streamWrite(stream, ZERO_BLOCK, part);
+        size -= part;
+    }
+}
+
+/// @brief Octal number terminated by NUL; values which don't fit use GNU base-256 encoding
+static void putNumber(char *field, size_t width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), value);
+        return;
+    }
+
+    for (size_t idx = width - 1; idx > 0; idx--) {
+        field[idx] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+/// @brief Header of one entry, preceded by GNU long name entries if name or link don't fit
+static void putHeader(TarStream *stream, const char *name, const struct stat *info,
+                      char type, off_t size, const char *link) {
+    TarHeader header = {};
+    size_t name_len = strlen(name);
+    size_t link_len = (link) ? strlen(link) : 0;
+
+    if (name_len > sizeof(header.name)) {
+        struct stat long_info = {};
+        putHeader(stream, GNU_LONG_LINK_NAME, &long_info, TAR_GNU_LONG_NAME, name_len + 1, NULL);
+        streamWrite(stream, name, name_len + 1);
+        streamZeros(stream, paddingOf(name_len + 1));
+    }
+    if (link_len > sizeof(header.link_name)) {
+        struct stat long_info = {};
+        putHeader(stream, GNU_LONG_LINK_NAME, &long_info, TAR_GNU_LONG_LINK, link_len + 1, NULL);
+        streamWrite(stream, link, link_len + 1);
+        streamZeros(stream, paddingOf(link_len + 1));
+    }
+
+    // truncated names are replaced by long name entry on extraction
+    memcpy(header.name, name, (name_len < sizeof(header.name)) ? name_len : sizeof(header.name));
+    if (link) memcpy(header.link_name, link, (link_len < sizeof(header.link_name)) ? link_len : sizeof(header.link_name));
+    putNumber(header.mode, sizeof(header.mode), info->st_mode & 07777);
+    putNumber(header.uid, sizeof(header.uid), info->st_uid);
+    putNumber(header.gid, sizeof(header.gid), info->st_gid);
+    putNumber(header.size, sizeof(header.size), size);
+    putNumber(header.mtime, sizeof(header.mtime), (info->st_mtime > 0) ? info->st_mtime : 0);
+    header.type = type;
+    memcpy(header.magic, "ustar ", sizeof(header.magic));
+    memcpy(header.version, " ", sizeof(header.version));
+
+    // checksum is counted with its own field filled by spaces
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned int checksum = 0;
+    for (size_t idx = 0; idx < TAR_BLOCK; idx++) checksum += ((const unsigned char *) &header)[idx];
+    snprintf(header.checksum, sizeof(header.checksum) - 1, "%06o", checksum);
+
+    streamWrite(stream, &header, TAR_BLOCK);
+}
+
+/// @brief Name of source in archive: its basename, like cp -r names the copy
+static char *memberName(const char *src) {
+    char *name = strdup(src);
+    if (!name) return NULL;
+
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') name[--len] = '\0';
+    const char *slash = strrchr(name, '/');
+    const char *base = (slash && slash[1]) ? slash + 1 : name;
+    // content of . and .. is packed without prefix, unpack refuses names with ".."
+    if (strcmp(base, "..") == 0 || strcmp(base, "/") == 0) base = ".";
+
+    memmove(name, base, strlen(base) + 1);
+    return name;
+}
+
+static void packFile(TarStream *stream, int dirfd, const char *name, const char *src_path, const char *member) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    struct stat info = {};
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        reportMember(stream, src_path, member, CopyMethod::ARCHIVE, 0, {CP_ERROR::SRC_OPEN, errno});
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (!S_ISREG(info.st_mode)) {
+        reportMember(stream, src_path, member, CopyMethod::ARCHIVE, 0, {CP_ERROR::SRC_NOT_REGULAR, 0});
+        close(fd);
+        return;
+    }
+    if (info.st_dev == stream->archive_dev && info.st_ino == stream->archive_ino) {
+        close(fd);
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    progressStartFile(stream->progress, src_path, info.st_size);
+    putHeader(stream, member, &info, TAR_REGULAR, info.st_size, NULL);
+
+    // data is read straight into free part of stream buffer, small files share one write
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    off_t remaining = info.st_size;
+    while (remaining > 0 && stream->error == 0) {
+        if (stream->end == TAR_BUFFER && !flushStream(stream)) break;
+
+        size_t part = TAR_BUFFER - stream->end;
+        if ((off_t) part > remaining) part = (size_t) remaining;
+        ssize_t bytes_read = read(fd, stream->buffer + stream->end, part);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) {
+            // size is already in header: file which shrank or can't be read is padded with zeros
+            err = {CP_ERROR::SRC_READ, (bytes_read < 0) ? errno : ENODATA};
+            streamZeros(stream, (size_t) remaining);
+            break;
+        }
+
+        stream->end += bytes_read;
+        remaining -= bytes_read;
+        progressAdd(stream->progress, bytes_read);
+    }
+    streamZeros(stream, paddingOf(info.st_size));
+    progressEndFile(stream->progress);
+    close(fd);
+
+    if (stream->error == 0)
+        reportMember(stream, src_path, member, CopyMethod::ARCHIVE, info.st_size - remaining, err);
+}
+
+static void packSymlink(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                        const char *src_path, const char *member) {
+    char target[PATH_MAX + 1] = "";
+    ssize_t len = readlinkat(dirfd, name, target, PATH_MAX);
+    if (len < 0) {
+        reportMember(stream, src_path, member, CopyMethod::SYMLINK, 0, {CP_ERROR::SRC_READ, errno});
+        return;
+    }
+    target[len] = '\0';
+
+    putHeader(stream, member, info, TAR_SYMLINK, 0, target);
+    if (stream->error == 0) reportMember(stream, src_path, member, CopyMethod::SYMLINK, 0, {CP_ERROR::SUCCESS, 0});
+}
+
+static void packDir(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                    const char *src_path, const char *member) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (!dir) {
+        reportMember(stream, src_path, member, CopyMethod::DIRECTORY, 0, {CP_ERROR::SRC_OPEN, errno});
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    // directories are stored with trailing slash, like tar does
+    char *dir_member = joinPath(member, "");
+    if (!dir_member) {
+        reportMember(stream, src_path, member, CopyMethod::DIRECTORY, 0, {CP_ERROR::SRC_READ, ENOMEM});
+        closedir(dir);
+        return;
+    }
+    if (strcmp(dir_member, "./") != 0) putHeader(stream, dir_member, info, TAR_DIRECTORY, 0, NULL);
+    if (stream->error == 0) reportMember(stream, src_path, dir_member, CopyMethod::DIRECTORY, 0, {CP_ERROR::SUCCESS, 0});
+    free(dir_member);
+
+    struct dirent *entry = NULL;
+    while (stream->error == 0) {
+        errno = 0;
+        if ((entry = readdir(dir)) == NULL) {
+            if (errno != 0)
+                reportMember(stream, src_path, member, CopyMethod::DIRECTORY, 0, {CP_ERROR::SRC_READ, errno});
+            break;
+        }
+
+        const char *child = entry->d_name;
+        if (strcmp(child, ".") == 0 || strcmp(child, "..") == 0) continue;
+
+        // "." as root member would give "./name", which is fine, but plain name is shorter
+        char *child_src = joinPath(src_path, child);
+        char *child_member = (strcmp(member, ".") == 0) ? strdup(child) : joinPath(member, child);
+        struct stat child_info = {};
+        if (!child_src || !child_member) {
+            reportMember(stream, src_path, member, CopyMethod::DIRECTORY, 0, {CP_ERROR::SRC_READ, ENOMEM});
+        } else if (fstatat(fd, child, &child_info, AT_SYMLINK_NOFOLLOW) < 0) {
+            reportMember(stream, child_src, child_member, CopyMethod::NONE, 0, {CP_ERROR::SRC_STAT, errno});
+        } else {
+            packEntry(stream, fd, child, &child_info, child_src, child_member);
+        }
+        free(child_src);
+        free(child_member);
+    }
+
+    closedir(dir);
+}
+
+static void packEntry(TarStream *stream, int dirfd, const char *name, const struct stat *info,
+                      const char *src_path, const char *member) {
+    if (S_ISREG(info->st_mode)) {
+        progressAddTotal(1, info->st_size);
+        packFile(stream, dirfd, name, src_path, member);
+    } else if (S_ISDIR(info->st_mode) && stream->flags->recursive) {
+        packDir(stream, dirfd, name, info, src_path, member);
+    } else if (S_ISLNK(info->st_mode)) {
+        packSymlink(stream, dirfd, name, info, src_path, member);
+    } else {
+        reportMember(stream, src_path, member, CopyMethod::NONE, 0, {CP_ERROR::SRC_NOT_REGULAR, 0});
+    }
+}
+
+/// @brief Make at least need bytes (need <= TAR_BUFFER) available from stream->start; false at EOF or error
+static bool fillStream(TarStream *stream, size_t need) {
+    if (stream->end - stream->start >= need) return true;
+
+    // only a tail shorter than one header is moved
+    memmove(stream->buffer, stream->buffer + stream->start, stream->end - stream->start);
+    stream->end -= stream->start;
+    stream->start = 0;
+
+    while (stream->end < need && !stream->eof) {
+        ssize_t bytes_read = read(stream->fd, stream->buffer + stream->end,
+                                  throttleChunk(TAR_BUFFER - stream->end));
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            stream->error = errno;
+            return false;
+        }
+        if (bytes_read == 0) stream->eof = true;
+        stream->end += bytes_read;
+        throttleIo(bytes_read);
+    }
+
+    return stream->end >= need;
+}
+
+static bool skipStream(TarStream *stream, off_t size) {
+    while (size > 0) {
+        if (!fillStream(stream, 1)) return false;
+
+        size_t part = stream->end - stream->start;
+        if ((off_t) part > size) part = (size_t) size;
+        stream->start += part;
+        size -= part;
+    }
+
+    return true;
+}
+
+/// @brief Data of long name or pax entry with padding consumed, NUL-terminated; NULL if archive is damaged
+static char *readBlob(TarStream *stream, off_t size) {
+    if (size < 0 || (size_t) size > TAR_LONG_NAME_MAX) return NULL;
+
+    char *blob = (char *) malloc(size + 1);
+    if (!blob) return NULL;
+
+    for (off_t done = 0; done < size;) {
+        if (!fillStream(stream, 1)) {
+            free(blob);
+            return NULL;
+        }
+
+        size_t part = stream->end - stream->start;
+        if ((off_t) part > size - done) part = (size_t)(size - done);
+        memcpy(blob + done, stream->buffer + stream->start, part);
+        stream->start += part;
+        done += part;
+    }
+    blob[size] = '\0';
+
+    if (!skipStream(stream, paddingOf(size))) {
+        free(blob);
+        return NULL;
+    }
+    return blob;
+}
+
+/// @brief Octal field (may be padded with spaces or NULs) or GNU base-256 number
+static bool parseNumber(const char *field, size_t width, unsigned long long *value) {
+    *value = 0;
+    if ((unsigned char) field[0] & 0x80) {
+        // negative base-256 values are not used for sizes and ids
+        if ((unsigned char) field[0] != 0x80) return false;
+        for (size_t idx = 1; idx < width; idx++) *value = (*value << 8) | (unsigned char) field[idx];
+        return true;
+    }
+
+    size_t idx = 0;
+    while (idx < width && field[idx] == ' ') idx++;
+    for (; idx < width && field[idx] >= '0' && field[idx] <= '7'; idx++) *value = (*value << 3) | (field[idx] - '0');
+    return idx == width || field[idx] == ' ' || field[idx] == '\0';
+}
+
+/// @brief Old archivers summed signed chars, so both sums are accepted
+static bool checkHeader(const TarHeader *header) {
+    unsigned long long stored = 0;
+    if (!parseNumber(header->checksum, sizeof(header->checksum), &stored)) return false;
+
+    unsigned int sum = 0;
+    int signed_sum = 0;
+    const char *bytes = (const char *) header;
+    for (size_t idx = 0; idx < TAR_BLOCK; idx++) {
+        bool in_checksum = idx >= offsetof(TarHeader, checksum) &&
+                           idx < offsetof(TarHeader, checksum) + sizeof(header->checksum);
+        char byte = in_checksum ? ' ' : bytes[idx];
+        sum += (unsigned char) byte;
+        signed_sum += (signed char) byte;
+    }
+
+    return stored == sum || (long long) stored == signed_sum;
+}
+
+/// @brief Take path and linkpath from pax records "LEN key=value\n", other keys are ignored
+static void parsePax(char *records, size_t size, char **path, char **link) {
+    for (size_t pos = 0; pos < size;) {
+        char *end = NULL;
+        unsigned long len = strtoul(records + pos, &end, 10);
+        if (len == 0 || pos + len > size || *end != ' ') break;
+
+        char *key = end + 1;
+        char *record_end = records + pos + len - 1;
+        char *value = (char *) memchr(key, '=', record_end - key);
+        if (!value) break;
+        *value++ = '\0';
+        *record_end = '\0';
+
+        char **target = (strcmp(key, "path") == 0) ? path : (strcmp(key, "linkpath") == 0) ? link : NULL;
+        if (target) {
+            free(*target);
+            *target = strdup(value);
+        }
+        pos += len;
+    }
+}
+
+/// @brief Relative form of member name or NULL if it has ".." component
+static char *safeMemberPath(char *path) {
+    while (*path == '/') path++;
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') path[--len] = '\0';
+
+    for (const char *pos = path; *pos;) {
+        const char *slash = strchrnul(pos, '/');
+        if (slash - pos == 2 && pos[0] == '.' && pos[1] == '.') return NULL;
+        pos = (*slash) ? slash + 1 : slash;
+    }
+
+    return path;
+}
+
+/// @brief Open directory path of root component by component with O_NOFOLLOW, creating missing ones,
+/// so symlinks extracted earlier can't lead members out of root
+static int openBeneath(int root_fd, const char *path) {
+    int fd = openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char component[NAME_MAX + 1] = "";
+
+    for (const char *pos = path; *pos && fd >= 0;) {
+        const char *slash = strchrnul(pos, '/');
+        size_t len = slash - pos;
+        const char *next_pos = (*slash) ? slash + 1 : slash;
+        if (len == 0 || (len == 1 && pos[0] == '.')) {
+            pos = next_pos;
+            continue;
+        }
+        if (len > NAME_MAX) {
+            close(fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(component, pos, len);
+        component[len] = '\0';
+
+        int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && (mkdirat(fd, component, 0777) == 0 || errno == EEXIST))
+            next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int open_errno = errno;
+        close(fd);
+        errno = open_errno;
+
+        fd = next;
+        pos = next_pos;
+    }
+
+    return fd;
+}
+
+/// @brief Directory of member; members of one directory usually follow each other, so it is kept open
+static int memberParent(TarUnpack *unpack, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    size_t len = (slash) ? (size_t)(slash - path) : 0;
+    *name = (slash) ? slash + 1 : path;
+
+    if (unpack->parent_fd >= 0 && len == unpack->parent_len && memcmp(path, unpack->parent_path, len) == 0)
+        return unpack->parent_fd;
+
+    if (unpack->parent_fd >= 0) close(unpack->parent_fd);
+    unpack->parent_fd = -1;
+    if (len >= sizeof(unpack->parent_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy(unpack->parent_path, path, len);
+    unpack->parent_path[len] = '\0';
+    unpack->parent_len = len;
+    unpack->parent_fd = openBeneath(unpack->root_fd, unpack->parent_path);
+    return unpack->parent_fd;
+}
+
+static void addFixup(TarUnpack *unpack, const TarMember *member) {
+    if (unpack->fixup_count == unpack->fixup_capacity) {
+        size_t capacity = (unpack->fixup_capacity) ? 2 * unpack->fixup_capacity : 64;
+        TarFixup *fixups = (TarFixup *) realloc(unpack->fixups, capacity * sizeof(TarFixup));
+        if (!fixups) return; // directory just keeps owner permissions
+        unpack->fixups = fixups;
+        unpack->fixup_capacity = capacity;
+    }
+
+    char *path = strdup((member->path[0]) ? member->path : ".");
+    if (!path) return;
+    unpack->fixups[unpack->fixup_count++] = {path, member->mode & 07777, member->uid, member->gid,
+                                             {member->times[0], member->times[1]}};
+}
+
+/// @brief Mode (and with -p owner and times) of extracted directories, deepest first
+static void applyFixups(TarUnpack *unpack) {
+    for (size_t idx = unpack->fixup_count; idx > 0; idx--) {
+        const TarFixup *fixup = &unpack->fixups[idx - 1];
+        if (!unpack->stream.flags->preserve) {
+            fchmodat(unpack->root_fd, fixup->path, fixup->mode, 0);
+        } else {
+            CpErr err = applyMetadataAt(unpack->root_fd, fixup->path, fixup->uid, fixup->gid,
+                                        fixup->mode, fixup->times);
+            if (err.code != CP_ERROR::SUCCESS) {
+                char *path = joinPath(unpack->root_path, fixup->path);
+                reportMember(&unpack->stream, fixup->path, path ? path : fixup->path, CopyMethod::DIRECTORY, 0, err);
+                free(path);
+            }
+        }
+        free(fixup->path);
+    }
+
+    free(unpack->fixups);
+    unpack->fixups = NULL;
+    unpack->fixup_count = unpack->fixup_capacity = 0;
+}
+
+/// @brief Existing dir_fd/name is removed with -f; directories are never replaced
+static CpErr replaceExisting(TarUnpack *unpack, int dir_fd, const char *name) {
+    struct stat info = {};
+    if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode))
+        return {CP_ERROR::DIR_REWRITE, 0};
+    if (!unpack->stream.flags->rewrite_existing) return {CP_ERROR::DST_REWRITE, 0};
+    if (unlinkat(dir_fd, name, 0) < 0) return {CP_ERROR::DST_OPEN, errno};
+
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+/// @brief Write member data from stream; data is always consumed, even if file can't be written
+static CpErr extractFile(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name,
+                         size_t *bytes, bool *truncated) {
+    TarStream *stream = &unpack->stream;
+    int open_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    int fd = (dir_fd >= 0) ? openat(dir_fd, name, open_flags, member->mode & 07777) : -1;
+    if (dir_fd < 0) {
+        err = {CP_ERROR::DST_OPEN, errno};
+    } else if (fd < 0 && errno == EEXIST) {
+        err = replaceExisting(unpack, dir_fd, name);
+        if (err.code == CP_ERROR::SUCCESS) fd = openat(dir_fd, name, open_flags, member->mode & 07777);
+    }
+    if (fd < 0 && err.code == CP_ERROR::SUCCESS) err = {CP_ERROR::DST_OPEN, errno};
+
+    progressAddTotal(1, member->size);
+    progressStartFile(stream->progress, member->path, member->size);
+    off_t remaining = member->size;
+    while (remaining > 0) {
+        if (!fillStream(stream, 1)) break;
+
+        size_t part = stream->end - stream->start;
+        if ((off_t) part > remaining) part = (size_t) remaining;
+        for (size_t done = 0; done < part && err.code == CP_ERROR::SUCCESS;) {
+            ssize_t written = write(fd, stream->buffer + stream->start + done, part - done);
+            if (written < 0 && errno != EINTR) err = {CP_ERROR::DST_WRITE, errno};
+            if (written > 0) done += written;
+        }
+
+        stream->start += part;
+        remaining -= part;
+        progressAdd(stream->progress, part);
+    }
+    progressEndFile(stream->progress);
+
+    *bytes = member->size - remaining;
+    *truncated = remaining > 0;
+    if (fd < 0) return err;
+
+    if (close(fd) < 0 && err.code == CP_ERROR::SUCCESS) err = {CP_ERROR::DST_CLOSE, errno};
+    if (err.code == CP_ERROR::SUCCESS && stream->flags->preserve)
+        err = applyMetadataAt(dir_fd, name, member->uid, member->gid, member->mode, member->times);
+    return err;
+}
+
+static CpErr extractDir(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name) {
+    // destination itself is only fixed up
+    if (name[0] != '\0' && strcmp(name, ".") != 0) {
+        if (dir_fd < 0) return {CP_ERROR::DST_MKDIR, errno};
+        // owner must be able to fill directory, real mode is set after extraction
+        if (mkdirat(dir_fd, name, (member->mode & 07777) | S_IRWXU) < 0) {
+            if (errno != EEXIST) return {CP_ERROR::DST_MKDIR, errno};
+
+            struct stat info = {};
+            if (fstatat(dir_fd, name, &info, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(info.st_mode))
+                return {CP_ERROR::DST_MKDIR, ENOTDIR};
+        }
+    }
+
+    addFixup(unpack, member);
+    return {CP_ERROR::SUCCESS, 0};
+}
+
+static CpErr extractSymlink(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name) {
+    if (dir_fd < 0) return {CP_ERROR::DST_SYMLINK, errno};
+    if (symlinkat(member->link, dir_fd, name) < 0) {
+        if (errno != EEXIST) return {CP_ERROR::DST_SYMLINK, errno};
+
+        CpErr err = replaceExisting(unpack, dir_fd, name);
+        if (err.code != CP_ERROR::SUCCESS) return err;
+        if (symlinkat(member->link, dir_fd, name) < 0) return {CP_ERROR::DST_SYMLINK, errno};
+    }
+
+    if (!unpack->stream.flags->preserve) return {CP_ERROR::SUCCESS, 0};
+    struct stat info = {};
+    info.st_uid = member->uid;
+    info.st_gid = member->gid;
+    info.st_atim = member->times[0];
+    info.st_mtim = member->times[1];
+    return copySymlinkMetadata(dir_fd, name, &info);
+}
+
+/// @brief Link to member extracted earlier; its path is resolved beneath root too
+static CpErr extractHardlink(TarUnpack *unpack, const TarMember *member, int dir_fd, const char *name) {
+    if (dir_fd < 0) return {CP_ERROR::DST_OPEN, errno};
+
+    char *target = strdup(member->link);
+    char *safe_target = (target) ? safeMemberPath(target) : NULL;
+    if (!safe_target || safe_target[0] == '\0') {
+        free(target);
+        return {CP_ERROR::SRC_OPEN, (target) ? EINVAL : ENOMEM};
+    }
+
+    char *slash = strrchr(safe_target, '/');
+    const char *target_name = (slash) ? slash + 1 : safe_target;
+    if (slash) *slash = '\0';
+    int target_fd = openBeneath(unpack->root_fd, (slash) ? safe_target : "");
+
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    if (target_fd < 0) {
+        err = {CP_ERROR::SRC_OPEN, errno};
+    } else if (linkat(target_fd, target_name, dir_fd, name, 0) < 0) {
+        err = (errno == EEXIST) ? replaceExisting(unpack, dir_fd, name) : CpErr{CP_ERROR::DST_OPEN, errno};
+        if (err.code == CP_ERROR::SUCCESS && linkat(target_fd, target_name, dir_fd, name, 0) < 0)
+            err = {CP_ERROR::DST_OPEN, errno};
+    }
+
+    if (target_fd >= 0) close(target_fd);
+    free(target);
+    return err;
+}
+
+/// @brief Extract member and consume its data; returns false if archive ended inside it
+static bool extractMember(TarUnpack *unpack, TarMember *member) {
+    TarStream *stream = &unpack->stream;
+    char *dst_path = joinPath(unpack->root_path, member->path);
+    const char *dst = (dst_path) ? dst_path : member->path;
+
+    const char *name = NULL;
+    int dir_fd = memberParent(unpack, member->path, &name);
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    CopyMethod method = CopyMethod::ARCHIVE;
+    size_t bytes = 0;
+    bool truncated = false;
+    off_t data_left = member->size;
+
+    switch (member->type) {
+        case TAR_REGULAR:
+        case TAR_OLD_REGULAR:
+        case TAR_CONTIGUOUS:
+            err = extractFile(unpack, member, dir_fd, name, &bytes, &truncated);
+            data_left = 0;
+            break;
+        case TAR_DIRECTORY:
+            method = CopyMethod::DIRECTORY;
+            err = extractDir(unpack, member, dir_fd, name);
+            break;
+        case TAR_SYMLINK:
+            method = CopyMethod::SYMLINK;
+            err = extractSymlink(unpack, member, dir_fd, name);
+            break;
+        case TAR_HARDLINK:
+            method = CopyMethod::HARDLINK;
+            err = extractHardlink(unpack, member, dir_fd, name);
+            break;
+        default:
+            // devices, fifos and GNU extensions like sparse files are skipped
+            method = CopyMethod::NONE;
+            err = {CP_ERROR::SRC_NOT_REGULAR, 0};
+            break;
+    }
+
+    if (!truncated) truncated = !skipStream(stream, data_left + paddingOf(member->size));
+    if (!truncated) reportMember(stream, member->path, dst, method, bytes, err);
+    free(dst_path);
+    return !truncated;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+int packArchive(char *const sources[], int count, const char *dst, const struct copy_flags *flags) {
+    assert(sources); assert(dst); assert(flags);
+    TarStream stream = {};
+    stream.path = dst;
+    stream.flags = flags;
+    stream.progress = progressThreadSlot();
+
+    if (strcmp(dst, "-") == 0) {
+        if (isatty(STDOUT_FILENO)) {
+            ERRPRINTF("Refusing to write archive to terminal\n");
+            return CP_FATAL;
+        }
+        // messages printed to stdout (-v, "Already exists") must not get into archive
+        fflush(stdout);
+        stream.fd = dup(STDOUT_FILENO);
+        if (stream.fd >= 0) dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | ((flags->rewrite_existing) ? 0 : O_EXCL);
+        stream.fd = open(dst, open_flags, 0666);
+        if (stream.fd < 0 && errno == EEXIST) {
+            reportMember(&stream, dst, dst, CopyMethod::ARCHIVE, 0, {CP_ERROR::DST_REWRITE, 0});
+            return CP_FATAL;
+        }
+    }
+    if (stream.fd < 0) {
+        reportMember(&stream, dst, dst, CopyMethod::ARCHIVE, 0, {CP_ERROR::DST_OPEN, errno});
+        return CP_FATAL;
+    }
+
+    struct stat archive_info = {};
+    if (fstat(stream.fd, &archive_info) == 0 && S_ISREG(archive_info.st_mode)) {
+        stream.archive_dev = archive_info.st_dev;
+        stream.archive_ino = archive_info.st_ino;
+    }
+
+    stream.buffer = (char *) reserveCopyBuffer(&stream.memory, TAR_BUFFER);
+    if (!stream.buffer) {
+        ERRPRINTF("Failed to allocate archive buffer\n");
+        close(stream.fd);
+        return CP_FATAL;
+    }
+
+    for (int idx = 0; idx < count && stream.error == 0; idx++) {
+        struct stat info = {};
+        if (stat(sources[idx], &info) < 0) {
+            reportMember(&stream, sources[idx], dst, CopyMethod::NONE, 0, {CP_ERROR::SRC_STAT, errno});
+            continue;
+        }
+
+        char *member = memberName(sources[idx]);
+        if (!member) {
+            reportMember(&stream, sources[idx], dst, CopyMethod::NONE, 0, {CP_ERROR::SRC_READ, ENOMEM});
+            continue;
+        }
+        packEntry(&stream, AT_FDCWD, sources[idx], &info, sources[idx], member);
+        free(member);
+    }
+
+    // end of archive is two zero blocks
+    streamZeros(&stream, 2 * TAR_BLOCK);
+    if (stream.error == 0) flushStream(&stream);
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    if (stream.error != 0) err = {CP_ERROR::DST_WRITE, stream.error};
+    if (close(stream.fd) < 0 && err.code == CP_ERROR::SUCCESS) err = {CP_ERROR::DST_CLOSE, errno};
+    freeCopyBuffer(&stream.memory);
+
+    if (err.code != CP_ERROR::SUCCESS) {
+        reportMember(&stream, dst, dst, CopyMethod::ARCHIVE, 0, err);
+        return CP_FATAL;
+    }
+    return 0;
+}
+
+int unpackArchive(const char *src, const char *dst, const struct copy_flags *flags) {
+    assert(src); assert(dst); assert(flags);
+    TarUnpack unpack = {};
+    TarStream *stream = &unpack.stream;
+    stream->path = src;
+    stream->flags = flags;
+    stream->progress = progressThreadSlot();
+    unpack.root_path = dst;
+    unpack.root_fd = -1;
+    unpack.parent_fd = -1;
+
+    if (strcmp(src, "-") == 0) {
+        if (isatty(STDIN_FILENO)) {
+            ERRPRINTF("Refusing to read archive from terminal\n");
+            return CP_FATAL;
+        }
+        stream->fd = STDIN_FILENO;
+    } else {
+        stream->fd = open(src, O_RDONLY | O_CLOEXEC);
+        if (stream->fd < 0) {
+            reportMember(stream, src, dst, CopyMethod::ARCHIVE, 0, {CP_ERROR::SRC_OPEN, errno});
+            return CP_FATAL;
+        }
+        posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (mkdir(dst, 0777) < 0 && errno != EEXIST) {
+        reportMember(stream, src, dst, CopyMethod::DIRECTORY, 0, {CP_ERROR::DST_MKDIR, errno});
+    } else if ((unpack.root_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        CP_ERROR code = (errno == ENOTDIR) ? CP_ERROR::DST_NOT_DIR : CP_ERROR::DST_OPEN;
+        reportMember(stream, src, dst, CopyMethod::DIRECTORY, 0, {code, errno});
+    } else {
+        stream->buffer = (char *) reserveCopyBuffer(&stream->memory, TAR_BUFFER);
+        if (!stream->buffer) ERRPRINTF("Failed to allocate archive buffer\n");
+    }
+
+    int result = (stream->buffer) ? 0 : CP_FATAL;
+    char *long_name = NULL, *long_link = NULL;
+    while (result == 0) {
+        if (!fillStream(stream, TAR_BLOCK)) {
+            // archive without end blocks is accepted if it stops between members
+            if (stream->error != 0)
+                reportMember(stream, src, dst, CopyMethod::ARCHIVE, 0, {CP_ERROR::SRC_READ, stream->error});
+            else if (stream->end != stream->start || long_name || long_link)
+                ERRPRINTF("Unexpected end of archive '%s'\n", src);
+            else break;
+            result = CP_FATAL;
+            break;
+        }
+
+        TarHeader header = {};
+        memcpy(&header, stream->buffer + stream->start, TAR_BLOCK);
+        stream->start += TAR_BLOCK;
+        if (memcmp(&header, ZERO_BLOCK, TAR_BLOCK) == 0) break;
+
+        unsigned long long size = 0, mode = 0, uid = 0, gid = 0, mtime = 0;
+        if (!checkHeader(&header) || !parseNumber(header.size, sizeof(header.size), &size) ||
+            !parseNumber(header.mode, sizeof(header.mode), &mode) ||
+            !parseNumber(header.uid, sizeof(header.uid), &uid) ||
+            !parseNumber(header.gid, sizeof(header.gid), &gid) ||
+            !parseNumber(header.mtime, sizeof(header.mtime), &mtime) || (off_t) size < 0) {
+            ERRPRINTF("Archive '%s' is damaged: invalid header\n", src);
+            result = CP_FATAL;
+            break;
+        }
+
+        if (header.type == TAR_GNU_LONG_NAME || header.type == TAR_GNU_LONG_LINK || header.type == TAR_PAX) {
+            char *blob = readBlob(stream, (off_t) size);
+            if (!blob) {
+                ERRPRINTF("Archive '%s' is damaged: invalid extended header\n", src);
+                result = CP_FATAL;
+                break;
+            }
+            if (header.type == TAR_PAX) {
+                parsePax(blob, size, &long_name, &long_link);
+                free(blob);
+            } else {
+                char **target = (header.type == TAR_GNU_LONG_NAME) ? &long_name : &long_link;
+                free(*target);
+                *target = blob;
+            }
+            continue;
+        }
+        if (header.type == TAR_PAX_GLOBAL) {
+            if (!skipStream(stream, size + paddingOf(size))) {
+                ERRPRINTF("Unexpected end of archive '%s'\n", src);
+                result = CP_FATAL;
+            }
+            continue;
+        }
+
+        // ustar splits long names into prefix and name; GNU format keeps other fields in prefix
+        char name[TAR_NAME_LEN] = "";
+        char link[sizeof(header.link_name) + 1] = "";
+        if (memcmp(header.magic, "ustar", sizeof(header.magic)) == 0 && header.prefix[0] != '\0') {
+            snprintf(name, TAR_NAME_LEN, "%.*s/%.*s", (int) sizeof(header.prefix), header.prefix,
+                     (int) sizeof(header.name), header.name);
+        } else {
+            snprintf(name, TAR_NAME_LEN, "%.*s", (int) sizeof(header.name), header.name);
+        }
+        snprintf(link, sizeof(link), "%.*s", (int) sizeof(header.link_name), header.link_name);
+
+        TarMember member = {};
+        member.type = header.type;
+        member.mode = (mode_t) mode;
+        member.uid = (uid_t) uid;
+        member.gid = (gid_t) gid;
+        member.size = (off_t) size;
+        member.times[0] = member.times[1] = {(time_t) mtime, 0};
+        member.link = (long_link) ? long_link : link;
+        member.path = safeMemberPath((long_name) ? long_name : name);
+
+        if (member.path) {
+            if (!extractMember(&unpack, &member)) {
+                ERRPRINTF("Unexpected end of archive '%s'\n", src);
+                result = CP_FATAL;
+            }
+        } else {
+            ERRPRINTF("Skipping member '%s' with '..' in its name\n", (long_name) ? long_name : name);
+            if (!skipStream(stream, size + paddingOf(size))) {
+                ERRPRINTF("Unexpected end of archive '%s'\n", src);
+                result = CP_FATAL;
+            }
+        }
+
+        free(long_name);
+        free(long_link);
+        long_name = long_link = NULL;
+    }
+
+    free(long_name);
+    free(long_link);
+    if (unpack.root_fd >= 0) applyFixups(&unpack);
+    if (unpack.parent_fd >= 0) close(unpack.parent_fd);
+    if (unpack.root_fd >= 0) close(unpack.root_fd);
+    if (stream->fd != STDIN_FILENO) close(stream->fd);
+    freeCopyBuffer(&stream->memory);
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include <sys/types.h>
+
+#include "file_copy.h"
+
+const size_t TAR_BLOCK = 512;
+const size_t TAR_BUFFER = 4 << 20;          ///< archive is read and written in chunks of this size
+const size_t TAR_LONG_NAME_MAX = 64 << 10;  ///< longest GNU long name or pax record block accepted by unpack
+
+enum class ArchiveMode {
+    NONE = 0,
+    PACK,       ///< sources are packed into one tar stream
+    UNPACK,     ///< tar stream is extracted into directory
+};
+
+/// @brief Pack count sources into GNU tar archive dst ("-" - stdout) with large sequential writes
+/// Members are named like cp -r would name copies: basename(src)/relative path. Directories are
+/// walked only with -r; regular files, directories and symlinks are stored, other files are reported.
+/// Existing dst is replaced only with -f. Errors are reported with parseCpErr; returns CP_FATAL if
+/// archive can't be written, 0 otherwise
+int packArchive(char *const sources[], int count, const char *dst, const struct copy_flags *flags);
+
+/// @brief Extract ustar/GNU/pax archive src ("-" - stdin) into directory dst, which is created if missing
+/// Members can't escape dst: absolute names are made relative, names with ".." are skipped and
+/// symlinks are never followed on the way to a member. Existing files are replaced only with -f,
+/// owner and timestamps are restored with -p. Returns CP_FATAL if archive is damaged or unreadable
+int unpackArchive(const char *src, const char *dst, const struct copy_flags *flags);
+
+#endif
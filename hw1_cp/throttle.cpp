@@ -0,0 +1,251 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include "throttle.h"
+
+const char WAKE_TOGGLE = 't';   ///< SIGUSR2 arrived
+const char WAKE_STOP = 'q';     ///< stopThrottle was called
+
+/// @brief Tokens may go negative: thread takes what it spent at once and sleeps the debt off
+struct TokenBucket {
+    double rate;        ///< tokens per second, 0 - unlimited
+    double tokens;
+};
+
+std::atomic<bool> throttle_enabled(false);
+
+/// @brief Limits shared by all copy threads, control thread exists between startThrottle and stopThrottle
+static struct {
+    pthread_mutex_t mtx;                ///< protects buckets and limits
+    TokenBucket bytes;
+    TokenBucket ops;
+    double last_refill;
+    size_t bytes_limit;                 ///< configured limits, restored when SIGUSR2 resumes them
+    size_t ops_limit;
+    bool suspended;
+    std::atomic<size_t> chunk;          ///< cap for kernel copy requests, 0 - none
+
+    bool running;
+    pthread_t thread;
+    int wake_pipe[2];                   ///< written by SIGUSR2 handler and stopThrottle
+    int control_fd;
+    struct sigaction old_action;
+} throttle = {PTHREAD_MUTEX_INITIALIZER};
+
+static double getTime();
+
+static void onToggleSignal(int sig);
+
+static void refillBuckets(double now);
+
+static void applyRates(size_t bytes_per_sec, size_t ops_per_sec);
+
+static void runCommand(char *line);
+
+static void *controlThread(void *arg);
+
+static double getTime() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+static void onToggleSignal(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    char cmd = WAKE_TOGGLE;
+    if (write(throttle.wake_pipe[1], &cmd, 1) < 0) {}  // full pipe already has pending toggles
+    errno = saved_errno;
+}
+
+/// @brief Called with throttle.mtx held; idle time fills buckets up to THROTTLE_BURST seconds of rate
+static void refillBuckets(double now) {
+    double elapsed = now - throttle.last_refill;
+    throttle.last_refill = now;
+
+    TokenBucket *buckets[] = {&throttle.bytes, &throttle.ops};
+    for (TokenBucket *bucket : buckets) {
+        if (bucket->rate == 0) continue;
+        double capacity = bucket->rate * THROTTLE_BURST;
+        if (capacity < 1) capacity = 1;
+        bucket->tokens += bucket->rate * elapsed;
+        if (bucket->tokens > capacity) bucket->tokens = capacity;
+    }
+}
+
+/// @brief Called with throttle.mtx held; debt made under old rates is kept and repaid with new ones
+static void applyRates(size_t bytes_per_sec, size_t ops_per_sec) {
+    refillBuckets(getTime());
+    throttle.bytes.rate = (double) bytes_per_sec;
+    throttle.ops.rate = (double) ops_per_sec;
+    if (bytes_per_sec == 0) throttle.bytes.tokens = 0;
+    if (ops_per_sec == 0) throttle.ops.tokens = 0;
+
+    size_t chunk = 0;
+    if (bytes_per_sec > 0) {
+        chunk = (size_t)((double) bytes_per_sec * THROTTLE_BURST);
+        if (chunk < THROTTLE_MIN_CHUNK) chunk = THROTTLE_MIN_CHUNK;
+    }
+    throttle.chunk.store(chunk, std::memory_order_relaxed);
+    throttle_enabled.store(bytes_per_sec > 0 || ops_per_sec > 0, std::memory_order_relaxed);
+}
+
+/// @brief Handle one line of control fd: bwlimit=SIZE or iops-limit=N
+static void runCommand(char *line) {
+    char *value = strchr(line, '=');
+    if (!value) {
+        if (line[0] != '\0') ERRPRINTF("Unknown throttle command '%s'\n", line);
+        return;
+    }
+    *value++ = '\0';
+
+    size_t number = (strcmp(value, "0") == 0) ? 0 : parseSize(value);
+    if (number == 0 && strcmp(value, "0") != 0) {
+        ERRPRINTF("Invalid value '%s' of throttle command '%s'\n", value, line);
+        return;
+    }
+
+    if (strcmp(line, "bwlimit") != 0 && strcmp(line, "iops-limit") != 0) {
+        ERRPRINTF("Unknown throttle command '%s'\n", line);
+        return;
+    }
+
+    pthread_mutex_lock(&throttle.mtx);
+    if (strcmp(line, "bwlimit") == 0) throttle.bytes_limit = number;
+    else                              throttle.ops_limit = number;
+
+    // new limits also end suspension
+    throttle.suspended = false;
+    applyRates(throttle.bytes_limit, throttle.ops_limit);
+    pthread_mutex_unlock(&throttle.mtx);
+}
+
+static void *controlThread(void *arg) {
+    (void) arg;
+    char line[THROTTLE_CMD_LEN] = "";
+    size_t line_len = 0;
+
+    while (true) {
+        struct pollfd fds[2] = {{throttle.wake_pipe[0], POLLIN, 0}, {throttle.control_fd, POLLIN, 0}};
+        int code = poll(fds, (throttle.control_fd >= 0) ? 2 : 1, -1);
+        if (code < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char cmd = 0;
+            if (read(throttle.wake_pipe[0], &cmd, 1) == 1 && cmd == WAKE_STOP) break;
+
+            pthread_mutex_lock(&throttle.mtx);
+            throttle.suspended = !throttle.suspended;
+            if (throttle.suspended) applyRates(0, 0);
+            else applyRates(throttle.bytes_limit, throttle.ops_limit);
+            pthread_mutex_unlock(&throttle.mtx);
+        }
+
+        if (throttle.control_fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t bytes_read = read(throttle.control_fd, line + line_len, sizeof(line) - 1 - line_len);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) {
+                throttle.control_fd = -1;   // writer is gone, limits stay as they are
+                continue;
+            }
+            line_len += bytes_read;
+            line[line_len] = '\0';
+
+            char *start = line, *end = NULL;
+            while ((end = strchr(start, '\n'))) {
+                *end = '\0';
+                runCommand(start);
+                start = end + 1;
+            }
+            line_len -= start - line;
+            memmove(line, start, line_len);
+            if (line_len == sizeof(line) - 1) line_len = 0;     // too long to be command
+        }
+    }
+
+    return NULL;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool startThrottle(const struct copy_flags *flags) {
+    assert(flags);
+    assert(!throttle.running);
+
+    pthread_mutex_lock(&throttle.mtx);
+    throttle.last_refill = getTime();
+    throttle.bytes_limit = flags->bw_limit;
+    throttle.ops_limit = flags->iops_limit;
+    throttle.suspended = false;
+    applyRates(throttle.bytes_limit, throttle.ops_limit);
+    pthread_mutex_unlock(&throttle.mtx);
+
+    throttle.control_fd = flags->control_fd;
+    if (pipe2(throttle.wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return false;
+    if (pthread_create(&throttle.thread, NULL, controlThread, NULL) != 0) {
+        close(throttle.wake_pipe[0]);
+        close(throttle.wake_pipe[1]);
+        return false;
+    }
+    throttle.running = true;
+
+    struct sigaction action = {};
+    action.sa_handler = onToggleSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, &throttle.old_action);
+    return true;
+}
+
+void stopThrottle() {
+    if (!throttle.running) return;
+
+    sigaction(SIGUSR2, &throttle.old_action, NULL);
+    char cmd = WAKE_STOP;
+    while (write(throttle.wake_pipe[1], &cmd, 1) < 0 && errno == EINTR) {}
+    pthread_join(throttle.thread, NULL);
+    close(throttle.wake_pipe[0]);
+    close(throttle.wake_pipe[1]);
+    throttle.running = false;
+}
+
+void throttleWait(size_t bytes) {
+    pthread_mutex_lock(&throttle.mtx);
+    refillBuckets(getTime());
+    if (throttle.bytes.rate > 0) throttle.bytes.tokens -= (double) bytes;
+    if (throttle.ops.rate > 0) throttle.ops.tokens -= 1;
+    pthread_mutex_unlock(&throttle.mtx);
+
+    // limits may be changed or removed while we sleep, so debt is rechecked in short naps
+    while (true) {
+        pthread_mutex_lock(&throttle.mtx);
+        refillBuckets(getTime());
+        double wait = 0;
+        if (throttle.bytes.rate > 0 && throttle.bytes.tokens < 0)
+            wait = -throttle.bytes.tokens / throttle.bytes.rate;
+        if (throttle.ops.rate > 0 && throttle.ops.tokens < 0 && -throttle.ops.tokens / throttle.ops.rate > wait)
+            wait = -throttle.ops.tokens / throttle.ops.rate;
+        pthread_mutex_unlock(&throttle.mtx);
+        if (wait <= 0) break;
+
+        if (wait > THROTTLE_MAX_SLEEP) wait = THROTTLE_MAX_SLEEP;
+        struct timespec nap = {0, (long)(wait * 1e9)};
+        nanosleep(&nap, NULL);
+    }
+}
+
+size_t throttleChunk(size_t wanted) {
+    size_t chunk = throttle.chunk.load(std::memory_order_relaxed);
+    return (chunk > 0 && chunk < wanted) ? chunk : wanted;
+}
@@ -0,0 +1,36 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <sys/types.h>
+
+#include <atomic>
+
+#include "file_copy.h"
+
+const double THROTTLE_BURST = 0.1;          ///< seconds of rate which may be spent at once after idle time
+const double THROTTLE_MAX_SLEEP = 0.1;      ///< sleeping threads recheck limits this often, so new ones apply fast
+const size_t THROTTLE_MIN_CHUNK = 64 << 10; ///< smallest kernel copy request while bandwidth is limited
+const int THROTTLE_CMD_LEN = 128;           ///< longest line of control fd
+
+/// @brief Limits are checked by every copy loop, so disabled state is one relaxed load
+extern std::atomic<bool> throttle_enabled;
+
+/// @brief Set --bwlimit/--iops-limit and start control thread which listens to flags->control_fd and SIGUSR2
+/// Control fd accepts lines "bwlimit=SIZE" and "iops-limit=N" (0 removes limit); SIGUSR2 suspends
+/// limits or restores them. Returns false if control thread can't be started
+bool startThrottle(const struct copy_flags *flags);
+
+void stopThrottle();
+
+/// @brief Take bytes and one operation from buckets shared by all threads, sleep while they are in debt
+void throttleWait(size_t bytes);
+
+/// @brief Account I/O just done by copy loop
+static inline void throttleIo(size_t bytes) {
+    if (throttle_enabled.load(std::memory_order_relaxed)) throttleWait(bytes);
+}
+
+/// @brief Size of next kernel copy request: huge requests would make bandwidth limit bursty
+size_t throttleChunk(size_t wanted);
+
+#endif
@@ -0,0 +1,611 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <atomic>
+
+#include "tree_copy.h"
+#include "progress.h"
+#include "meta_copy.h"
+#include "atomic_write.h"
+
+struct TreeCopy;
+
+/// @brief Directory descriptor shared by walker and queued files, closed by last user
+struct DirRef {
+    int fd;
+    std::atomic<int> refs;
+    TreeCopy *tree;     ///< counts open directories
+};
+
+/// @brief Regular file waiting for a copy thread
+struct TreeTask {
+    DirRef *src_dir;
+    DirRef *dst_dir;
+    char *src_path;     ///< full paths only for messages
+    char *dst_path;
+    const char *name;   ///< tail of src_path, used with directory descriptors
+};
+
+/// @brief Attributes of created directory, applied when all its content is copied:
+/// files created inside would change mtime, restricted mode could forbid filling it
+struct DirFixup {
+    char *rel_path;     ///< relative to destination root
+    mode_t mode;
+    uid_t uid;          ///< owner and times are used only with -p
+    gid_t gid;
+    struct timespec times[2];
+};
+
+struct TreeCopy {
+    const struct copy_flags *flags;
+
+    TreeTask queue[TREE_QUEUE_LEN];
+    int head;
+    int count;
+    bool walk_done;
+    bool stop;
+    pthread_mutex_t mtx;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;    ///< also signalled when directory is closed or all tasks are done
+
+    int open_dirs;              ///< descriptors of live DirRefs
+    int dir_budget;             ///< walker sleeps while open_dirs is above it, derived from RLIMIT_NOFILE
+    int pending;                ///< queued and running tasks, they hold DirRefs
+
+    pthread_mutex_t report_mtx;
+    int result;
+
+    bool no_workers;            ///< threads can't be started, walker copies files itself
+    CopyBuffer walker_buffer;
+
+    dev_t root_dev;     ///< destination root, skipped if it is inside source
+    ino_t root_ino;
+
+    DirFixup *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+};
+
+static DirRef *newDirRef(TreeCopy *tree, int fd);
+
+static DirRef *acquireDir(DirRef *dir);
+
+static void releaseDir(DirRef *dir);
+
+static char *joinPath(const char *dir, const char *name);
+
+static void waitDirBudget(TreeCopy *tree);
+
+static bool isStopped(TreeCopy *tree);
+
+static void reportContext(TreeCopy *tree, const CpContext_t *context, CpErr err);
+
+static void reportTree(TreeCopy *tree, const char *src, const char *dst, CopyMethod method, CpErr err);
+
+static void addFixup(TreeCopy *tree, const char *rel_path, const struct stat *src_info);
+
+static void applyFixups(TreeCopy *tree, int root_fd, const char *target);
+
+static void pushTask(TreeCopy *tree, TreeTask task);
+
+static bool popTask(TreeCopy *tree, TreeTask *task);
+
+static void runTask(TreeCopy *tree, TreeTask *task, CopyBuffer *buffer);
+
+static void *treeWorker(void *tree_ptr);
+
+static void copySymlink(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir, const char *name,
+                        const char *src_path, const char *dst_path);
+
+static void walkDir(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir,
+                    const char *src_path, const char *dst_path, const char *rel_path);
+
+static void copySubdir(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir, const char *name,
+                       const char *src_path, const char *dst_path, const char *rel_path);
+
+static DirRef *newDirRef(TreeCopy *tree, int fd) {
+    DirRef *dir = (DirRef *) calloc(1, sizeof(DirRef));
+    if (!dir) {
+        close(fd);
+        return NULL;
+    }
+
+    dir->fd = fd;
+    dir->refs.store(1);
+    dir->tree = tree;
+
+    pthread_mutex_lock(&tree->mtx);
+    tree->open_dirs++;
+    pthread_mutex_unlock(&tree->mtx);
+    return dir;
+}
+
+static DirRef *acquireDir(DirRef *dir) {
+    dir->refs.fetch_add(1, std::memory_order_relaxed);
+    return dir;
+}
+
+static void releaseDir(DirRef *dir) {
+    if (dir->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        TreeCopy *tree = dir->tree;
+        close(dir->fd);
+        free(dir);
+
+        pthread_mutex_lock(&tree->mtx);
+        tree->open_dirs--;
+        pthread_cond_broadcast(&tree->not_full);
+        pthread_mutex_unlock(&tree->mtx);
+    }
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = (char *) malloc(dir_len + name_len + 2);
+    if (!path) return NULL;
+
+    memcpy(path, dir, dir_len);
+    size_t pos = dir_len;
+    if (dir_len > 0 && dir[dir_len - 1] != '/') path[pos++] = '/';
+    memcpy(path + pos, name, name_len + 1);
+    return path;
+}
+
+/// @brief Queued files pin their directories: wait until workers release some before opening more,
+/// so trees with many small directories don't run out of descriptors. Directories of walker itself
+/// are released only when it returns, so it doesn't wait when no task is left
+static void waitDirBudget(TreeCopy *tree) {
+    pthread_mutex_lock(&tree->mtx);
+    while (tree->open_dirs + 2 > tree->dir_budget && tree->pending > 0 && !tree->stop) {
+        pthread_cond_wait(&tree->not_full, &tree->mtx);
+    }
+    pthread_mutex_unlock(&tree->mtx);
+}
+
+static bool isStopped(TreeCopy *tree) {
+    pthread_mutex_lock(&tree->mtx);
+    bool stop = tree->stop;
+    pthread_mutex_unlock(&tree->mtx);
+    return stop;
+}
+
+static void reportContext(TreeCopy *tree, const CpContext_t *context, CpErr err) {
+    pthread_mutex_lock(&tree->report_mtx);
+    int code = parseCpErr(context, err, tree->flags);
+    pthread_mutex_unlock(&tree->report_mtx);
+
+    if (code == CP_FATAL) {
+        pthread_mutex_lock(&tree->mtx);
+        tree->stop = true;
+        tree->result = CP_FATAL;
+        pthread_cond_broadcast(&tree->not_full);
+        pthread_mutex_unlock(&tree->mtx);
+    }
+}
+
+static void reportTree(TreeCopy *tree, const char *src, const char *dst, CopyMethod method, CpErr err) {
+    CpContext_t context = {};
+    context.src = src;
+    context.dst = dst;
+    context.dst_path = dst;
+    context.method = method;
+
+    reportContext(tree, &context, err);
+}
+
+static void addFixup(TreeCopy *tree, const char *rel_path, const struct stat *src_info) {
+    if (tree->fixup_count == tree->fixup_capacity) {
+        size_t capacity = (tree->fixup_capacity) ? 2 * tree->fixup_capacity : 64;
+        DirFixup *fixups = (DirFixup *) realloc(tree->fixups, capacity * sizeof(DirFixup));
+        if (!fixups) return; // directory just keeps owner permissions
+        tree->fixups = fixups;
+        tree->fixup_capacity = capacity;
+    }
+
+    char *path = strdup(rel_path);
+    if (!path) return;
+    tree->fixups[tree->fixup_count++] = {path, src_info->st_mode & 07777, src_info->st_uid, src_info->st_gid,
+                                         {src_info->st_atim, src_info->st_mtim}};
+}
+
+/// @brief One pass over all created directories after data copy
+static void applyFixups(TreeCopy *tree, int root_fd, const char *target) {
+    // children were added after parents, so going backwards fixes deepest directories first
+    for (size_t idx = tree->fixup_count; idx > 0; idx--) {
+        const DirFixup *fixup = &tree->fixups[idx - 1];
+        if (!tree->flags->preserve) {
+            fchmodat(root_fd, fixup->rel_path, fixup->mode, 0);
+            continue;
+        }
+
+        CpErr err = applyMetadataAt(root_fd, fixup->rel_path, fixup->uid, fixup->gid, fixup->mode, fixup->times);
+        if (err.code != CP_ERROR::SUCCESS) {
+            char *path = joinPath(target, fixup->rel_path);
+            reportTree(tree, path ? path : fixup->rel_path, path ? path : fixup->rel_path,
+                       CopyMethod::DIRECTORY, err);
+            free(path);
+        }
+    }
+}
+
+static void pushTask(TreeCopy *tree, TreeTask task) {
+    if (tree->no_workers) {
+        runTask(tree, &task, &tree->walker_buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&tree->mtx);
+    while (tree->count == TREE_QUEUE_LEN && !tree->stop) {
+        pthread_cond_wait(&tree->not_full, &tree->mtx);
+    }
+
+    if (tree->stop) {
+        pthread_mutex_unlock(&tree->mtx);
+        runTask(tree, &task, NULL);
+        return;
+    }
+
+    tree->queue[(tree->head + tree->count) % TREE_QUEUE_LEN] = task;
+    tree->count++;
+    tree->pending++;
+    pthread_cond_signal(&tree->not_empty);
+    pthread_mutex_unlock(&tree->mtx);
+}
+
+static bool popTask(TreeCopy *tree, TreeTask *task) {
+    pthread_mutex_lock(&tree->mtx);
+    while (tree->count == 0 && !tree->walk_done) {
+        pthread_cond_wait(&tree->not_empty, &tree->mtx);
+    }
+
+    if (tree->count == 0) {
+        pthread_mutex_unlock(&tree->mtx);
+        return false;
+    }
+
+    *task = tree->queue[tree->head];
+    tree->head = (tree->head + 1) % TREE_QUEUE_LEN;
+    tree->count--;
+    pthread_cond_signal(&tree->not_full);
+    pthread_mutex_unlock(&tree->mtx);
+    return true;
+}
+
+/// @brief Copy file of task (unless copy is stopped) and free task
+static void runTask(TreeCopy *tree, TreeTask *task, CopyBuffer *buffer) {
+    if (buffer && !isStopped(tree)) {
+        CpContext_t context = {};
+        context.src = task->src_path;
+        context.dst = task->dst_path;
+        context.dst_path = task->dst_path;
+        context.buffer = buffer;
+
+        CpErr err = copyFileAt(&context, task->src_dir->fd, task->name, task->dst_dir->fd, task->name,
+                               NULL, tree->flags);
+        reportContext(tree, &context, err);
+    }
+
+    releaseDir(task->src_dir);
+    releaseDir(task->dst_dir);
+    free(task->src_path);
+    free(task->dst_path);
+}
+
+static void *treeWorker(void *tree_ptr) {
+    TreeCopy *tree = (TreeCopy *) tree_ptr;
+    CopyBuffer buffer = {NULL, 0};
+
+    TreeTask task = {};
+    while (popTask(tree, &task)) {
+        runTask(tree, &task, &buffer);
+
+        pthread_mutex_lock(&tree->mtx);
+        if (--tree->pending == 0) pthread_cond_broadcast(&tree->not_full);
+        pthread_mutex_unlock(&tree->mtx);
+    }
+
+    freeCopyBuffer(&buffer);
+    return NULL;
+}
+
+static void copySymlink(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir, const char *name,
+                        const char *src_path, const char *dst_path) {
+    char target[PATH_MAX + 1] = "";
+    ssize_t len = readlinkat(src_dir->fd, name, target, PATH_MAX);
+    if (len < 0) {
+        reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, {CP_ERROR::SRC_READ, errno});
+        return;
+    }
+    target[len] = '\0';
+
+    if (symlinkat(target, dst_dir->fd, name) < 0) {
+        if (errno != EEXIST) {
+            reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, {CP_ERROR::DST_SYMLINK, errno});
+            return;
+        }
+
+        struct stat dst_info = {};
+        if (fstatat(dst_dir->fd, name, &dst_info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(dst_info.st_mode)) {
+            reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, {CP_ERROR::DIR_REWRITE, 0});
+            return;
+        }
+        if (tree->flags->update && S_ISLNK(dst_info.st_mode)) {
+            char dst_target[PATH_MAX + 1] = "";
+            ssize_t dst_len = readlinkat(dst_dir->fd, name, dst_target, PATH_MAX);
+            if (dst_len == len && memcmp(dst_target, target, len) == 0) {
+                reportTree(tree, src_path, dst_path, CopyMethod::UP_TO_DATE, {CP_ERROR::SUCCESS, 0});
+                return;
+            }
+        }
+        if (!tree->flags->rewrite_existing && !tree->flags->update) {
+            reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, {CP_ERROR::DST_REWRITE, 0});
+            return;
+        }
+        if (unlinkat(dst_dir->fd, name, 0) < 0 || symlinkat(target, dst_dir->fd, name) < 0) {
+            reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, {CP_ERROR::DST_SYMLINK, errno});
+            return;
+        }
+    }
+
+    CpErr err = {CP_ERROR::SUCCESS, 0};
+    struct stat src_info = {};
+    if (tree->flags->preserve) {
+        err = (fstatat(src_dir->fd, name, &src_info, AT_SYMLINK_NOFOLLOW) == 0) ?
+              copySymlinkMetadata(dst_dir->fd, name, &src_info) : CpErr{CP_ERROR::SRC_STAT, errno};
+    }
+    reportTree(tree, src_path, dst_path, CopyMethod::SYMLINK, err);
+}
+
+static void copySubdir(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir, const char *name,
+                       const char *src_path, const char *dst_path, const char *rel_path) {
+    waitDirBudget(tree);
+    int src_fd = openat(src_dir->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat src_info = {};
+    if (src_fd < 0 || fstat(src_fd, &src_info) < 0) {
+        reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::SRC_OPEN, errno});
+        if (src_fd >= 0) close(src_fd);
+        return;
+    }
+
+    if (src_info.st_dev == tree->root_dev && src_info.st_ino == tree->root_ino) {
+        close(src_fd); // destination is inside source, don't copy it into itself
+        return;
+    }
+
+    // owner must be able to fill directory, real mode is set after copy
+    if (mkdirat(dst_dir->fd, name, (src_info.st_mode & 07777) | S_IRWXU) < 0 && errno != EEXIST) {
+        reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::DST_MKDIR, errno});
+        close(src_fd);
+        return;
+    }
+
+    int dst_fd = openat(dst_dir->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dst_fd < 0) {
+        // ENOTDIR or ELOOP: existing non-directory with the same name
+        int open_errno = errno;
+        bool not_dir = open_errno == ENOTDIR || open_errno == ELOOP;
+        reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY,
+                   {(not_dir) ? CP_ERROR::DST_MKDIR : CP_ERROR::DST_OPEN, (not_dir) ? ENOTDIR : open_errno});
+        close(src_fd);
+        return;
+    }
+
+    CpErr xattr_err = (tree->flags->preserve) ? copyXattrs(src_fd, dst_fd) : CpErr{CP_ERROR::SUCCESS, 0};
+    addFixup(tree, rel_path, &src_info);
+    if (xattr_err.code != CP_ERROR::SUCCESS) reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, xattr_err);
+    else reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::SUCCESS, 0});
+
+    DirRef *child_src = newDirRef(tree, src_fd);
+    DirRef *child_dst = newDirRef(tree, dst_fd);
+    if (child_src && child_dst) {
+        walkDir(tree, child_src, child_dst, src_path, dst_path, rel_path);
+    }
+    if (child_src) releaseDir(child_src);
+    if (child_dst) releaseDir(child_dst);
+}
+
+static void walkDir(TreeCopy *tree, DirRef *src_dir, DirRef *dst_dir,
+                    const char *src_path, const char *dst_path, const char *rel_path) {
+    int list_fd = openat(src_dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = (list_fd >= 0) ? fdopendir(list_fd) : NULL;
+    if (!dir) {
+        reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::SRC_OPEN, errno});
+        if (list_fd >= 0) close(list_fd);
+        return;
+    }
+
+    struct dirent *entry = NULL;
+    while (!isStopped(tree)) {
+        errno = 0;
+        if ((entry = readdir(dir)) == NULL) {
+            if (errno != 0) {
+                reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::SRC_READ, errno});
+            }
+            break;
+        }
+
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat info = {};
+            if (fstatat(src_dir->fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISREG(info.st_mode) ? DT_REG :
+                       S_ISDIR(info.st_mode) ? DT_DIR :
+                       S_ISLNK(info.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+        }
+
+        char *child_src = joinPath(src_path, name);
+        char *child_dst = joinPath(dst_path, name);
+        char *child_rel = joinPath(rel_path, name);
+        if (!child_src || !child_dst || !child_rel) {
+            free(child_src); free(child_dst); free(child_rel);
+            reportTree(tree, src_path, dst_path, CopyMethod::DIRECTORY, {CP_ERROR::SRC_READ, ENOMEM});
+            break;
+        }
+
+        switch (type) {
+            case DT_REG: {
+                progressAddTotal(1, 0); // size is known only when file is opened by worker
+                TreeTask task = {acquireDir(src_dir), acquireDir(dst_dir), child_src, child_dst, NULL};
+                task.name = child_src + strlen(child_src) - strlen(name);
+                pushTask(tree, task);
+                child_src = child_dst = NULL; // owned by task now
+                break;
+            }
+            case DT_DIR:
+                copySubdir(tree, src_dir, dst_dir, name, child_src, child_dst, child_rel);
+                break;
+            case DT_LNK:
+                copySymlink(tree, src_dir, dst_dir, name, child_src, child_dst);
+                break;
+            default:
+                reportTree(tree, child_src, child_dst, CopyMethod::NONE, {CP_ERROR::SRC_NOT_REGULAR, 0});
+                break;
+        }
+
+        free(child_src);
+        free(child_dst);
+        free(child_rel);
+    }
+
+    closedir(dir);
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+int copyTree(const char *src, const char *dst, const struct copy_flags *flags) {
+    assert(src); assert(dst); assert(flags);
+
+    TreeCopy *tree = (TreeCopy *) calloc(1, sizeof(TreeCopy));
+    if (!tree) {
+        ERRPRINTF("Failed to allocate tree copy state\n");
+        return CP_FATAL;
+    }
+    tree->flags = flags;
+    pthread_mutex_init(&tree->mtx, NULL);
+    pthread_mutex_init(&tree->report_mtx, NULL);
+    pthread_cond_init(&tree->not_empty, NULL);
+    pthread_cond_init(&tree->not_full, NULL);
+
+    // half of descriptors are left for files being copied, atomic batches and journal
+    struct rlimit fd_limit = {};
+    rlim_t fd_max = (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) ? fd_limit.rlim_cur : 1024;
+    if (fd_max == RLIM_INFINITY || fd_max > INT_MAX) fd_max = INT_MAX;
+    tree->dir_budget = (int)(fd_max / 2);
+    if (tree->dir_budget < TREE_DIR_FDS_MIN) tree->dir_budget = TREE_DIR_FDS_MIN;
+
+    // dst/basename(src) if dst is directory; trailing slashes of src are ignored
+    char *target = NULL;
+    struct stat dst_info = {};
+    bool dst_exists = stat(dst, &dst_info) == 0;
+    if (dst_exists && S_ISDIR(dst_info.st_mode)) {
+        char *src_copy = strdup(src);
+        if (src_copy) {
+            size_t len = strlen(src_copy);
+            while (len > 1 && src_copy[len - 1] == '/') src_copy[--len] = '\0';
+            const char *slash = strrchr(src_copy, '/');
+            target = joinPath(dst, (slash && slash[1]) ? slash + 1 : src_copy);
+            free(src_copy);
+        }
+    } else if (!dst_exists && !flags->only_dir_dst) {
+        target = strdup(dst);
+    } else {
+        reportTree(tree, src, dst, CopyMethod::DIRECTORY, {CP_ERROR::DST_NOT_DIR, 0});
+    }
+
+    int src_fd = -1, dst_fd = -1;
+    if (target) {
+        struct stat src_info = {};
+        src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (src_fd < 0 || fstat(src_fd, &src_info) < 0) {
+            reportTree(tree, src, target, CopyMethod::DIRECTORY, {CP_ERROR::SRC_OPEN, errno});
+        } else if (mkdir(target, (src_info.st_mode & 07777) | S_IRWXU) < 0 && errno != EEXIST) {
+            reportTree(tree, src, target, CopyMethod::DIRECTORY, {CP_ERROR::DST_MKDIR, errno});
+        } else if ((dst_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            CP_ERROR code = (errno == ENOTDIR) ? CP_ERROR::DST_MKDIR : CP_ERROR::DST_OPEN;
+            reportTree(tree, src, target, CopyMethod::DIRECTORY, {code, errno});
+        } else {
+            struct stat root_info = {};
+            fstat(dst_fd, &root_info);
+            tree->root_dev = root_info.st_dev;
+            tree->root_ino = root_info.st_ino;
+            addFixup(tree, ".", &src_info);
+            if (flags->preserve) {
+                CpErr xattr_err = copyXattrs(src_fd, dst_fd);
+                if (xattr_err.code != CP_ERROR::SUCCESS)
+                    reportTree(tree, src, target, CopyMethod::DIRECTORY, xattr_err);
+            }
+        }
+    }
+
+    if (dst_fd >= 0) {
+        int jobs = (flags->jobs > 0) ? flags->jobs : 1;
+        pthread_t *workers = (pthread_t *) calloc(jobs, sizeof(pthread_t));
+        int started = 0;
+        for (; workers && started < jobs; started++) {
+            int code = pthread_create(&workers[started], NULL, treeWorker, tree);
+            if (code != 0) {
+                ERRPRINTF("Failed to start copy thread:%s\n", strerror(code));
+                break;
+            }
+        }
+
+        tree->no_workers = started == 0;
+
+        int root_fd = dup(dst_fd); // for directory fixups
+        DirRef *src_dir = newDirRef(tree, src_fd);
+        DirRef *dst_dir = newDirRef(tree, dst_fd);
+        src_fd = dst_fd = -1;
+        if (src_dir && dst_dir) {
+            walkDir(tree, src_dir, dst_dir, src, target, ".");
+        }
+        if (src_dir) releaseDir(src_dir);
+        if (dst_dir) releaseDir(dst_dir);
+
+        pthread_mutex_lock(&tree->mtx);
+        tree->walk_done = true;
+        pthread_cond_broadcast(&tree->not_empty);
+        pthread_mutex_unlock(&tree->mtx);
+
+        for (int idx = 0; idx < started; idx++) {
+            pthread_join(workers[idx], NULL);
+        }
+        free(workers);
+
+        // postponed renames must land before directories get their final mode and times
+        if (flags->atomic) flushAtomicWrites();
+
+        if (root_fd >= 0) {
+            applyFixups(tree, root_fd, target);
+            close(root_fd);
+        }
+    }
+
+    if (src_fd >= 0) close(src_fd);
+    for (size_t idx = 0; idx < tree->fixup_count; idx++) {
+        free(tree->fixups[idx].rel_path);
+    }
+    free(tree->fixups);
+    free(target);
+    freeCopyBuffer(&tree->walker_buffer);
+
+    int result = tree->result;
+    pthread_cond_destroy(&tree->not_full);
+    pthread_cond_destroy(&tree->not_empty);
+    pthread_mutex_destroy(&tree->report_mtx);
+    pthread_mutex_destroy(&tree->mtx);
+    free(tree);
+
+    return result;
+}
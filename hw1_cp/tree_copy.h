@@ -0,0 +1,15 @@
+#ifndef TREE_COPY_H
+#define TREE_COPY_H
+
+#include "file_copy.h"
+
+const int TREE_QUEUE_LEN = 1024; ///< files waiting for copy threads; walker sleeps when queue is full
+const int TREE_DIR_FDS_MIN = 16;  ///< directory descriptors walker may always keep open
+
+/// @brief Copy directory src like cp -r: into dst/basename(src) if dst is directory, into dst otherwise
+/// Walker runs in calling thread with openat/fstatat relative to directory descriptors and feeds
+/// files to flags->jobs copy threads while it walks. Symlinks are recreated, modes are kept.
+/// Errors are reported with parseCpErr; returns CP_FATAL if copy was stopped, 0 otherwise
+int copyTree(const char *src, const char *dst, const struct copy_flags *flags);
+
+#endif
@@ -0,0 +1,109 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "update_copy.h"
+#include "copy_engine.h"
+#include "progress.h"
+#include "throttle.h"
+#include "verify_copy.h"
+
+static ssize_t readFull(int fd, char *buffer, size_t size, off_t offset);
+
+/// @brief pread until size bytes or EOF
+static ssize_t readFull(int fd, char *buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes_read = pread(fd, buffer + done, size - done, offset + (off_t) done);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (bytes_read == 0) break;
+        done += bytes_read;
+    }
+
+    return (ssize_t) done;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool isUpToDate(const struct stat *src_info, const struct stat *dst_info) {
+    assert(src_info); assert(dst_info);
+    return src_info->st_size == dst_info->st_size &&
+           src_info->st_mtim.tv_sec == dst_info->st_mtim.tv_sec &&
+           src_info->st_mtim.tv_nsec == dst_info->st_mtim.tv_nsec;
+}
+
+CpErr copyFileDelta(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags) {
+    assert(src_info); assert(context); assert(flags);
+    context->method = CopyMethod::DELTA;
+    context->bytes_copied = 0;
+    context->checksum = 0;
+    context->has_checksum = flags->verify;
+
+    struct stat dst_info = {};
+    if (fstat(dst_fd, &dst_info) < 0) return {CP_ERROR::DST_OPEN, errno};
+
+    size_t buf_size = chooseBufferSize(src_info->st_blksize, dst_info.st_blksize,
+                                       src_info->st_size, flags->buffer_size);
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *src_data = (char *) reserveCopyBuffer(buffer, 2 * buf_size);
+    if (!src_data) return {CP_ERROR::SRC_READ, ENOMEM};
+    char *dst_data = src_data + buf_size;
+
+    // comparing with block granularity: small change doesn't rewrite whole buffer
+    size_t block = (dst_info.st_blksize > 0) ? dst_info.st_blksize : BUF_SIZE;
+    CpErr status = {CP_ERROR::SUCCESS, 0};
+    off_t offset = 0;
+    while (true) {
+        ssize_t src_len = readFull(src_fd, src_data, buf_size, offset);
+        if (src_len < 0) { status = {CP_ERROR::SRC_READ, errno}; break; }
+        if (src_len == 0) break;
+        if (flags->verify) context->checksum = crc32c(context->checksum, src_data, src_len);
+
+        ssize_t dst_len = (offset < dst_info.st_size) ? readFull(dst_fd, dst_data, src_len, offset) : 0;
+        if (dst_len < 0) { status = {CP_ERROR::DST_WRITE, errno}; break; }
+
+        for (size_t pos = 0; pos < (size_t) src_len && status.code == CP_ERROR::SUCCESS; pos += block) {
+            size_t len = ((size_t) src_len - pos < block) ? (size_t) src_len - pos : block;
+            if (pos + len <= (size_t) dst_len && memcmp(src_data + pos, dst_data + pos, len) == 0) continue;
+
+            for (size_t written = 0; written < len;) {
+                ssize_t code = pwrite(dst_fd, src_data + pos + written, len - written,
+                                      offset + (off_t)(pos + written));
+                if (code < 0) {
+                    if (errno == EINTR) continue;
+                    status = {CP_ERROR::DST_WRITE, errno};
+                    break;
+                }
+                written += code;
+            }
+            context->bytes_copied += len;
+        }
+        if (status.code != CP_ERROR::SUCCESS) break;
+
+        offset += src_len;
+        progressAdd(context->progress, src_len);
+        throttleIo(src_len);
+    }
+
+    if (status.code == CP_ERROR::SUCCESS && offset != dst_info.st_size && ftruncate(dst_fd, offset) < 0) {
+        status = {CP_ERROR::DST_WRITE, errno};
+    }
+
+    freeCopyBuffer(&local_buffer);
+    return status;
+}
+
+CpErr copyModificationTime(int dst_fd, const struct stat *src_info) {
+    assert(src_info);
+    struct timespec times[2] = {{0, UTIME_OMIT}, src_info->st_mtim};
+    if (futimens(dst_fd, times) < 0) return {CP_ERROR::DST_WRITE, errno};
+
+    return {CP_ERROR::SUCCESS, 0};
+}
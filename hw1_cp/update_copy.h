@@ -0,0 +1,20 @@
+#ifndef UPDATE_COPY_H
+#define UPDATE_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+/// @brief Destination has the same size and modification time as source
+bool isUpToDate(const struct stat *src_info, const struct stat *dst_info);
+
+/// @brief Rewrite in place only blocks of dst_fd which differ from src_fd, then cut dst to source size
+/// Both files are compared block by block, so unchanged data is only read. File offsets are not used
+CpErr copyFileDelta(int src_fd, int dst_fd, const struct stat *src_info,
+                    CpContext_t *context, const struct copy_flags *flags);
+
+/// @brief Set modification time of destination to the one of source, so next --update run skips it
+CpErr copyModificationTime(int dst_fd, const struct stat *src_info);
+
+#endif
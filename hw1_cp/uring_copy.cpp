@@ -0,0 +1,373 @@
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "uring_copy.h"
+#include "progress.h"
+#include "throttle.h"
+#include "copy_engine.h"
+
+/// @brief Mapped submission and completion queues of one ring
+struct UringRing {
+    int fd;
+    unsigned sq_entries;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;     ///< tail including entries not yet visible to kernel
+    unsigned to_submit;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+enum class SlotState {
+    FREE,
+    LINKED,     ///< read -> write pair is in flight
+    WRITE,      ///< finishing short write or short read
+};
+
+/// @brief One registered buffer with the file range it holds
+struct UringSlot {
+    SlotState state;
+    off_t offset;
+    size_t length;      ///< bytes requested by read, then bytes that must be written
+    size_t written;
+    ssize_t read_res;
+    int pending;        ///< completions not received yet
+};
+
+/// @brief Whole state of one file copy
+struct UringCopy {
+    UringRing ring;
+    UringSlot slots[URING_QUEUE_DEPTH];
+    unsigned slot_count;
+    char *memory;
+    size_t block;
+    bool fixed;         ///< buffers are registered
+
+    int src_fd, dst_fd;
+    off_t size;
+    off_t next;         ///< start of the next unread range
+    bool eof;           ///< file was truncated while copying
+
+    off_t retry_offset[URING_QUEUE_DEPTH];  ///< tails of short reads
+    size_t retry_length[URING_QUEUE_DEPTH];
+    unsigned retry_count;
+
+    unsigned busy;
+    size_t copied;
+    ProgressSlot *progress;
+    bool any_read;
+    bool failed;
+    CpErr error;
+};
+
+static int setupRing(UringRing *ring, unsigned entries);
+
+static void destroyRing(UringRing *ring);
+
+static struct io_uring_sqe *getSqe(UringRing *ring);
+
+static int submitAndWait(UringRing *ring, unsigned wait_nr);
+
+static void prepRw(struct io_uring_sqe *sqe, bool write, bool fixed, int fd, void *addr,
+                   size_t len, off_t offset, unsigned buf_index, uint64_t user_data);
+
+static void setUringError(UringCopy *copy, CpErr error);
+
+static bool startSlot(UringCopy *copy, unsigned idx);
+
+static void submitSlotWrite(UringCopy *copy, unsigned idx);
+
+static void completeRequest(UringCopy *copy, const struct io_uring_cqe *cqe);
+
+static int setupRing(UringRing *ring, unsigned entries) {
+    struct io_uring_params params = {};
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return -errno;
+
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) { ring->sq_map = NULL; return -errno; }
+
+    if (single_mmap) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) { ring->cq_map = NULL; return -errno; }
+    }
+
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return -errno;
+    ring->sqes = (struct io_uring_sqe *) sqes;
+
+    char *sq = (char *) ring->sq_map, *cq = (char *) ring->cq_map;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->to_submit = 0;
+    return 0;
+}
+
+static void destroyRing(UringRing *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+static struct io_uring_sqe *getSqe(UringRing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+
+    unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int submitAndWait(UringRing *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    while (true) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+
+        ring->to_submit -= (unsigned) submitted;
+        return 0;
+    }
+}
+
+static void prepRw(struct io_uring_sqe *sqe, bool write, bool fixed, int fd, void *addr,
+                   size_t len, off_t offset, unsigned buf_index, uint64_t user_data) {
+    if (fixed) sqe->opcode = (write) ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else       sqe->opcode = (write) ? IORING_OP_WRITE : IORING_OP_READ;
+
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) addr;
+    sqe->len = (uint32_t) len;
+    sqe->off = (uint64_t) offset;
+    sqe->buf_index = (uint16_t) buf_index;
+    sqe->user_data = user_data;
+}
+
+static void setUringError(UringCopy *copy, CpErr error) {
+    if (!copy->failed) {
+        copy->failed = true;
+        copy->error = error;
+    }
+}
+
+/// user_data of requests: slot index << 1 | is_write
+static bool startSlot(UringCopy *copy, unsigned idx) {
+    UringSlot *slot = &copy->slots[idx];
+    off_t offset = 0;
+    size_t length = 0;
+
+    if (copy->retry_count > 0) {
+        copy->retry_count--;
+        offset = copy->retry_offset[copy->retry_count];
+        length = copy->retry_length[copy->retry_count];
+    } else if (!copy->eof && copy->next < copy->size) {
+        offset = copy->next;
+        length = ((size_t)(copy->size - offset) < copy->block) ? (size_t)(copy->size - offset) : copy->block;
+        copy->next += length;
+    } else {
+        return false;
+    }
+
+    struct io_uring_sqe *read_sqe = getSqe(&copy->ring),
+                        *write_sqe = getSqe(&copy->ring);
+    assert(read_sqe && write_sqe); // ring has two entries for every slot
+    char *buffer = copy->memory + idx * copy->block;
+
+    prepRw(read_sqe, false, copy->fixed, copy->src_fd, buffer, length, offset, idx, idx << 1);
+    read_sqe->flags |= IOSQE_IO_LINK; // short read cancels write
+    prepRw(write_sqe, true, copy->fixed, copy->dst_fd, buffer, length, offset, idx, idx << 1 | 1);
+
+    *slot = {SlotState::LINKED, offset, length, 0, 0, 2};
+    copy->busy++;
+    return true;
+}
+
+static void submitSlotWrite(UringCopy *copy, unsigned idx) {
+    UringSlot *slot = &copy->slots[idx];
+    struct io_uring_sqe *sqe = getSqe(&copy->ring);
+    assert(sqe);
+
+    char *buffer = copy->memory + idx * copy->block + slot->written;
+    prepRw(sqe, true, copy->fixed, copy->dst_fd, buffer, slot->length - slot->written,
+           slot->offset + (off_t) slot->written, idx, idx << 1 | 1);
+
+    slot->state = SlotState::WRITE;
+    slot->pending = 1;
+}
+
+static void completeRequest(UringCopy *copy, const struct io_uring_cqe *cqe) {
+    unsigned idx = (unsigned)(cqe->user_data >> 1);
+    bool is_write = cqe->user_data & 1;
+    UringSlot *slot = &copy->slots[idx];
+    int res = cqe->res;
+
+    slot->pending--;
+    if (!is_write) {
+        slot->read_res = res;
+        if (res < 0) setUringError(copy, {CP_ERROR::SRC_READ, -res});
+        else copy->any_read = true;
+    } else if (res >= 0) {
+        slot->written += res;
+    } else if (res != -ECANCELED) { // cancelled writes are handled after short read
+        setUringError(copy, {CP_ERROR::DST_WRITE, -res});
+    }
+
+    if (slot->pending > 0) return;
+
+    if (!copy->failed) {
+        if (slot->state == SlotState::LINKED && slot->read_res < (ssize_t) slot->length) {
+            if (slot->read_res == 0) {
+                copy->eof = true;
+                slot->length = 0;
+            } else {
+                copy->retry_offset[copy->retry_count] = slot->offset + slot->read_res;
+                copy->retry_length[copy->retry_count] = slot->length - slot->read_res;
+                copy->retry_count++;
+                slot->length = slot->read_res;
+            }
+        }
+
+        if (slot->written < slot->length) {
+            submitSlotWrite(copy, idx);
+            return;
+        }
+        copy->copied += slot->length;
+        progressAdd(copy->progress, slot->length);
+        throttleIo(slot->length);
+    }
+
+    slot->state = SlotState::FREE;
+    copy->busy--;
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+bool copyFileUring(int src_fd, int dst_fd, const struct stat *src_info,
+                   CpContext_t *context, const struct copy_flags *flags, CpErr *status) {
+    assert(src_info); assert(context); assert(flags); assert(status);
+    // ranges are planned from st_size, files like /proc/... must be read until EOF
+    if (src_info->st_size <= 0) return false;
+
+    UringCopy *copy = (UringCopy *) calloc(1, sizeof(UringCopy));
+    if (!copy) return false;
+    copy->ring.fd = -1;
+
+    if (setupRing(&copy->ring, 2 * URING_QUEUE_DEPTH) < 0) {
+        destroyRing(&copy->ring);
+        free(copy);
+        return false;
+    }
+
+    struct stat dst_info = {};
+    blksize_t dst_block = (fstat(dst_fd, &dst_info) == 0) ? dst_info.st_blksize : 0;
+    size_t cap = (flags->buffer_size < URING_MAX_BLOCK) ? flags->buffer_size : URING_MAX_BLOCK;
+    copy->block = chooseBufferSize(src_info->st_blksize, dst_block, src_info->st_size, cap);
+
+    off_t blocks = (src_info->st_size + (off_t) copy->block - 1) / (off_t) copy->block;
+    copy->slot_count = (blocks < (off_t) URING_QUEUE_DEPTH) ? (unsigned) blocks : URING_QUEUE_DEPTH;
+    if (copy->slot_count == 0) copy->slot_count = 1;
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    copy->memory = (char *) reserveCopyBuffer(buffer, copy->block * copy->slot_count);
+    if (!copy->memory) {
+        destroyRing(&copy->ring);
+        free(copy);
+        return false;
+    }
+
+    struct iovec iov[URING_QUEUE_DEPTH] = {};
+    for (unsigned idx = 0; idx < copy->slot_count; idx++) {
+        iov[idx].iov_base = copy->memory + idx * copy->block;
+        iov[idx].iov_len = copy->block;
+    }
+    // registration pins memory and may hit RLIMIT_MEMLOCK, plain read/write requests work without it
+    copy->fixed = syscall(__NR_io_uring_register, copy->ring.fd, IORING_REGISTER_BUFFERS,
+                          iov, copy->slot_count) == 0;
+
+    copy->src_fd = src_fd;
+    copy->dst_fd = dst_fd;
+    copy->size = src_info->st_size;
+    copy->progress = context->progress;
+    copy->error = {CP_ERROR::SUCCESS, 0};
+    context->method = CopyMethod::URING;
+
+    while (true) {
+        for (unsigned idx = 0; !copy->failed && idx < copy->slot_count; idx++) {
+            if (copy->slots[idx].state == SlotState::FREE && !startSlot(copy, idx)) break;
+        }
+        if (copy->busy == 0) break;
+
+        int code = submitAndWait(&copy->ring, 1);
+        if (code < 0) {
+            // requests that are already in flight are cancelled when ring is closed
+            setUringError(copy, {CP_ERROR::SRC_READ, -code});
+            break;
+        }
+
+        unsigned head = *copy->ring.cq_head;
+        unsigned tail = __atomic_load_n(copy->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            completeRequest(copy, &copy->ring.cqes[head & *copy->ring.cq_mask]);
+        }
+        __atomic_store_n(copy->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    destroyRing(&copy->ring);
+    freeCopyBuffer(&local_buffer);
+
+    bool unsupported = copy->failed && !copy->any_read &&
+                       (copy->error.cp_errno == EINVAL || copy->error.cp_errno == EOPNOTSUPP);
+    context->bytes_copied = copy->copied;
+    *status = (copy->failed) ? copy->error : CpErr{CP_ERROR::SUCCESS, 0};
+    free(copy);
+
+    return !unsupported;
+}
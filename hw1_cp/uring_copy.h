@@ -0,0 +1,18 @@
+#ifndef URING_COPY_H
+#define URING_COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "file_copy.h"
+
+const unsigned URING_QUEUE_DEPTH = 16;      ///< ranges in flight, each is linked read -> write
+const size_t URING_MAX_BLOCK = 512 << 10;   ///< max size of one registered buffer
+
+/// @brief Copy file through io_uring: ring of linked read -> write requests on registered buffers
+/// Returns false if io_uring is not available (old kernel, seccomp, sysctl) or file size is unknown;
+/// nothing is copied then and caller should use another engine. Otherwise result is stored in status
+bool copyFileUring(int src_fd, int dst_fd, const struct stat *src_info,
+                   CpContext_t *context, const struct copy_flags *flags, CpErr *status);
+
+#endif
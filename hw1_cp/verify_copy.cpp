@@ -0,0 +1,189 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "verify_copy.h"
+#include "copy_engine.h"
+
+const size_t VERIFY_BUF_SIZE = 1 << 20;     ///< read-back buffer, multiple of O_DIRECT alignment
+
+static uint32_t CRC_TABLE[8][256];
+
+static uint32_t CRC_X2N[32];     ///< x^(2^n) modulo polynomial, reflected like CRC itself
+
+static pthread_once_t CRC_ONCE = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crcUpdate)(uint32_t crc, const unsigned char *data, size_t size) = NULL;
+
+static void initCrc();
+
+static uint32_t crcSoftware(uint32_t crc, const unsigned char *data, size_t size);
+
+#if defined(__x86_64__)
+static uint32_t crcHardware(uint32_t crc, const unsigned char *data, size_t size);
+#endif
+
+static uint32_t multModPoly(uint32_t a, uint32_t b);
+
+static uint32_t shiftBytes(uint32_t crc, off_t size);
+
+static int readBack(int fd, char *buffer, uint32_t *crc);
+
+/// @brief Build slicing-by-8 tables and pick implementation for this CPU
+static void initCrc() {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        CRC_TABLE[0][byte] = crc;
+    }
+    for (int slice = 1; slice < 8; slice++) {
+        for (int byte = 0; byte < 256; byte++) {
+            uint32_t prev = CRC_TABLE[slice - 1][byte];
+            CRC_TABLE[slice][byte] = (prev >> 8) ^ CRC_TABLE[0][prev & 0xFF];
+        }
+    }
+
+    CRC_X2N[0] = 1u << 30;     // x^1
+    for (int idx = 1; idx < 32; idx++) CRC_X2N[idx] = multModPoly(CRC_X2N[idx - 1], CRC_X2N[idx - 1]);
+
+    crcUpdate = crcSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crcUpdate = crcHardware;
+#endif
+}
+
+static uint32_t crcSoftware(uint32_t crc, const unsigned char *data, size_t size) {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = 0, high = 0;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+        crc = CRC_TABLE[7][low & 0xFF] ^ CRC_TABLE[6][(low >> 8) & 0xFF] ^
+              CRC_TABLE[5][(low >> 16) & 0xFF] ^ CRC_TABLE[4][low >> 24] ^
+              CRC_TABLE[3][high & 0xFF] ^ CRC_TABLE[2][(high >> 8) & 0xFF] ^
+              CRC_TABLE[1][(high >> 16) & 0xFF] ^ CRC_TABLE[0][high >> 24];
+    }
+    for (; size > 0; data++, size--) crc = (crc >> 8) ^ CRC_TABLE[0][(crc ^ *data) & 0xFF];
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/// @brief crc32 instruction eats 8 bytes per cycle of throughput, far more than read-back of any device
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char *data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word = 0;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    for (; size > 0; data++, size--) crc = __builtin_ia32_crc32qi(crc, *data);
+
+    return crc;
+}
+#endif
+
+/// @brief a * b modulo polynomial, both in reflected bit order (x^0 is top bit)
+static uint32_t multModPoly(uint32_t a, uint32_t b) {
+    uint32_t mask = 1u << 31, product = 0;
+    while (mask != 0 && a != 0) {
+        if (a & mask) {
+            product ^= b;
+            a ^= mask;
+        }
+        mask >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return product;
+}
+
+/// @brief Raw CRC register after size zero bytes: crc * x^(8 * size), O(log size)
+static uint32_t shiftBytes(uint32_t crc, off_t size) {
+    uint64_t bits = (uint64_t) size;
+    for (int power = 3; bits != 0; bits >>= 1, power++) {
+        if (bits & 1) crc = multModPoly(CRC_X2N[power & 31], crc);
+    }
+
+    return crc;
+}
+
+/// @brief CRC32C of whole fd from offset 0; returns 0 or errno
+static int readBack(int fd, char *buffer, uint32_t *crc) {
+    *crc = 0;
+    off_t pos = 0;
+    while (true) {
+        ssize_t bytes_read = pread(fd, buffer, VERIFY_BUF_SIZE, pos);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (bytes_read == 0) return 0;
+
+        *crc = crc32c(*crc, buffer, bytes_read);
+        pos += bytes_read;
+    }
+}
+
+/* =============================== GLOBAL SYMBOLS ================================= */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    assert(data || size == 0);
+    pthread_once(&CRC_ONCE, initCrc);
+    return ~crcUpdate(~crc, (const unsigned char *) data, size);
+}
+
+uint32_t crc32cCombine(uint32_t crc, uint32_t next_crc, off_t next_size) {
+    assert(next_size >= 0);
+    pthread_once(&CRC_ONCE, initCrc);
+    // inversions at both ends of CRC32C cancel out for xor of two CRCs
+    return shiftBytes(crc, next_size) ^ next_crc;
+}
+
+uint32_t crc32cZeros(uint32_t crc, off_t size) {
+    assert(size >= 0);
+    pthread_once(&CRC_ONCE, initCrc);
+    return ~shiftBytes(~crc, size);
+}
+
+CpErr verifyCopy(int dst_fd, const CpContext_t *context) {
+    assert(context);
+    // dirty pages would be read back from memory, not from the device
+    if (fdatasync(dst_fd) < 0) return {CP_ERROR::VERIFY_MISMATCH, errno};
+
+    CopyBuffer local_buffer = {NULL, 0};
+    CopyBuffer *buffer = (context->buffer) ? context->buffer : &local_buffer;
+    char *memory = (char *) reserveCopyBuffer(buffer, VERIFY_BUF_SIZE);
+    if (!memory) return {CP_ERROR::VERIFY_MISMATCH, ENOMEM};
+
+    // O_DIRECT is set on new open file description: dst_fd may be shared with copy engines
+    char fd_path[MAX_PATH_LEN] = "";
+    snprintf(fd_path, MAX_PATH_LEN, "/proc/self/fd/%d", dst_fd);
+    int direct_fd = open(fd_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+
+    uint32_t crc = 0;
+    int read_errno = (direct_fd >= 0) ? readBack(direct_fd, memory, &crc) : errno;
+    if (direct_fd >= 0) close(direct_fd);
+    if (read_errno == EINVAL) {
+        // filesystem without O_DIRECT: cached copy is evicted, so pages are read again from device
+        // dst_fd itself is write-only, so file is reopened for reading
+        int read_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+        if (read_fd < 0) {
+            read_errno = errno;
+        } else {
+            posix_fadvise(read_fd, 0, 0, POSIX_FADV_DONTNEED);
+            read_errno = readBack(read_fd, memory, &crc);
+            close(read_fd);
+        }
+    }
+    freeCopyBuffer(&local_buffer);
+
+    if (read_errno != 0) return {CP_ERROR::VERIFY_MISMATCH, read_errno};
+    if (crc != context->checksum) return {CP_ERROR::VERIFY_MISMATCH, 0};
+    return {CP_ERROR::SUCCESS, 0};
+}
@@ -0,0 +1,28 @@
+#ifndef VERIFY_COPY_H
+#define VERIFY_COPY_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "file_copy.h"
+
+const uint32_t CRC32C_POLY = 0x82F63B78;    ///< Castagnoli polynomial, reflected
+
+/// @brief Continue CRC32C of previous data (start with 0) with size bytes
+/// Uses SSE4.2 crc32 instruction when CPU has it, slicing-by-8 tables otherwise
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+/// @brief CRC32C of data followed by next data, from crc of the first part and next_crc of next_size bytes
+/// Lets parallel ranges be checksummed separately
+uint32_t crc32cCombine(uint32_t crc, uint32_t next_crc, off_t next_size);
+
+/// @brief Continue CRC32C with size zero bytes without reading them, e.g. for holes of sparse file
+uint32_t crc32cZeros(uint32_t crc, off_t size);
+
+/// @brief Read dst_fd back bypassing page cache and compare its CRC32C with context->checksum
+/// Destination is flushed and read through new O_DIRECT descriptor, so data comes from the device;
+/// without O_DIRECT support its cached pages are evicted first. Returns VERIFY_MISMATCH on difference
+/// or read error (then cp_errno is set). File offsets are not used
+CpErr verifyCopy(int dst_fd, const CpContext_t *context);
+
+#endif
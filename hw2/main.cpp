@@ -1,7 +1,37 @@
 #include "microBash.hpp"
 
-int main() {
-    microBash bash;
-    bash.run();
+#include <getopt.h>
+
+int main(int argc, char *argv[]) {
+    bool report_timing = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        switch (opt) {
+            case 't':
+                report_timing = true; // spawn latency of every pipeline stage
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t] [script]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    microBash bash(report_timing);
+
+    // batch mode: script file or stdin which isn't terminal is run without prompt
+    if (optind < argc) {
+        int script_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            fprintf(stderr, "%s: can't open '%s': %s\n", argv[0], argv[optind], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        bash.run_script(script_fd);
+        close(script_fd);
+    } else if (!isatty(STDIN_FD)) {
+        bash.run_script(STDIN_FD);
+    } else {
+        bash.run();
+    }
     return 0;
 }
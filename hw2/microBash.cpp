@@ -41,7 +41,8 @@ void *memoryArena::alloc(size_t number, size_t elem_size) {
 
 pipe_fd pipe_create() {
     int fd[2] = {-1, -1};
-    if (pipe(fd) < 0) {
+    // spawned processes get only ends installed by file actions
+    if (pipe2(fd, O_CLOEXEC) < 0) {
         perror("Failed to create pipe");
         exit(1);
     }
@@ -49,48 +50,301 @@ pipe_fd pipe_create() {
     return pipe_fd{fd[0], fd[1]};
 }
 
-/* ==================== PROCESS ABSTRACTION ====================== */
-MicroBashStatus proc_t::execute(pipe_fd in, pipe_fd out) {
-    // creating pipes
-    if (in.valid()) {
-        close(in.write_fd);
-        dup2(in.read_fd, STDIN_FD);
-        close(in.read_fd);
+/* ==================== PATH CACHE =============================== */
+pathCache::~pathCache() {
+    clear();
+    free(path_env);
+}
+
+/// @brief Slot of name or empty slot where it should be inserted
+size_t pathCache::find_slot(const char *name) const {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *ptr = name; *ptr; ptr++) {
+        hash = (hash ^ (unsigned char) *ptr) * 1099511628211ULL;
     }
 
-    if (pipe && out.valid()) {
-        close(out.read_fd);
-        dup2(out.write_fd, STDOUT_FD);
-        close(out.write_fd);
+    size_t mask = slots.size() - 1;
+    for (size_t idx = hash & mask;; idx = (idx + 1) & mask) {
+        if (!slots[idx].name || strcmp(slots[idx].name, name) == 0) return idx;
     }
+}
+
+void pathCache::grow() {
+    std::vector<entry> old_slots(2 * slots.size());
+    std::swap(slots, old_slots);
+    for (const entry& old: old_slots) {
+        if (old.name) slots[find_slot(old.name)] = old;
+    }
+}
+
+void pathCache::check_path_env() {
+    const char *env = getenv("PATH");
+    if (!env) env = DEFAULT_PATH;
+    if (path_env && strcmp(path_env, env) == 0) return;
+
+    clear();
+    free(path_env);
+    path_env = strdup(env);
+}
+
+/// @brief Find executable name in PATH like execvp; result is stored in scratch
+const char *pathCache::search(const char *name) {
+    for (const char *dir = path_env; dir;) {
+        const char *colon = strchr(dir, ':');
+        int dir_length = (colon) ? int(colon - dir) : (int) strlen(dir);
+
+        // empty entry is current directory
+        int length = (dir_length == 0) ? snprintf(scratch, sizeof(scratch), "%s", name)
+                                       : snprintf(scratch, sizeof(scratch), "%.*s/%s", dir_length, dir, name);
+        struct stat info = {};
+        if (length > 0 && (size_t) length < sizeof(scratch) &&
+            access(scratch, X_OK) == 0 && stat(scratch, &info) == 0 && S_ISREG(info.st_mode)) {
+            return scratch;
+        }
+
+        dir = (colon) ? colon + 1 : nullptr;
+    }
+
+    return nullptr;
+}
+
+const char *pathCache::lookup(const char *name) {
+    assert(name);
+    if (strchr(name, '/')) return name;
+
+    check_path_env();
+    if (!path_env) return search(name);
+
+    size_t slot = find_slot(name);
+    if (slots[slot].path) {
+        slots[slot].hits++;
+        return slots[slot].path;
+    }
+
+    const char *path = search(name);
+    // commands from relative PATH entries depend on current directory
+    if (!path || path[0] != '/') return path;
+
+    if (!slots[slot].name) {
+        if (2 * (used + 1) > slots.size()) {
+            grow();
+            slot = find_slot(name);
+        }
+        slots[slot].name = strdup(name);
+        used++;
+    }
+    slots[slot].path = strdup(path);
+    slots[slot].hits = 1;
+    return slots[slot].path;
+}
+
+void pathCache::forget(const char *name) {
+    assert(name);
+    size_t slot = find_slot(name);
+    if (!slots[slot].name) return;
+
+    // name stays in table, so probe chains aren't broken
+    free(slots[slot].path);
+    slots[slot].path = nullptr;
+    slots[slot].hits = 0;
+}
+
+void pathCache::clear() {
+    for (entry& slot: slots) {
+        free(slot.name);
+        free(slot.path);
+        slot = entry();
+    }
+    used = 0;
+}
+
+void pathCache::print(int out_fd) const {
+    bool empty = true;
+    for (const entry& slot: slots) {
+        if (!slot.path) continue;
+        if (empty) dprintf(out_fd, "hits\tcommand\n");
+        dprintf(out_fd, "%4u\t%s\n", slot.hits, slot.path);
+        empty = false;
+    }
+    if (empty) dprintf(out_fd, "hash: hash table empty\n");
+}
+
+/* ==================== SCRIPT READER ============================ */
+scriptReader::scriptReader(int fd_): fd(fd_) {
+    struct stat info = {};
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        if (start >= 0 && info.st_size > start) {
+            void *memory = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (memory != MAP_FAILED) {
+                madvise(memory, (size_t) info.st_size, MADV_SEQUENTIAL);
+                data = (char *) memory;
+                size = (size_t) info.st_size;
+                pos = (size_t) start;
+                mapped = true;
+                eof = true;
+                return;
+            }
+        }
+    }
+
+    capacity = SCRIPT_CHUNK;
+    data = (char *) malloc(capacity);
+    if (!data) {
+        fprintf(stderr, "Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+scriptReader::~scriptReader() {
+    if (mapped) munmap(data, size);
+    else free(data);
+}
+
+/// @brief Read next chunk keeping unfinished line; false if nothing was read
+bool scriptReader::fill() {
+    if (eof) return false;
+
+    if (pos > 0) {
+        memmove(data, data + pos, size - pos);
+        size -= pos;
+        pos = 0;
+    }
+    if (size == capacity) {
+        char *new_data = (char *) realloc(data, 2 * capacity);
+        if (!new_data) {
+            fprintf(stderr, "Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        data = new_data;
+        capacity *= 2;
+    }
+
+    ssize_t bytes_read = 0;
+    do {
+        bytes_read = read(fd, data + size, capacity - size);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        if (bytes_read < 0) perror("Failed to read script");
+        eof = true;
+        return false;
+    }
+    size += (size_t) bytes_read;
+    return true;
+}
+
+bool scriptReader::next_line(const char **line, size_t *length) {
+    assert(line); assert(length);
+    size_t searched = pos;
+    while (true) {
+        const char *newline = (const char *) memchr(data + searched, '\n', size - searched);
+        if (newline) {
+            *line = data + pos;
+            *length = size_t(newline - (data + pos));
+            pos += *length + 1;
+            return true;
+        }
+
+        searched = size - pos; // fill() moves unfinished line to the beginning
+        if (!fill()) break;
+        searched += pos;
+    }
+
+    // last line without '\n'
+    if (pos == size) return false;
+    *line = data + pos;
+    *length = size - pos;
+    pos = size;
+    return true;
+}
+
+void scriptReader::sync_position() {
+    if (mapped) lseek(fd, (off_t) pos, SEEK_SET);
+}
+
+void scriptReader::reload_position() {
+    if (!mapped) return;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset >= 0 && (size_t) offset <= size) pos = (size_t) offset;
+}
+
+/* ==================== PROCESS ABSTRACTION ====================== */
+MicroBashStatus proc_t::open_redirects(int *in_fd, int *out_fd) const {
+    assert(in_fd); assert(out_fd);
+    *in_fd = *out_fd = -1;
 
-    // redirections have higher priority than pipes
     if (redirected_in) {
-        int in_fd = open(redirected_in, O_RDONLY);
-        if (in_fd < 0) {
+        *in_fd = open(redirected_in, O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
             execerr("microBash: failed to open '%s':'%s'\n", redirected_in, strerror(errno));
             return EXEC_NO_FILE;
         }
-        dup2(in_fd, STDIN_FD);
-        close(in_fd);
     }
 
     if (redirected_out) {
-        umask(0);
-        int out_fd = open(redirected_out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (out_fd < 0) {
-            execerr("microBash: failed to open '%s':'%s'\n", redirected_out, strerror(errno));
+        // created files are rw for everyone, shell umask is kept for its other children
+        mode_t old_mask = umask(0);
+        *out_fd = open(redirected_out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        int open_errno = errno;
+        umask(old_mask);
+        if (*out_fd < 0) {
+            execerr("microBash: failed to open '%s':'%s'\n", redirected_out, strerror(open_errno));
+            if (*in_fd >= 0) close(*in_fd);
+            *in_fd = -1;
             return EXEC_NO_FILE;
         }
-        dup2(out_fd, STDOUT_FD);
-        close(out_fd);
     }
 
-    // executing
-    if (pass) return SUCCESS;
+    return SUCCESS;
+}
+
+MicroBashStatus proc_t::spawn(pipe_fd in, pipe_fd out, const posix_spawnattr_t *attr, pathCache *commands, pid_t *pid) {
+    assert(commands); assert(pid);
+    *pid = -1;
+
+    int in_fd = -1, out_fd = -1;
+    MicroBashStatus status = open_redirects(&in_fd, &out_fd);
+    if (status != SUCCESS || pass) {
+        if (in_fd >= 0) close(in_fd);
+        if (out_fd >= 0) close(out_fd);
+        return status;
+    }
+
+    // redirections have higher priority than pipes
+    int stdin_src  = (in_fd >= 0)  ? in_fd  : (in.valid())          ? in.read_fd   : -1;
+    int stdout_src = (out_fd >= 0) ? out_fd : (pipe && out.valid()) ? out.write_fd : -1;
+
+    // all other descriptors of shell are O_CLOEXEC
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_src >= 0) posix_spawn_file_actions_adddup2(&actions, stdin_src, STDIN_FD);
+    if (stdout_src >= 0) posix_spawn_file_actions_adddup2(&actions, stdout_src, STDOUT_FD);
+
     if (argv.back() != nullptr) argv.push_back(nullptr); // last argument must be nullptr
-    if (execvp(argv[0], (char * const *)argv.data()) < 0) {
-        execerr("microBash: failed to execute '%s':'%s'\n", argv[0], strerror(errno));
+
+    timespec start = {}, end = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char * const *args = (char * const *)argv.data();
+    const char *path = commands->lookup(argv[0]);
+    int code = (path) ? posix_spawn(pid, path, &actions, attr, args, environ) : ENOENT;
+    if (path && code == ENOENT && path != argv[0]) {
+        // cached file was removed or moved
+        commands->forget(argv[0]);
+        path = commands->lookup(argv[0]);
+        code = (path) ? posix_spawn(pid, path, &actions, attr, args, environ) : ENOENT;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    spawn_time = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    posix_spawn_file_actions_destroy(&actions);
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+
+    if (code != 0) {
+        *pid = -1;
+        execerr("microBash: failed to execute '%s':'%s'\n", argv[0], strerror(code));
         return EXEC_FAIL;
     }
     return SUCCESS;
@@ -104,6 +358,7 @@ const char * Token::keyword_to_string(Keyword kword) {
         case Keyword::PIPE: return "PIPE";
         case Keyword::REDIRECT_IN: return "REDIR_IN";
         case Keyword::REDIRECT_OUT: return "REDIR_OUT";
+        case Keyword::BACKGROUND: return "BACKGROUND";
         default: return "UNKNOWN";
     }
 }
@@ -116,6 +371,8 @@ Keyword Token::getKeywordFromSymbol(const char symbol) {
             return Keyword::REDIRECT_IN;
         case REDIRECT_OUT:
             return Keyword::REDIRECT_OUT;
+        case BACKGROUND:
+            return Keyword::BACKGROUND;
         default:
             return Keyword::NOT_KEYWORD;
     }
@@ -138,26 +395,262 @@ void Token::print() const {
     }
 }
 /* ============================ microBash ============================ */
+microBash::microBash(bool report_timing_): tokenizer(), proc(), report_timing(report_timing_),
+                                           foreground(), jobs(), spawn_attr(), commands() {
+    // SIGCHLD is read from signalfd, so it must be blocked in shell and unblocked in children
+    sigset_t child_mask, shell_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &child_mask, &shell_mask) < 0) {
+        perror("Failed to block SIGCHLD");
+        exit(EXIT_FAILURE);
+    }
+
+    sigchld_fd = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd < 0) {
+        perror("Failed to create signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    posix_spawnattr_init(&spawn_attr);
+    posix_spawnattr_setsigmask(&spawn_attr, &shell_mask);
+    posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSIGMASK);
+}
+
+microBash::~microBash() {
+    posix_spawnattr_destroy(&spawn_attr);
+    close(sigchld_fd);
+}
+
+void microBash::reap_children() {
+    // signals are merged, so signalfd is only drained and every exited child is collected by waitpid
+    signalfd_siginfo info = {};
+    while (read(sigchld_fd, &info, sizeof(info)) > 0) {}
+
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
+        errprintf("Reaped %d\n", (int) pid);
+        auto remove_pid = [pid](job_t& job) {
+            for (size_t idx = 0; idx < job.pids.size(); idx++) {
+                if (job.pids[idx] == pid) {
+                    job.pids[idx] = job.pids.back();
+                    job.pids.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        if (remove_pid(foreground)) continue;
+        for (size_t job_idx = 0; job_idx < jobs.size(); job_idx++) {
+            if (!remove_pid(jobs[job_idx])) continue;
+            if (jobs[job_idx].pids.empty()) {
+                if (interactive) fprintf(stderr, "[%d] Done\t%s\n", jobs[job_idx].id, jobs[job_idx].command);
+                jobs.erase(jobs.begin() + (long) job_idx);
+            }
+            break;
+        }
+    }
+}
+
+bool microBash::wait_event(int fd) {
+    pollfd fds[2] = {{fd, POLLIN, 0}, {sigchld_fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) return false;
+        perror("Failed to poll");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fds[1].revents & POLLIN) reap_children();
+    return fds[0].revents != 0;
+}
+
+/* ============================ builtins ============================= */
+const builtinCommand microBash::BUILTINS[] = {
+    {"echo",  &microBash::builtin_echo},
+    {"true",  &microBash::builtin_true},
+    {"false", &microBash::builtin_false},
+    {"pwd",   &microBash::builtin_pwd},
+    {"cd",    &microBash::builtin_cd},
+    {"jobs",  &microBash::builtin_jobs},
+    {"wait",  &microBash::builtin_wait},
+    {"hash",  &microBash::builtin_hash},
+};
+
+int microBash::find_builtin(const char *name) {
+    assert(name);
+    for (size_t idx = 0; idx < sizeof(BUILTINS) / sizeof(BUILTINS[0]); idx++) {
+        if (strcmp(BUILTINS[idx].name, name) == 0) return (int) idx;
+    }
+    return -1;
+}
+
+void microBash::run_builtin(proc_t& process) {
+    assert(process.builtin >= 0);
+    int in_fd = -1, out_fd = -1;
+    if (process.open_redirects(&in_fd, &out_fd) != SUCCESS) return;
+
+    BUILTINS[process.builtin].run(*this, process, (out_fd >= 0) ? out_fd : STDOUT_FD);
+
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+}
+
+MicroBashStatus microBash::fork_builtin(proc_t& process, pipe_fd in, pipe_fd out, pid_t *pid) {
+    assert(process.builtin >= 0); assert(pid);
+    *pid = -1;
+
+    int in_fd = -1, out_fd = -1;
+    MicroBashStatus status = process.open_redirects(&in_fd, &out_fd);
+    if (status != SUCCESS) return status;
+
+    timespec start = {}, end = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *pid = fork();
+    if (*pid == 0) {
+        in_child = true;
+        in.close(); // builtins don't read stdin
+        int stdout_fd = (out_fd >= 0) ? out_fd : (process.pipe && out.valid()) ? out.write_fd : STDOUT_FD;
+        _exit(BUILTINS[process.builtin].run(*this, process, stdout_fd));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    process.spawn_time = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+
+    if (*pid < 0) {
+        execerr("Failed to fork:%s\n", strerror(errno));
+        return FORK_ERROR;
+    }
+    return SUCCESS;
+}
+
+int microBash::builtin_echo(microBash&, const proc_t& process, int out_fd) {
+    size_t first = 1;
+    bool newline = true;
+    if (process.argv.size() > 1 && process.argv[1] && strcmp(process.argv[1], "-n") == 0) {
+        newline = false;
+        first = 2;
+    }
+
+    // one write for whole line, so output of concurrent jobs isn't mixed inside line
+    size_t length = 0;
+    for (size_t idx = first; idx < process.argv.size() && process.argv[idx]; idx++) {
+        length += strlen(process.argv[idx]) + 1;
+    }
+
+    memoryArena line(length + 1);
+    char *line_ptr = (char *) line.data();
+    for (size_t idx = first; idx < process.argv.size() && process.argv[idx]; idx++) {
+        size_t arg_length = strlen(process.argv[idx]);
+        memcpy(line_ptr, process.argv[idx], arg_length);
+        line_ptr += arg_length;
+        *line_ptr++ = ' ';
+    }
+    if (line_ptr != line.data()) line_ptr--; // last separator
+    if (newline) *line_ptr++ = '\n';
+
+    length = size_t(line_ptr - (char *) line.data());
+    return (write(out_fd, line.data(), length) == (ssize_t) length) ? 0 : 1;
+}
+
+int microBash::builtin_true(microBash&, const proc_t&, int) { return 0; }
+
+int microBash::builtin_false(microBash&, const proc_t&, int) { return 1; }
+
+int microBash::builtin_pwd(microBash&, const proc_t&, int out_fd) {
+    char path[PATH_MAX] = "";
+    if (!getcwd(path, sizeof(path))) {
+        execerr("pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    dprintf(out_fd, "%s\n", path);
+    return 0;
+}
+
+int microBash::builtin_cd(microBash&, const proc_t& process, int) {
+    const char *path = (process.argv.size() > 1 && process.argv[1]) ? process.argv[1] : getenv("HOME");
+    if (!path) {
+        execerr("cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(path) < 0) {
+        execerr("cd: '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char cwd[PATH_MAX] = "";
+    if (getcwd(cwd, sizeof(cwd))) setenv("PWD", cwd, 1);
+    return 0;
+}
+
+int microBash::builtin_jobs(microBash& bash, const proc_t&, int out_fd) {
+    for (const job_t& job: bash.jobs) {
+        dprintf(out_fd, "[%d] Running\t%s\n", job.id, job.command);
+    }
+    return 0;
+}
+
+int microBash::builtin_wait(microBash& bash, const proc_t&, int) {
+    // jobs of forked builtin belong to shell
+    if (bash.in_child) return 0;
+    while (!bash.jobs.empty()) bash.wait_event(-1);
+    return 0;
+}
+
+int microBash::builtin_hash(microBash& bash, const proc_t& process, int out_fd) {
+    if (process.argv.size() < 2 || !process.argv[1]) {
+        bash.commands.print(out_fd);
+        return 0;
+    }
+
+    if (strcmp(process.argv[1], "-r") == 0) {
+        bash.commands.clear();
+        return 0;
+    }
+
+    int status = 0;
+    for (size_t idx = 1; idx < process.argv.size() && process.argv[idx]; idx++) {
+        bash.commands.forget(process.argv[idx]);
+        if (!bash.commands.lookup(process.argv[idx])) {
+            execerr("hash: %s: not found\n", process.argv[idx]);
+            status = 1;
+        }
+    }
+    return status;
+}
 
 /**
  * @brief Parse cmd creating vector of tokens (pointer to string argument or microBash keyword)
 */
-MicroBashStatus microBash::tokenize_cmd(const char *cmd) {
+MicroBashStatus microBash::tokenize_cmd(const char *cmd, size_t length) {
+    if (length >= MAX_CMD_SIZE) {
+        syntaxerr("Syntax error: command is longer than %u bytes\n", MAX_CMD_SIZE - 1);
+        return BAD_INPUT;
+    }
+
+    const char *cmd_end = cmd + length;
+    for (const char *cmd_ptr = cmd; cmd_ptr < cmd_end;) {
+        if (size_t(tokenizer.arg_ptr - tokenizer.arg_buffer) >= MAX_ARG_SIZE - 1) {
+            syntaxerr("Syntax error: argument is longer than %u bytes\n", MAX_ARG_SIZE - 1);
+            return BAD_INPUT;
+        }
 
-    for (const char *cmd_ptr = cmd; *cmd_ptr != '\0';) {
         // quoted string
         if (*cmd_ptr == '"') {
             tokenizer.in_arg = true;
             tokenizer.quoted = true;
             cmd_ptr++;
-            while (*cmd_ptr && *cmd_ptr != '"') {
+            while (cmd_ptr < cmd_end && *cmd_ptr != '"' &&
+                   size_t(tokenizer.arg_ptr - tokenizer.arg_buffer) < MAX_ARG_SIZE - 1) {
                 tokenizer.push_symbol(*cmd_ptr);
                 cmd_ptr++;
             }
 
-            if (*cmd_ptr == '"') {
+            if (cmd_ptr < cmd_end && *cmd_ptr == '"') {
                 cmd_ptr++;
-            } else {
+            } else if (cmd_ptr == cmd_end) {
                 syntaxerr("Syntax error: unclosed qoutes\n");
                 return BAD_INPUT;
             }
@@ -175,7 +668,7 @@ MicroBashStatus microBash::tokenize_cmd(const char *cmd) {
         } else {
             tokenizer.push_arg();
 
-            while (*cmd_ptr && isspace(*cmd_ptr)) {
+            while (cmd_ptr < cmd_end && isspace(*cmd_ptr)) {
                 cmd_ptr++;
             }
         }
@@ -190,8 +683,18 @@ MicroBashStatus microBash::tokenize_cmd(const char *cmd) {
 /// Process is an argv vector + redirected in/out paths + additional info
 MicroBashStatus microBash::parse_tokens() {
     std::vector<Token>& tokens = tokenizer.tokens;
+    background = false;
     if (tokens.empty()) return SUCCESS;
 
+    if (tokens.back().isKeyword(Keyword::BACKGROUND)) {
+        background = true;
+        tokens.pop_back();
+        if (tokens.empty()) {
+            syntaxerr("Syntax error: no command before &\n");
+            return SYNTAX_ERROR;
+        }
+    }
+
     if (tokens.front().isKeyword(Keyword::EXIT)) {
         return EXIT;
     }
@@ -231,9 +734,13 @@ MicroBashStatus microBash::parse_tokens() {
                         return SYNTAX_ERROR;
                     }
                     current.pipe = true;
+                    current.builtin = find_builtin(current.argv[0]);
                     proc.push_back(current);
                     current = proc_t();
                     break;
+                case Keyword::BACKGROUND:
+                    syntaxerr("Syntax error: & must end command\n");
+                    return SYNTAX_ERROR;
                 case Keyword::NOT_KEYWORD:
                 default:
                     syntaxerr("Unknown keyword: tokens[%zu] = %d\n", idx, (int)tokens[idx].kword_);
@@ -244,7 +751,10 @@ MicroBashStatus microBash::parse_tokens() {
         }
     }
 
-    if (!current.argv.empty()) proc.push_back(current);
+    if (!current.argv.empty()) {
+        current.builtin = find_builtin(current.argv[0]);
+        proc.push_back(current);
+    }
 
     return SUCCESS;
 }
@@ -253,9 +763,23 @@ MicroBashStatus microBash::parse_tokens() {
 MicroBashStatus microBash::execute_cmd() {
     if (proc.empty()) return SUCCESS;
 
+    // builtin alone in foreground doesn't need process
+    if (proc.size() == 1 && proc[0].builtin >= 0 && !proc[0].pass && !background) {
+        run_builtin(proc[0]);
+        if (report_timing) fprintf(stderr, "spawn[0] '%s': builtin, no process\n", proc[0].argv[0]);
+        return SUCCESS;
+    }
+
     const pipe_fd invalid = pipe_fd{};
     pipe_fd in = invalid, out = invalid;
 
+    job_t job;
+    for (size_t proc_idx = 0, used = 0; proc_idx < proc.size() && used < JOB_COMMAND_SIZE; proc_idx++) {
+        int printed = snprintf(job.command + used, JOB_COMMAND_SIZE - used, "%s%s",
+                               (proc_idx == 0) ? "" : " | ", proc[proc_idx].argv[0]);
+        if (printed > 0) used += (size_t) printed;
+    }
+
     for (size_t proc_idx = 0; proc_idx < proc.size(); proc_idx++) {
         in.close();
         in = out;
@@ -264,76 +788,118 @@ MicroBashStatus microBash::execute_cmd() {
         else
             out = invalid;
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            execerr("Failed to fork:%s\n", strerror(errno));
-            return FORK_ERROR;
-        } else if (pid == 0) {
-            exit(proc[proc_idx].execute(in, out));
-        }
-
+        // failed stage is skipped like before: its neighbours see closed pipe
+        pid_t pid = -1;
+        if (proc[proc_idx].builtin >= 0 && !proc[proc_idx].pass) fork_builtin(proc[proc_idx], in, out, &pid);
+        else proc[proc_idx].spawn(in, out, &spawn_attr, &commands, &pid);
+        errprintf("Spawned %d\n", (int) pid);
+        if (pid > 0) job.pids.push_back(pid);
     }
 
     in.close();
-    pid_t closed_pid = 0;
-    while ((closed_pid = wait(NULL)) != -1) {}
-    errprintf("Status: all processes ended\n");
+
+    if (background) {
+        if (!job.pids.empty()) {
+            job.id = (jobs.empty()) ? 1 : jobs.back().id + 1;
+            if (interactive) fprintf(stderr, "[%d] %d\n", job.id, job.pids.back());
+            jobs.push_back(job);
+        }
+    } else {
+        // other jobs are reaped too while foreground pipeline runs
+        std::swap(foreground.pids, job.pids);
+        reap_children();
+        while (!foreground.pids.empty()) wait_event(-1);
+        errprintf("Status: all processes ended\n");
+    }
+
+    if (report_timing) {
+        for (size_t proc_idx = 0; proc_idx < proc.size(); proc_idx++) {
+            const proc_t& stage = proc[proc_idx];
+            if (stage.pass) fprintf(stderr, "spawn[%zu]: no process\n", proc_idx);
+            else fprintf(stderr, "spawn[%zu] '%s': %.1f us\n", proc_idx, stage.argv[0], stage.spawn_time * 1e6);
+        }
+    }
 
     return SUCCESS;
 }
 
 
 /*======================== Core microBash function ============================*/
+MicroBashStatus microBash::run_cmd(const char *cmd, size_t length) {
+    // clearing previous arguments, arena memory is reused
+    tokenizer.clear();
+    proc.clear();
+
+    // tokenization
+    MicroBashStatus status = tokenize_cmd(cmd, length);
+    if (status != SUCCESS) return status;
+
+    errprintf("Done: tokenization\n");
+
+    #ifdef LOGGING
+    for (const Token& token: tokenizer.tokens) {
+        token.print();
+    }
+    errprintf("\n");
+    #endif
+
+    // creating array of processes
+    status = parse_tokens();
+    errprintf("Done: token parsing (%d)\n", (int) status);
+    if (status != SUCCESS) return status;
+
+    #ifdef LOGGING
+    for (const proc_t& process: proc) {
+        errprintf("argc = %zu;", process.argv.size());
+        for (const char *arg: process.argv) {
+            errprintf("'%s' ", arg);
+        }
+        errprintf("\n");
+    }
+    #endif
+
+    // executing processes
+    status = execute_cmd();
+
+    errprintf("Done: execution (%d)\n", (int) status);
+    return status;
+}
+
 /// @brief microBash execute loop
 void microBash::run() {
     char buffer[MAX_CMD_SIZE];
 
+    // unbuffered stdin can be polled together with signalfd: finished jobs are reaped while shell
+    // waits for input. Terminal gives one line per read anyway
+    setvbuf(stdin, nullptr, _IONBF, 0);
+    interactive = true;
+
     while (true) {
         // printing prompt and reading user input
         print_propmt();
+        while (!wait_event(STDIN_FD)) {}
         bool continue_read = fgets(buffer, MAX_CMD_SIZE, stdin);
         if (!continue_read) break;
 
-        // clearing previous arguments
-        tokenizer.clear();
-        proc.clear();
-
-        // tokenization
-        MicroBashStatus status = tokenize_cmd(buffer);
-        if (status != SUCCESS) continue;
-
-        errprintf("Done: tokenization\n");
-
-        #ifdef LOGGING
-        for (const Token& token: tokenizer.tokens) {
-            token.print();
-        }
-        errprintf("\n");
-        #endif
+        if (run_cmd(buffer, strlen(buffer)) == EXIT) break;
+    }
 
-        // creating array of processes
-        status = parse_tokens();
-        errprintf("Done: token parsing (%d)\n", (int) status);
-        if (status == EXIT) {
-            break;
-        } else if (status != SUCCESS) {
-            continue;
-        }
+    // like bash, shell quits at once: jobs still running are left to init, finished ones are reported
+    reap_children();
+}
 
-        #ifdef LOGGING
-        for (const proc_t& process: proc) {
-            errprintf("argc = %zu;", process.argv.size());
-            for (const char *arg: process.argv) {
-                errprintf("'%s' ", arg);
-            }
-            errprintf("\n");
-        }
-        #endif
+void microBash::run_script(int fd) {
+    scriptReader script(fd);
 
-        // executing processes
-        status = execute_cmd();
+    const char *line = nullptr;
+    size_t length = 0;
+    while (script.next_line(&line, &length)) {
+        // commands reading stdin continue after current line and script continues after them
+        if (fd == STDIN_FD) script.sync_position();
+        if (run_cmd(line, length) == EXIT) break;
+        if (fd == STDIN_FD) script.reload_position();
 
-        errprintf("Done: execution (%d)\n", (int) status);
+        reap_children();
     }
-
+    // background jobs keep running after script ends, 'wait' waits for them explicitly
 }
@@ -4,6 +4,15 @@
 #include <stdlib.h>
 #include <cctype>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 #include <cstring>
@@ -12,6 +21,10 @@
 
 constexpr unsigned MAX_CMD_SIZE = 16384; ///< maximum length of command line string in bytes
 constexpr unsigned MAX_ARG_SIZE = 2048; ///< maximum length of one argument in bytes
+constexpr size_t SCRIPT_CHUNK = 1 << 20; ///< scripts which can't be mapped are read by chunks of this size
+constexpr size_t JOB_COMMAND_SIZE = 128; ///< length of command description in job table
+constexpr size_t PATH_CACHE_START = 64;  ///< starting number of slots in command path cache
+constexpr const char *DEFAULT_PATH = "/bin:/usr/bin"; ///< used when PATH is unset, like execvp
 
 const int STDOUT_FD = 1;
 const int STDIN_FD = 0;
@@ -66,6 +79,73 @@ struct pipe_fd {
 
 pipe_fd pipe_create();
 
+/// @brief Cache name -> absolute path of commands found in PATH, like bash hash table
+/// Whole cache is dropped when PATH changes, single entry is forgotten when its file disappears
+class pathCache {
+    struct entry {
+        char *name = nullptr;   ///< nullptr for empty slot
+        char *path = nullptr;   ///< nullptr for forgotten command
+        unsigned hits = 0;
+    };
+
+    std::vector<entry> slots;
+    size_t used = 0;
+    char *path_env = nullptr;   ///< PATH which cached commands were found with
+    char scratch[PATH_MAX];     ///< candidate path, also result for commands in relative PATH entries
+
+    size_t find_slot(const char *name) const;
+    void grow();
+    void check_path_env();
+    const char *search(const char *name);
+public:
+    pathCache(): slots(PATH_CACHE_START), scratch() {}
+    ~pathCache();
+
+    pathCache(const pathCache&) = delete;
+    pathCache& operator=(const pathCache&) = delete;
+
+    /// @brief Path to execute command name, nullptr if it isn't found in PATH
+    /// Result is valid until next call; names with '/' are returned as is
+    const char *lookup(const char *name);
+
+    /// @brief Search name in PATH again next time
+    void forget(const char *name);
+
+    void clear();
+
+    /// @brief Print cached commands like bash 'hash'
+    void print(int out_fd) const;
+};
+
+/// @brief Line reader for batch mode: regular files are mapped whole, streams are read by big chunks
+class scriptReader {
+    int fd = -1;
+    char *data = nullptr;   ///< mapped file or read buffer
+    size_t size = 0;        ///< bytes of script in data
+    size_t capacity = 0;    ///< size of read buffer
+    size_t pos = 0;         ///< start of next line
+    bool mapped = false;
+    bool eof = false;
+
+    bool fill();
+public:
+    scriptReader(int fd_);
+    ~scriptReader();
+
+    scriptReader(const scriptReader&) = delete;
+    scriptReader& operator=(const scriptReader&) = delete;
+
+    /// @brief Get next line without '\n' (not null-terminated); false at the end of script
+    bool next_line(const char **line, size_t *length);
+
+    /// @brief Seek fd shared with children (stdin) to the next line, so commands reading stdin
+    /// start after script lines consumed by shell. Only seekable input can be synced
+    void sync_position();
+
+    /// @brief Continue script where commands that read shared fd stopped
+    void reload_position();
+};
+
 enum MicroBashStatus {
     SUCCESS = 0,
     BAD_INPUT,          ///< unclosed quotes
@@ -74,7 +154,7 @@ enum MicroBashStatus {
     FORK_ERROR,
     EXIT,               ///< exit command
     EXEC_NO_FILE = 245, ///< Redirected in/out file can't be opened
-    EXEC_FAIL,          ///< Execvp fail
+    EXEC_FAIL,          ///< posix_spawn fail
 };
 
 /// @brief Process abstraction
@@ -86,10 +166,27 @@ struct proc_t {
     bool pass = false; ///< don't execute this process (i.e. echo abc | exit -> exit does nothing)
     const char *redirected_in  = nullptr; ///< Path for redirected stdin
     const char *redirected_out = nullptr; ///< Path for redirected stdout
+    double spawn_time = 0;                ///< seconds spent starting process, reported with -t
+    int builtin = -1;                     ///< index in microBash::BUILTINS, -1 for external command
 
     proc_t(): argv() {}
 
-    MicroBashStatus execute(pipe_fd in, pipe_fd out);
+    /// @brief Open redirected files in shell, so errors are reported before process is started
+    MicroBashStatus open_redirects(int *in_fd, int *out_fd) const;
+
+    /// @brief Start process without forking shell: pipe ends and redirections are installed by
+    /// posix_spawn file actions. Pass process only opens its redirections, pid is -1 then
+    /// Executable is taken from commands cache, stale entry is searched again once
+    MicroBashStatus spawn(pipe_fd in, pipe_fd out, const posix_spawnattr_t *attr, pathCache *commands, pid_t *pid);
+};
+
+/// @brief Pipeline which processes are not reaped yet
+struct job_t {
+    int id = 0;                         ///< number of background job, 0 for foreground pipeline
+    std::vector<pid_t> pids;            ///< running processes
+    char command[JOB_COMMAND_SIZE] = {};
+
+    job_t(): pids() {}
 };
 
 
@@ -104,7 +201,8 @@ enum class Keyword {
     EXIT,
     PIPE,
     REDIRECT_IN,
-    REDIRECT_OUT
+    REDIRECT_OUT,
+    BACKGROUND,
 };
 
 struct Token {
@@ -112,6 +210,7 @@ struct Token {
     constexpr static const char PIPE_DELIMETER = '|';
     constexpr static const char REDIRECT_IN = '<';
     constexpr static const char REDIRECT_OUT = '>';
+    constexpr static const char BACKGROUND = '&';
 
     constexpr static const char * const EXIT_COMMAND = "exit";
 
@@ -205,23 +304,79 @@ struct tokenizerContext {
     }
 };
 
+struct microBash;
+
+/// @brief Command run by shell itself; output goes to out_fd, returns exit status
+struct builtinCommand {
+    const char *name;
+    int (*run)(microBash& bash, const proc_t& process, int out_fd);
+};
+
 struct microBash {
 
 private:
+    static const builtinCommand BUILTINS[];
+
     tokenizerContext tokenizer;
     std::vector<proc_t> proc;
-
-
-    MicroBashStatus tokenize_cmd(const char *cmd);
+    bool report_timing;         ///< print spawn latency of every stage
+    bool interactive = false;   ///< report started and finished background jobs
+    bool background = false;    ///< current command ends with '&'
+
+    job_t foreground;
+    std::vector<job_t> jobs;    ///< background jobs in order of start
+    int sigchld_fd = -1;        ///< signalfd of blocked SIGCHLD, reaping is driven by it
+    posix_spawnattr_t spawn_attr;   ///< children are started with SIGCHLD unblocked
+    pathCache commands;
+    bool in_child = false;      ///< shell is forked to run builtin of pipeline
+
+    MicroBashStatus tokenize_cmd(const char *cmd, size_t length);
     MicroBashStatus parse_tokens();
     MicroBashStatus execute_cmd();
 
+    /// @brief Index of argv[0] in BUILTINS or -1
+    static int find_builtin(const char *name);
+
+    /// @brief Run builtin alone in foreground in shell, so cd and wait affect shell itself
+    void run_builtin(proc_t& process);
+
+    /// @brief Run builtin of pipeline or background job in forked child without exec
+    MicroBashStatus fork_builtin(proc_t& process, pipe_fd in, pipe_fd out, pid_t *pid);
+
+    static int builtin_echo (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_true (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_false(microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_pwd  (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_cd   (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_jobs (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_wait (microBash& bash, const proc_t& process, int out_fd);
+    static int builtin_hash (microBash& bash, const proc_t& process, int out_fd);
+
+    /// @brief Reap all exited children without blocking and update job table
+    void reap_children();
+
+    /// @brief Sleep in poll until child exits or fd (ignored if -1) is readable; exited children
+    /// are reaped. Returns true if fd is readable
+    bool wait_event(int fd);
+
     void print_propmt() {
         fprintf(stderr, "$ "); //printing to stderr because of line buffering
     }
+
+    /// @brief Tokenize, parse and execute one command line; returns EXIT on exit command
+    MicroBashStatus run_cmd(const char *cmd, size_t length);
 public:
-    microBash(): tokenizer(), proc() {}
+    microBash(bool report_timing_=false);
+    ~microBash();
 
+    microBash(const microBash&) = delete;
+    microBash& operator=(const microBash&) = delete;
 
+
+    /// @brief Interactive loop: prompt and read line by line until exit or end of input
+    /// Background jobs are not waited for, they keep running after shell quits
     void run();
+
+    /// @brief Batch mode: run every line of script fd without prompt, background jobs are not waited for
+    void run_script(int fd);
 };